@@ -22,20 +22,123 @@
 #include <errno.h>
 #include <sys/mman.h>
 #include <inttypes.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#if DRM_HOTPLUG
+#include <linux/netlink.h>
+#endif
 
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 #include <drm_fourcc.h>
 
+#include "drm_blit.h"
+
 #define DBG_TAG "drm"
 
+#ifndef DRM_NONBLOCK
+#define DRM_NONBLOCK 0
+#endif
+
+#ifndef DRM_BUFFERS
+#define DRM_BUFFERS 2
+#endif
+
+#ifndef DRM_DIRECT_RENDER
+#define DRM_DIRECT_RENDER 0
+#endif
+
+#ifndef DRM_OUTPUTS
+#define DRM_OUTPUTS 1
+#endif
+
+#ifndef DRM_MODE_WIDTH
+#define DRM_MODE_WIDTH 0
+#endif
+
+#ifndef DRM_MODE_HEIGHT
+#define DRM_MODE_HEIGHT 0
+#endif
+
+#ifndef DRM_MODE_REFRESH
+#define DRM_MODE_REFRESH 0
+#endif
+
+#ifndef DRM_RENDER_WIDTH
+#define DRM_RENDER_WIDTH 0
+#endif
+
+#ifndef DRM_RENDER_HEIGHT
+#define DRM_RENDER_HEIGHT 0
+#endif
+
+#ifndef DRM_CURSOR
+#define DRM_CURSOR 0
+#endif
+
+#ifndef DRM_LAYERS
+#define DRM_LAYERS 0
+#endif
+
+#ifndef DRM_EXPORT
+#define DRM_EXPORT 0
+#endif
+
+#ifndef DRM_EXPORT_SOCKET
+#define DRM_EXPORT_SOCKET "/tmp/lv_drm.sock"
+#endif
+
+#ifndef DRM_WRITEBACK
+#define DRM_WRITEBACK 0
+#endif
+
+#ifndef DRM_HOTPLUG
+#define DRM_HOTPLUG 0
+#endif
+
+#if DRM_OUTPUTS < 1 || DRM_OUTPUTS + DRM_LAYERS > 32
+#error DRM_OUTPUTS must be 1..32 with DRM_LAYERS at most 32 in total
+#endif
+
+#define DRM_BUFFERS_MAX 4
+
 #define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
 
+/* Number of refreshes whose damage is remembered to bring an older buffer up to date */
+#define DRM_DAMAGE_HISTORY 8
+
+/* Areas remembered per refresh, more are merged */
+#define DRM_DAMAGE_MAX 16
+
+/* Consumers of the exported buffers served at once */
+#define DRM_EXPORT_CLIENTS 4
+
 #define print(msg, ...)	fprintf(stderr, msg, ##__VA_ARGS__);
 #define err(msg, ...)  print("error: " msg "\n", ##__VA_ARGS__)
 #define info(msg, ...) print(msg "\n", ##__VA_ARGS__)
 #define dbg(msg, ...)  {} //print(DBG_TAG ": " msg "\n", ##__VA_ARGS__)
 
+#if DRM_NONBLOCK
+#define drm_lock()	pthread_mutex_lock(&drm_dev.lock)
+#define drm_unlock()	pthread_mutex_unlock(&drm_dev.lock)
+#else
+#define drm_lock()	do {} while (0)
+#define drm_unlock()	do {} while (0)
+#endif
+
+enum drm_buffer_state {
+	DRM_BUF_FREE,		/* can be rendered to */
+	DRM_BUF_BACK,		/* a refresh is being rendered to it */
+	DRM_BUF_QUEUED,		/* waiting to be committed or for its page flip */
+	DRM_BUF_SCANOUT,	/* on the screen */
+};
+
+struct drm_damage {
+	lv_area_t areas[DRM_DAMAGE_MAX];
+	uint32_t cnt;
+};
+
 struct drm_buffer {
 	uint32_t handle;
 	uint32_t pitch;
@@ -43,752 +146,3443 @@ struct drm_buffer {
 	unsigned long int size;
 	void * map;
 	uint32_t fb_handle;
+	uint32_t frame; /* output's frame when the content was last updated */
+	enum drm_buffer_state state;
+	uint32_t refr_flips; /* output's flips when its refresh started */
+	uint64_t flush_us; /* when its refresh was flushed, 0 if it's shown again */
+	unsigned int vblank_seq; /* first vblank it could be shown from, 0 if unknown */
+	uint32_t damage_blob; /* FB_DAMAGE_CLIPS blob of blob_damage, 0 if none */
+	struct drm_damage blob_damage;
 };
 
-struct drm_dev {
-	int fd;
+/*
+ * Plane formats in the order of preference: the ones LVGL renders, then the
+ * ones its pixels are converted to while they are copied to the buffers.
+ */
+static const struct drm_format {
+	uint32_t fourcc;
+	uint32_t bpp;
+} drm_formats[] = {
+#if LV_COLOR_DEPTH == 32
+	{ DRM_FORMAT_ARGB8888, 32 },
+	{ DRM_FORMAT_XRGB8888, 32 },
+	{ DRM_FORMAT_RGB888, 24 },
+	{ DRM_FORMAT_XRGB2101010, 32 },
+#elif LV_COLOR_DEPTH == 16
+	{ DRM_FORMAT_RGB565, 16 },
+#if LV_COLOR_16_SWAP == 0
+	{ DRM_FORMAT_XRGB8888, 32 },
+	{ DRM_FORMAT_RGB888, 24 },
+	{ DRM_FORMAT_XRGB2101010, 32 },
+#endif
+#else
+#error LV_COLOR_DEPTH not supported
+#endif
+};
+
+/* IDs of the properties the driver sets */
+struct drm_plane_props {
+	uint32_t fb_id, crtc_id;
+	uint32_t src_x, src_y, src_w, src_h;
+	uint32_t crtc_x, crtc_y, crtc_w, crtc_h;
+	uint32_t fb_damage_clips; /* 0 if the plane has none */
+};
+
+struct drm_crtc_props {
+	uint32_t mode_id, active;
+};
+
+struct drm_conn_props {
+	uint32_t crtc_id;
+};
+
+struct drm_prop_name {
+	const char *name;
+	size_t offset; /* of the ID in the struct of the object's properties */
+	bool optional;
+};
+
+static const struct drm_prop_name drm_plane_prop_names[] = {
+	{ "FB_ID", offsetof(struct drm_plane_props, fb_id), false },
+	{ "CRTC_ID", offsetof(struct drm_plane_props, crtc_id), false },
+	{ "SRC_X", offsetof(struct drm_plane_props, src_x), false },
+	{ "SRC_Y", offsetof(struct drm_plane_props, src_y), false },
+	{ "SRC_W", offsetof(struct drm_plane_props, src_w), false },
+	{ "SRC_H", offsetof(struct drm_plane_props, src_h), false },
+	{ "CRTC_X", offsetof(struct drm_plane_props, crtc_x), false },
+	{ "CRTC_Y", offsetof(struct drm_plane_props, crtc_y), false },
+	{ "CRTC_W", offsetof(struct drm_plane_props, crtc_w), false },
+	{ "CRTC_H", offsetof(struct drm_plane_props, crtc_h), false },
+	{ "FB_DAMAGE_CLIPS", offsetof(struct drm_plane_props, fb_damage_clips), true },
+};
+
+static const struct drm_prop_name drm_crtc_prop_names[] = {
+	{ "MODE_ID", offsetof(struct drm_crtc_props, mode_id), false },
+	{ "ACTIVE", offsetof(struct drm_crtc_props, active), false },
+};
+
+static const struct drm_prop_name drm_conn_prop_names[] = {
+	{ "CRTC_ID", offsetof(struct drm_conn_props, crtc_id), false },
+};
+
+#if DRM_WRITEBACK
+struct drm_wb_props {
+	uint32_t crtc_id;
+	uint32_t fb_id;
+	uint32_t out_fence_ptr;
+	uint32_t pixel_formats;
+};
+
+static const struct drm_prop_name drm_wb_prop_names[] = {
+	{ "CRTC_ID", offsetof(struct drm_wb_props, crtc_id), false },
+	{ "WRITEBACK_FB_ID", offsetof(struct drm_wb_props, fb_id), false },
+	{ "WRITEBACK_OUT_FENCE_PTR", offsetof(struct drm_wb_props, out_fence_ptr), false },
+	{ "WRITEBACK_PIXEL_FORMATS", offsetof(struct drm_wb_props, pixel_formats), false },
+};
+#endif
+
+/* Connector, CRTC, plane, cursor and writeback connector of every output, a plane per layer */
+#define DRM_REQ_OBJS_MAX (DRM_OUTPUTS * 5 + DRM_LAYERS)
+#define DRM_REQ_PROPS_MAX (DRM_REQ_OBJS_MAX * 11)
+
+/* An atomic request in fixed arrays, nothing is allocated to commit */
+struct drm_req {
+	uint32_t objs[DRM_REQ_OBJS_MAX];
+	uint32_t count_props[DRM_REQ_OBJS_MAX];
+	uint32_t props[DRM_REQ_PROPS_MAX];
+	uint64_t values[DRM_REQ_PROPS_MAX];
+	uint32_t obj_cnt;
+	uint32_t prop_cnt;
+};
+
+/*
+ * A connector driven by its own CRTC and plane, or an overlay layer: a plane
+ * with its own buffers over an area of an output's CRTC.
+ */
+struct drm_output {
 	uint32_t conn_id, enc_id, crtc_id, plane_id, crtc_idx;
-	uint32_t width, height;
+	uint32_t width, height; /* of the buffers, the plane scales them to the mode's size */
+	uint32_t fourcc, bpp; /* of the buffers */
+	drm_conv_cb_t conv; /* converts LVGL's pixels to the buffers' format, NULL to copy them */
 	uint32_t mmWidth, mmHeight;
-	uint32_t fourcc;
 	drmModeModeInfo mode;
+	uint32_t period_us; /* of a frame in the mode */
 	uint32_t blob_id;
-	drmModeCrtc *saved_crtc;
-	drmModeAtomicReq *req;
-	drmEventContext drm_event_ctx;
 	drmModePlane *plane;
 	drmModeCrtc *crtc;
 	drmModeConnector *conn;
-	uint32_t count_plane_props;
-	uint32_t count_crtc_props;
-	uint32_t count_conn_props;
-	drmModePropertyPtr plane_props[128];
-	drmModePropertyPtr crtc_props[128];
-	drmModePropertyPtr conn_props[128];
-	struct drm_buffer drm_bufs[2]; /* DUMB buffers */
-	struct drm_buffer *cur_bufs[2]; /* double buffering handling */
+	struct drm_plane_props plane_props;
+	struct drm_crtc_props crtc_props;
+	struct drm_conn_props conn_props;
+	bool modeset; /* the next commit enables the output */
+	bool crtc_active; /* the CRTC runs the mode, set by a commit or taken over at startup */
+	bool unplugged; /* the connector got disconnected, the refreshes are dropped */
+	bool plane_dirty; /* the next commit sets the plane's position and size, else only the buffer */
+	struct drm_buffer drm_bufs[DRM_BUFFERS_MAX]; /* DUMB buffers of the swap chain */
+	uint32_t buf_cnt;
+	struct drm_buffer *back; /* the refresh in progress is rendered to it */
+	struct drm_buffer *queue[DRM_BUFFERS_MAX]; /* QUEUED buffers not committed yet, oldest first */
+	uint32_t queue_cnt;
+	struct drm_buffer *flip_buf; /* committed, waiting for its page flip */
+	struct drm_buffer *scanout;
+	struct drm_buffer *last; /* holds the newest frame */
+	bool direct; /* LVGL renders into the back buffer */
+	lv_disp_drv_t *ready_drv; /* lv_disp_flush_ready() deferred until a buffer gets free */
+	uint64_t queue_us; /* when the last refresh was queued */
+	uint64_t prev_queue_us; /* and the one before */
+	uint32_t flips; /* number of page flips */
+	unsigned int flip_seq; /* vblank sequence of the last flip */
+	uint64_t fps_start_us; /* the flips per second are counted from then */
+	uint32_t fps_flips;
+	drm_swap_stats_t swap_stats;
+	uint8_t *shadow; /* system RAM copy of the screen to copy forward from */
+	uint32_t shadow_pitch;
+	uint32_t frame; /* number of refreshes */
+	struct drm_damage damage[DRM_DAMAGE_HISTORY]; /* of the last refreshes, index: frame % DRM_DAMAGE_HISTORY */
+	bool has_damage_clips; /* the plane has FB_DAMAGE_CLIPS */
+	bool dirty_fb; /* else try DIRTYFB */
+	struct drm_output *parent; /* the output of a layer, NULL for outputs */
+	lv_coord_t x, y; /* position of a layer on its output */
+#if DRM_CURSOR
+	uint32_t cursor_plane_id; /* 0 if there is no cursor plane */
+	struct drm_plane_props cursor_props;
+	struct drm_buffer cursor_bufs[2]; /* the image is changed in the one not shown */
+	uint32_t cursor_idx; /* of the buffer shown */
+	uint32_t cursor_w, cursor_h; /* size of the cursor buffers */
+	lv_coord_t cursor_x, cursor_y; /* position of the pointer in LVGL's coordinates */
+	lv_coord_t hot_x, hot_y; /* the point of the image at the position */
+	bool cursor_visible;
+	bool cursor_dirty; /* set the image with the next commit */
+#endif
+#if DRM_EXPORT
+	uint32_t export_gen; /* changes when the buffers are reallocated */
+	bool export_flip; /* a new buffer is on the screen */
+#endif
+#if DRM_WRITEBACK
+	uint32_t wb_conn_id; /* writeback connector, 0 if there is none */
+	struct drm_wb_props wb_props;
+	const struct drm_format *wb_format;
+	struct drm_buffer wb_buf; /* the screen is captured into it, allocated on the first capture */
+	uint32_t wb_width, wb_height;
+	bool wb_attached; /* the writeback connector is routed to the CRTC */
+	bool capture_req; /* capture with the next commit */
+	bool capture_busy; /* wait for wb_fence */
+	int32_t wb_fence; /* signaled when the capture is written */
+	drm_capture_cb_t capture_cb;
+	void *capture_user_data;
+#endif
+#if DRM_HOTPLUG
+	lv_disp_drv_t *drv; /* of the last flush */
+#endif
+};
+
+#if DRM_EXPORT
+struct drm_export_client {
+	int sock;
+	uint32_t gen[DRM_OUTPUTS + DRM_LAYERS]; /* of the outputs' buffers the consumer has */
+};
+#endif
+
+struct drm_dev {
+	int fd;
+	drmModeCrtc *saved_crtc;
+	struct drm_req req;
+	drmEventContext drm_event_ctx;
+	struct drm_output outputs[DRM_OUTPUTS + DRM_LAYERS]; /* the layers follow the outputs */
+	uint32_t output_cnt;
+	uint32_t layer_cnt;
+	bool monotonic_ts; /* the page flip events have CLOCK_MONOTONIC timestamps */
+#if DRM_NONBLOCK
+	pthread_t event_thread;
+	int wake_pipe[2]; /* 0 stops the event thread, 1 makes it poll again */
+	pthread_mutex_t lock;
+	pthread_cond_t flip_cond;
+	uint64_t gather_until; /* commit the held refreshes at the latest then */
+#endif
+#if DRM_EXPORT
+	bool exporting;
+	int export_sock; /* listening */
+	struct drm_export_client export_clients[DRM_EXPORT_CLIENTS];
+	uint32_t export_cnt;
+#endif
+#if DRM_HOTPLUG
+	int uevent_sock; /* the kernel's uevents, -1 if they can't be received */
+	lv_timer_t *hotplug_timer;
+	drm_hotplug_cb_t hotplug_cb;
+	void *hotplug_user_data;
+#endif
 } drm_dev;
 
-static uint32_t get_plane_property_id(const char *name)
+/* Find the IDs of the properties in `names` of a KMS object, resolved once at setup */
+static int drm_get_prop_ids(uint32_t obj_id, uint32_t obj_type, const struct drm_prop_name *names,
+			    uint32_t cnt, void *ids)
 {
-	uint32_t i;
+	drmModeObjectPropertiesPtr props;
+	drmModePropertyPtr prop;
+	uint32_t i, j;
 
-	dbg("Find plane property: %s", name);
-
-	for (i = 0; i < drm_dev.count_plane_props; ++i)
-		if (!strcmp(drm_dev.plane_props[i]->name, name))
-			return drm_dev.plane_props[i]->prop_id;
+	props = drmModeObjectGetProperties(drm_dev.fd, obj_id, obj_type);
+	if (!props) {
+		err("drmModeObjectGetProperties failed");
+		return -1;
+	}
 
-	dbg("Unknown plane property: %s", name);
+	for (j = 0; j < cnt; j++)
+		*(uint32_t *)((uint8_t *)ids + names[j].offset) = 0;
 
-	return 0;
-}
+	for (i = 0; i < props->count_props; i++) {
+		prop = drmModeGetProperty(drm_dev.fd, props->props[i]);
+		if (!prop)
+			continue;
 
-static uint32_t get_crtc_property_id(const char *name)
-{
-	uint32_t i;
+		dbg("Found prop %u:%s", prop->prop_id, prop->name);
+		for (j = 0; j < cnt; j++)
+			if (!strcmp(prop->name, names[j].name))
+				*(uint32_t *)((uint8_t *)ids + names[j].offset) = prop->prop_id;
 
-	dbg("Find crtc property: %s", name);
+		drmModeFreeProperty(prop);
+	}
 
-	for (i = 0; i < drm_dev.count_crtc_props; ++i)
-		if (!strcmp(drm_dev.crtc_props[i]->name, name))
-			return drm_dev.crtc_props[i]->prop_id;
+	drmModeFreeObjectProperties(props);
 
-	dbg("Unknown crtc property: %s", name);
+	for (j = 0; j < cnt; j++) {
+		if (!names[j].optional && !*(uint32_t *)((uint8_t *)ids + names[j].offset)) {
+			err("object %u has no %s property", obj_id, names[j].name);
+			return -1;
+		}
+	}
 
 	return 0;
 }
 
-static uint32_t get_conn_property_id(const char *name)
+static int drm_get_plane_props(uint32_t plane_id, struct drm_plane_props *ids)
 {
-	uint32_t i;
-
-	dbg("Find conn property: %s", name);
-
-	for (i = 0; i < drm_dev.count_conn_props; ++i)
-		if (!strcmp(drm_dev.conn_props[i]->name, name))
-			return drm_dev.conn_props[i]->prop_id;
+	return drm_get_prop_ids(plane_id, DRM_MODE_OBJECT_PLANE, drm_plane_prop_names,
+				sizeof(drm_plane_prop_names) / sizeof(drm_plane_prop_names[0]), ids);
+}
 
-	dbg("Unknown conn property: %s", name);
+static int drm_get_crtc_props(struct drm_output *out)
+{
+	return drm_get_prop_ids(out->crtc_id, DRM_MODE_OBJECT_CRTC, drm_crtc_prop_names,
+				sizeof(drm_crtc_prop_names) / sizeof(drm_crtc_prop_names[0]), &out->crtc_props);
+}
 
-	return 0;
+static int drm_get_conn_props(struct drm_output *out)
+{
+	return drm_get_prop_ids(out->conn_id, DRM_MODE_OBJECT_CONNECTOR, drm_conn_prop_names,
+				sizeof(drm_conn_prop_names) / sizeof(drm_conn_prop_names[0]), &out->conn_props);
 }
 
-static void page_flip_handler(int fd, unsigned int sequence, unsigned int tv_sec,
-			      unsigned int tv_usec, void *user_data)
+/* Start a new atomic request, the arrays are reused */
+static void drm_req_reset(void)
 {
-	dbg("flip");
+	drm_dev.req.obj_cnt = 0;
+	drm_dev.req.prop_cnt = 0;
 }
 
-static int drm_get_plane_props(void)
+/* Set a property of a KMS object in the request, the properties of an object are added together */
+static int drm_req_add(uint32_t obj_id, uint32_t prop_id, uint64_t value)
 {
-	uint32_t i;
+	struct drm_req *req = &drm_dev.req;
 
-	drmModeObjectPropertiesPtr props = drmModeObjectGetProperties(drm_dev.fd, drm_dev.plane_id,
-								      DRM_MODE_OBJECT_PLANE);
-	if (!props) {
-		err("drmModeObjectGetProperties failed");
+	if (req->prop_cnt == DRM_REQ_PROPS_MAX ||
+	    (req->obj_cnt == DRM_REQ_OBJS_MAX && req->objs[req->obj_cnt - 1] != obj_id)) {
+		err("atomic request is full");
 		return -1;
 	}
-	dbg("Found %u plane props", props->count_props);
-	drm_dev.count_plane_props = props->count_props;
-	for (i = 0; i < props->count_props; i++) {
-		drm_dev.plane_props[i] = drmModeGetProperty(drm_dev.fd, props->props[i]);
-		dbg("Added plane prop %u:%s", drm_dev.plane_props[i]->prop_id, drm_dev.plane_props[i]->name);
+
+	if (!req->obj_cnt || req->objs[req->obj_cnt - 1] != obj_id) {
+		req->objs[req->obj_cnt] = obj_id;
+		req->count_props[req->obj_cnt] = 0;
+		req->obj_cnt++;
 	}
-	drmModeFreeObjectProperties(props);
+
+	req->count_props[req->obj_cnt - 1]++;
+	req->props[req->prop_cnt] = prop_id;
+	req->values[req->prop_cnt] = value;
+	req->prop_cnt++;
 
 	return 0;
 }
 
-static int drm_get_crtc_props(void)
+/* Like drmModeAtomicCommit() but without copying and sorting the request on the heap */
+static int drm_req_commit(uint32_t flags)
 {
-	uint32_t i;
+	struct drm_mode_atomic atomic;
 
-	drmModeObjectPropertiesPtr props = drmModeObjectGetProperties(drm_dev.fd, drm_dev.crtc_id,
-								      DRM_MODE_OBJECT_CRTC);
-	if (!props) {
-		err("drmModeObjectGetProperties failed");
-		return -1;
-	}
-	dbg("Found %u crtc props", props->count_props);
-	drm_dev.count_crtc_props = props->count_props;
-	for (i = 0; i < props->count_props; i++) {
-		drm_dev.crtc_props[i] = drmModeGetProperty(drm_dev.fd, props->props[i]);
-		dbg("Added crtc prop %u:%s", drm_dev.crtc_props[i]->prop_id, drm_dev.crtc_props[i]->name);
-	}
-	drmModeFreeObjectProperties(props);
+	memset(&atomic, 0, sizeof(atomic));
+	atomic.flags = flags;
+	atomic.count_objs = drm_dev.req.obj_cnt;
+	atomic.objs_ptr = (uintptr_t)drm_dev.req.objs;
+	atomic.count_props_ptr = (uintptr_t)drm_dev.req.count_props;
+	atomic.props_ptr = (uintptr_t)drm_dev.req.props;
+	atomic.prop_values_ptr = (uintptr_t)drm_dev.req.values;
 
-	return 0;
+	return drmIoctl(drm_dev.fd, DRM_IOCTL_MODE_ATOMIC, &atomic);
 }
 
-static int drm_get_conn_props(void)
+/*
+ * Tell the kernel which parts of the new buffer changed so drivers which
+ * transfer the frame (USB, SPI, virtual displays) can send only those.
+ * Returns a blob for FB_DAMAGE_CLIPS or 0.
+ */
+static uint32_t drm_create_damage_blob(const struct drm_damage *damage)
 {
+	struct drm_mode_rect rects[DRM_DAMAGE_MAX];
+	uint32_t blob_id = 0;
 	uint32_t i;
 
-	drmModeObjectPropertiesPtr props = drmModeObjectGetProperties(drm_dev.fd, drm_dev.conn_id,
-								      DRM_MODE_OBJECT_CONNECTOR);
-	if (!props) {
-		err("drmModeObjectGetProperties failed");
-		return -1;
+	if (!damage->cnt)
+		return 0;
+
+	/* x2 and y2 are exclusive */
+	for (i = 0; i < damage->cnt; i++) {
+		rects[i].x1 = damage->areas[i].x1;
+		rects[i].y1 = damage->areas[i].y1;
+		rects[i].x2 = damage->areas[i].x2 + 1;
+		rects[i].y2 = damage->areas[i].y2 + 1;
 	}
-	dbg("Found %u connector props", props->count_props);
-	drm_dev.count_conn_props = props->count_props;
-	for (i = 0; i < props->count_props; i++) {
-		drm_dev.conn_props[i] = drmModeGetProperty(drm_dev.fd, props->props[i]);
-		dbg("Added connector prop %u:%s", drm_dev.conn_props[i]->prop_id, drm_dev.conn_props[i]->name);
+
+	if (drmModeCreatePropertyBlob(drm_dev.fd, rects, damage->cnt * sizeof(rects[0]), &blob_id)) {
+		err("error creating damage blob");
+		return 0;
 	}
-	drmModeFreeObjectProperties(props);
 
-	return 0;
+	return blob_id;
+}
+
+/*
+ * Keep the damage blob of a buffer while its damage stays the same, e.g. the
+ * same area animated or the buffer committed again, saving two ioctls per commit
+ */
+static void drm_update_damage_blob(struct drm_buffer *buf, const struct drm_damage *damage)
+{
+	if (buf->damage_blob && damage->cnt == buf->blob_damage.cnt &&
+	    !memcmp(damage->areas, buf->blob_damage.areas, damage->cnt * sizeof(damage->areas[0])))
+		return;
+
+	/* A commit holds a reference if it needs it */
+	if (buf->damage_blob)
+		drmModeDestroyPropertyBlob(drm_dev.fd, buf->damage_blob);
+
+	buf->damage_blob = drm_create_damage_blob(damage);
+	buf->blob_damage = *damage;
 }
 
-static int drm_add_plane_property(const char *name, uint64_t value)
+static void drm_dirty_fb(struct drm_output *out, struct drm_buffer *buf, const struct drm_damage *damage)
 {
+	drmModeClip clips[DRM_DAMAGE_MAX];
+	uint32_t i;
 	int ret;
-	uint32_t prop_id = get_plane_property_id(name);
 
-	if (!prop_id) {
-		err("Couldn't find plane prop %s", name);
-		return -1;
+	for (i = 0; i < damage->cnt; i++) {
+		clips[i].x1 = damage->areas[i].x1;
+		clips[i].y1 = damage->areas[i].y1;
+		clips[i].x2 = damage->areas[i].x2 + 1;
+		clips[i].y2 = damage->areas[i].y2 + 1;
 	}
 
-	ret = drmModeAtomicAddProperty(drm_dev.req, drm_dev.plane_id, get_plane_property_id(name), value);
-	if (ret < 0) {
-		err("drmModeAtomicAddProperty (%s:%" PRIu64 ") failed: %d", name, value, ret);
-		return ret;
+	ret = drmModeDirtyFB(drm_dev.fd, buf->fb_handle, clips, damage->cnt);
+	if (ret) {
+		/* Not needed or not supported by the driver */
+		dbg("drmModeDirtyFB failed: %d, disabled", ret);
+		out->dirty_fb = false;
 	}
+}
 
-	return 0;
+/* Set a plane to show a whole framebuffer in an area of a CRTC */
+static void drm_add_plane(uint32_t plane_id, const struct drm_plane_props *ids, uint32_t crtc_id,
+			  uint32_t fb, uint32_t fb_w, uint32_t fb_h, int32_t x, int32_t y, uint32_t w, uint32_t h)
+{
+	drm_req_add(plane_id, ids->fb_id, fb);
+	drm_req_add(plane_id, ids->crtc_id, crtc_id);
+	drm_req_add(plane_id, ids->src_x, 0);
+	drm_req_add(plane_id, ids->src_y, 0);
+	drm_req_add(plane_id, ids->src_w, fb_w << 16);
+	drm_req_add(plane_id, ids->src_h, fb_h << 16);
+	drm_req_add(plane_id, ids->crtc_x, x);
+	drm_req_add(plane_id, ids->crtc_y, y);
+	drm_req_add(plane_id, ids->crtc_w, w);
+	drm_req_add(plane_id, ids->crtc_h, h);
 }
 
-static int drm_add_crtc_property(const char *name, uint64_t value)
+#if DRM_CURSOR
+/* Top left corner of the cursor image on the CRTC, the pointer is in LVGL's coordinates */
+static void drm_cursor_pos(struct drm_output *out, int32_t *x, int32_t *y)
 {
-	int ret;
-	uint32_t prop_id = get_crtc_property_id(name);
+	*x = out->cursor_x * out->mode.hdisplay / out->width - out->hot_x;
+	*y = out->cursor_y * out->mode.vdisplay / out->height - out->hot_y;
+}
 
-	if (!prop_id) {
-		err("Couldn't find crtc prop %s", name);
-		return -1;
-	}
+/* Add the image and the position of the cursor plane to the request */
+static void drm_add_cursor(struct drm_output *out)
+{
+	struct drm_buffer *buf = &out->cursor_bufs[out->cursor_idx];
+	int32_t x, y;
 
-	ret = drmModeAtomicAddProperty(drm_dev.req, drm_dev.crtc_id, get_crtc_property_id(name), value);
-	if (ret < 0) {
-		err("drmModeAtomicAddProperty (%s:%" PRIu64 ") failed: %d", name, value, ret);
-		return ret;
-	}
+	drm_cursor_pos(out, &x, &y);
 
-	return 0;
+	drm_add_plane(out->cursor_plane_id, &out->cursor_props,
+		      out->cursor_visible ? out->crtc_id : 0, out->cursor_visible ? buf->fb_handle : 0,
+		      out->cursor_w, out->cursor_h, x, y, out->cursor_w, out->cursor_h);
 }
+#endif
 
-static int drm_add_conn_property(const char *name, uint64_t value)
+#if DRM_WRITEBACK
+/* Let the writeback connector write what the commit shows into wb_buf */
+static void drm_add_writeback(struct drm_output *out)
 {
-	int ret;
-	uint32_t prop_id = get_conn_property_id(name);
+	if (!out->wb_attached)
+		drm_req_add(out->wb_conn_id, out->wb_props.crtc_id, out->crtc_id);
 
-	if (!prop_id) {
-		err("Couldn't find conn prop %s", name);
-		return -1;
-	}
+	drm_req_add(out->wb_conn_id, out->wb_props.fb_id, out->wb_buf.fb_handle);
+	drm_req_add(out->wb_conn_id, out->wb_props.out_fence_ptr, (uintptr_t)&out->wb_fence);
+}
 
-	ret = drmModeAtomicAddProperty(drm_dev.req, drm_dev.conn_id, get_conn_property_id(name), value);
-	if (ret < 0) {
-		err("drmModeAtomicAddProperty (%s:%" PRIu64 ") failed: %d", name, value, ret);
-		return ret;
+/* Give up the captures of a failed commit, they may be why it failed */
+static bool drm_capture_failed(uint32_t mask)
+{
+	struct drm_output *out;
+	bool found = false;
+	uint32_t i;
+
+	for (i = 0; i < drm_dev.output_cnt; i++) {
+		out = &drm_dev.outputs[i];
+		if (!(mask & (1u << i)) || !out->capture_req)
+			continue;
+
+		err("writeback of connector %d failed: %s", out->conn_id, strerror(errno));
+		out->capture_req = false;
+		out->capture_cb(out, NULL, out->capture_user_data);
+		found = true;
 	}
 
-	return 0;
+	return found;
 }
+#endif
 
-static int drm_dmabuf_set_plane(struct drm_buffer *buf)
+/* Area of the CRTC the plane of an output or a layer is shown in */
+static void drm_plane_dest(struct drm_output *out, int32_t *x, int32_t *y, uint32_t *w, uint32_t *h)
 {
-	int ret;
-	static int first = 1;
-	uint32_t flags = DRM_MODE_PAGE_FLIP_EVENT;
+	struct drm_output *parent = out->parent;
 
-	drm_dev.req = drmModeAtomicAlloc();
+	if (!parent) {
+		*x = 0;
+		*y = 0;
+		*w = out->mode.hdisplay;
+		*h = out->mode.vdisplay;
+		return;
+	}
 
-	/* On first Atomic commit, do a modeset */
-	if (first) {
-		drm_add_conn_property("CRTC_ID", drm_dev.crtc_id);
+	/* A layer is scaled like its output */
+	*x = out->x * (int32_t)parent->mode.hdisplay / (int32_t)parent->width;
+	*y = out->y * (int32_t)parent->mode.vdisplay / (int32_t)parent->height;
+	*w = out->width * parent->mode.hdisplay / parent->width;
+	*h = out->height * parent->mode.vdisplay / parent->height;
+}
 
-		drm_add_crtc_property("MODE_ID", drm_dev.blob_id);
-		drm_add_crtc_property("ACTIVE", 1);
+/* Add the plane update of an output showing its flip_buf to the request */
+static void drm_add_output(struct drm_output *out)
+{
+	struct drm_buffer *buf = out->flip_buf;
+	int32_t x, y;
+	uint32_t w, h;
 
-		flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+	/* On first Atomic commit, do a modeset */
+	if (out->modeset) {
+		drm_req_add(out->conn_id, out->conn_props.crtc_id, out->crtc_id);
 
-		first = 0;
+		drm_req_add(out->crtc_id, out->crtc_props.mode_id, out->blob_id);
+		drm_req_add(out->crtc_id, out->crtc_props.active, 1);
 	}
 
-	drm_add_plane_property("FB_ID", buf->fb_handle);
-	drm_add_plane_property("CRTC_ID", drm_dev.crtc_id);
-	drm_add_plane_property("SRC_X", 0);
-	drm_add_plane_property("SRC_Y", 0);
-	drm_add_plane_property("SRC_W", drm_dev.width << 16);
-	drm_add_plane_property("SRC_H", drm_dev.height << 16);
-	drm_add_plane_property("CRTC_X", 0);
-	drm_add_plane_property("CRTC_Y", 0);
-	drm_add_plane_property("CRTC_W", drm_dev.width);
-	drm_add_plane_property("CRTC_H", drm_dev.height);
+	/* The plane keeps its position and size, usually only the buffer changes */
+	if (out->modeset || out->plane_dirty) {
+		drm_plane_dest(out, &x, &y, &w, &h);
+		drm_add_plane(out->plane_id, &out->plane_props, out->crtc_id, buf->fb_handle,
+			      out->width, out->height, x, y, w, h);
+	} else {
+		drm_req_add(out->plane_id, out->plane_props.fb_id, buf->fb_handle);
+	}
 
-	ret = drmModeAtomicCommit(drm_dev.fd, drm_dev.req, flags, NULL);
-	if (ret) {
-		err("drmModeAtomicCommit failed: %s", strerror(errno));
-		drmModeAtomicFree(drm_dev.req);
-		return ret;
+	/* Always set, no blob means all of the buffer changed */
+	if (out->has_damage_clips) {
+		drm_update_damage_blob(buf, &out->damage[buf->frame % DRM_DAMAGE_HISTORY]);
+		drm_req_add(out->plane_id, out->plane_props.fb_damage_clips, buf->damage_blob);
 	}
 
-	return 0;
+#if DRM_CURSOR
+	/* A new cursor image goes with the refresh */
+	if (out->cursor_dirty)
+		drm_add_cursor(out);
+#endif
+
+#if DRM_WRITEBACK
+	if (out->capture_req)
+		drm_add_writeback(out);
+#endif
 }
 
-static int find_plane(unsigned int fourcc, uint32_t *plane_id, uint32_t crtc_id, uint32_t crtc_idx)
+/* Show the flip_buf of the outputs in `mask` with one atomic commit */
+static int drm_commit(uint32_t mask)
 {
-	drmModePlaneResPtr planes;
-	drmModePlanePtr plane;
-	unsigned int i;
-	unsigned int j;
-	int ret = 0;
-	unsigned int format = fourcc;
+	uint32_t flags = DRM_MODE_PAGE_FLIP_EVENT;
+	struct drm_output *out;
+	struct timespec t0, t1;
+	uint32_t i, cpu_us;
+	int ret;
 
-	planes = drmModeGetPlaneResources(drm_dev.fd);
-	if (!planes) {
-		err("drmModeGetPlaneResources failed");
-		return -1;
-	}
+#if DRM_NONBLOCK
+	flags |= DRM_MODE_ATOMIC_NONBLOCK;
+#endif
 
-	dbg("drm: found planes %u", planes->count_planes);
+	/* The CPU time the thread spends building and committing, not waiting */
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
 
-	for (i = 0; i < planes->count_planes; ++i) {
-		plane = drmModeGetPlane(drm_dev.fd, planes->planes[i]);
-		if (!plane) {
-			err("drmModeGetPlane failed: %s", strerror(errno));
-			break;
-		}
+	drm_req_reset();
 
-		if (!(plane->possible_crtcs & (1 << crtc_idx))) {
-			drmModeFreePlane(plane);
+	for (i = 0; i < drm_dev.output_cnt + drm_dev.layer_cnt; i++) {
+		if (!(mask & (1u << i)))
 			continue;
-		}
-
-		for (j = 0; j < plane->count_formats; ++j) {
-			if (plane->formats[j] == format)
-				break;
-		}
 
-		if (j == plane->count_formats) {
-			drmModeFreePlane(plane);
-			continue;
-		}
+		out = &drm_dev.outputs[i];
+		if (out->modeset)
+			flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+#if DRM_WRITEBACK
+		/* Routing the writeback connector to the CRTC is a modeset */
+		if (out->capture_req && !out->wb_attached)
+			flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+#endif
+		drm_add_output(out);
+	}
 
-		*plane_id = plane->plane_id;
-		drmModeFreePlane(plane);
+	/* The page flip event tells when the buffer is on the screen */
+	ret = drm_req_commit(flags);
 
-		dbg("found plane %d", *plane_id);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+	cpu_us = (t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000;
 
-		break;
+	if (ret) {
+#if DRM_WRITEBACK
+		/* Don't let a capture the driver refuses hold up the refreshes */
+		if (drm_capture_failed(mask))
+			return drm_commit(mask);
+#endif
+		err("atomic commit failed: %s", strerror(errno));
+		return ret;
 	}
 
-	if (i == planes->count_planes)
-		ret = -1;
+	for (i = 0; i < drm_dev.output_cnt + drm_dev.layer_cnt; i++) {
+		if (!(mask & (1u << i)))
+			continue;
 
-	drmModeFreePlaneResources(planes);
+		out = &drm_dev.outputs[i];
+		out->modeset = false;
+		out->crtc_active = true;
+		out->plane_dirty = false;
+		out->swap_stats.commit_cpu_us = cpu_us;
+		if (cpu_us > out->swap_stats.max_commit_cpu_us)
+			out->swap_stats.max_commit_cpu_us = cpu_us;
+#if DRM_CURSOR
+		out->cursor_dirty = false;
+#endif
+#if DRM_WRITEBACK
+		if (out->capture_req) {
+			out->capture_req = false;
+			out->capture_busy = true;
+			out->wb_attached = true;
+		}
+#endif
+		if (!out->has_damage_clips && out->dirty_fb)
+			drm_dirty_fb(out, out->flip_buf, &out->damage[out->flip_buf->frame % DRM_DAMAGE_HISTORY]);
+	}
 
-	return ret;
+	return 0;
 }
 
-static int drm_find_connector(void)
+static bool drm_has_free_buffer(struct drm_output *out)
+{
+	uint32_t i;
+
+	for (i = 0; i < out->buf_cnt; i++)
+		if (out->drm_bufs[i].state == DRM_BUF_FREE)
+			return true;
+
+	return false;
+}
+
+static bool drm_flip_pending(void)
+{
+	uint32_t i;
+
+	for (i = 0; i < drm_dev.output_cnt + drm_dev.layer_cnt; i++)
+		if (drm_dev.outputs[i].flip_buf)
+			return true;
+
+	return false;
+}
+
+/* A page flip or the commit of the refreshes gathered for the other outputs is on the way */
+static bool drm_commit_pending(void)
+{
+#if DRM_NONBLOCK
+	if (drm_dev.gather_until)
+		return true;
+#endif
+	return drm_flip_pending();
+}
+
+/* A commit on the CRTC of an output or a layer waits for its page flip */
+static bool drm_crtc_busy(struct drm_output *out)
+{
+	uint32_t i;
+
+	for (i = 0; i < drm_dev.output_cnt + drm_dev.layer_cnt; i++)
+		if (drm_dev.outputs[i].crtc_id == out->crtc_id && drm_dev.outputs[i].flip_buf)
+			return true;
+
+	return false;
+}
+
+/* The oldest queued refresh can be committed */
+static bool drm_can_commit(struct drm_output *out)
+{
+	/* A layer waits for its output to be enabled */
+	return out->queue_cnt && !drm_crtc_busy(out) && !(out->parent && out->parent->modeset);
+}
+
+static uint64_t drm_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#if DRM_NONBLOCK
+/*
+ * LVGL refreshes the displays one after the other. Hold the queued refreshes
+ * for up to half a frame while an output which refreshed along with them last
+ * time has not queued its refresh yet, so they go in one commit. The event
+ * thread commits when the time is up. Called with the lock held.
+ */
+static bool drm_gather(void)
+{
+	struct drm_output *out, *held;
+	uint64_t now = drm_time_us();
+	uint32_t period_us = 0;
+	bool expected = false;
+	char c = 1;
+	uint32_t i, j;
+
+	for (i = 0; i < drm_dev.output_cnt + drm_dev.layer_cnt; i++) {
+		held = &drm_dev.outputs[i];
+		if (!drm_can_commit(held))
+			continue;
+
+		period_us = held->period_us;
+		for (j = 0; j < drm_dev.output_cnt + drm_dev.layer_cnt; j++) {
+			out = &drm_dev.outputs[j];
+			if (!out->queue_cnt && !drm_crtc_busy(out) &&
+			    out->queue_us > held->prev_queue_us)
+				expected = true;
+		}
+	}
+
+	if (expected && !drm_dev.gather_until) {
+		drm_dev.gather_until = now + period_us / 2;
+		if (write(drm_dev.wake_pipe[1], &c, 1) != 1)
+			err("cannot wake the event thread");
+	}
+
+	if (expected && now < drm_dev.gather_until)
+		return true;
+
+	drm_dev.gather_until = 0;
+
+	return false;
+}
+#endif
+
+/*
+ * Commit the oldest queued buffer of every output and layer whose CRTC waits
+ * for no page flip in one atomic request, so several displays cost one commit
+ * per vblank. Called with the lock held.
+ */
+static void drm_commit_queued(void)
+{
+	struct drm_output *out;
+	uint32_t mask = 0, all, crtc_mask;
+	uint32_t i, j, cnt = 0;
+
+	for (i = 0; i < drm_dev.output_cnt + drm_dev.layer_cnt; i++) {
+		if (drm_can_commit(&drm_dev.outputs[i])) {
+			mask |= 1u << i;
+			cnt++;
+		}
+	}
+
+	if (!mask)
+		return;
+
+#if DRM_NONBLOCK
+	if (drm_gather())
+		return;
+#endif
+
+	for (i = 0; i < drm_dev.output_cnt + drm_dev.layer_cnt; i++) {
+		if (!(mask & (1u << i)))
+			continue;
+
+		out = &drm_dev.outputs[i];
+		out->flip_buf = out->queue[0];
+		out->queue_cnt--;
+		for (j = 0; j < out->queue_cnt; j++)
+			out->queue[j] = out->queue[j + 1];
+	}
+
+	if (!drm_commit(mask)) {
+		dbg("Flush done");
+		for (i = 0; cnt > 1 && i < drm_dev.output_cnt + drm_dev.layer_cnt; i++)
+			if (mask & (1u << i))
+				drm_dev.outputs[i].swap_stats.shared_commits++;
+		return;
+	}
+
+	/*
+	 * Try CRTC by CRTC, the outputs may not be changed together (e.g. bandwidth).
+	 * The planes of a CRTC have to go together, it takes one commit at a time.
+	 */
+	all = mask;
+	for (i = 0; i < drm_dev.output_cnt + drm_dev.layer_cnt; i++) {
+		if (!(mask & (1u << i)))
+			continue;
+
+		crtc_mask = 0;
+		for (j = i; j < drm_dev.output_cnt + drm_dev.layer_cnt; j++)
+			if ((mask & (1u << j)) && drm_dev.outputs[j].crtc_id == drm_dev.outputs[i].crtc_id)
+				crtc_mask |= 1u << j;
+		mask &= ~crtc_mask;
+
+		if (crtc_mask != all && !drm_commit(crtc_mask))
+			continue;
+
+		err("Flush fail");
+		for (j = i; j < drm_dev.output_cnt + drm_dev.layer_cnt; j++) {
+			if (!(crtc_mask & (1u << j)))
+				continue;
+
+			out = &drm_dev.outputs[j];
+			/* A repeat of the buffer on the screen stays there */
+			out->flip_buf->state = out->flip_buf == out->scanout ? DRM_BUF_SCANOUT : DRM_BUF_FREE;
+			out->flip_buf = NULL;
+		}
+	}
+}
+
+/*
+ * Commit the buffer on the screen again if no refresh is on the way, for a
+ * change which takes a commit but no rendering (cursor, writeback). Called
+ * with the lock held.
+ */
+static void drm_show_again(struct drm_output *out)
+{
+	if ((out->back && !out->direct) || out->queue_cnt || out->flip_buf || !out->scanout || out->modeset)
+		return;
+
+	out->scanout->state = DRM_BUF_QUEUED;
+	out->scanout->refr_flips = out->flips;
+	out->scanout->flush_us = 0;
+	out->scanout->vblank_seq = 0;
+	out->queue[out->queue_cnt++] = out->scanout;
+	drm_commit_queued();
+}
+
+#if DRM_EXPORT
+/* Send a message to a consumer with `fd_cnt` file descriptors attached */
+static int drm_export_send(int sock, const drm_export_msg_t *msg, const int *fds, uint32_t fd_cnt)
+{
+	char ctrl[CMSG_SPACE(sizeof(int) * DRM_BUFFERS_MAX)];
+	struct iovec iov;
+	struct msghdr mh;
+	struct cmsghdr *cmsg;
+
+	iov.iov_base = (void *)msg;
+	iov.iov_len = sizeof(*msg);
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+
+	if (fd_cnt) {
+		memset(ctrl, 0, sizeof(ctrl));
+		mh.msg_control = ctrl;
+		mh.msg_controllen = CMSG_SPACE(sizeof(int) * fd_cnt);
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_cnt);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_cnt);
+	}
+
+	/* Never wait for a consumer, a full socket only skips the message */
+	if (sendmsg(sock, &mh, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/* Export the buffers of an output as dma-bufs to a consumer */
+static int drm_export_buffers(struct drm_export_client *client, uint32_t idx)
+{
+	struct drm_output *out = &drm_dev.outputs[idx];
+	int fds[DRM_BUFFERS_MAX];
+	drm_export_msg_t msg;
+	uint32_t i, cnt;
+	int ret = -EIO;
+
+	for (cnt = 0; cnt < out->buf_cnt; cnt++) {
+		if (drmPrimeHandleToFD(drm_dev.fd, out->drm_bufs[cnt].handle, DRM_CLOEXEC, &fds[cnt])) {
+			err("drmPrimeHandleToFD failed: %s", strerror(errno));
+			goto out;
+		}
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = DRM_EXPORT_MSG_BUFFERS;
+	msg.output = idx;
+	msg.buf_cnt = cnt;
+	msg.width = out->width;
+	msg.height = out->height;
+	msg.pitch = out->drm_bufs[0].pitch;
+	msg.fourcc = out->fourcc;
+
+	ret = drm_export_send(client->sock, &msg, fds, cnt);
+	if (!ret)
+		client->gen[idx] = out->export_gen;
+
+out:
+	/* The consumer holds its own references */
+	for (i = 0; i < cnt; i++)
+		close(fds[i]);
+
+	return ret;
+}
+
+/* Tell the consumers which buffers the flips put on the screen */
+static void drm_export_flips(void)
+{
+	struct drm_export_client *client;
+	struct drm_output *out;
+	drm_export_msg_t msg;
+	uint32_t c, i;
+	int sock, ret;
+
+	if (!drm_dev.exporting)
+		return;
+
+	/* They get the buffers of every output before its next frame */
+	while ((sock = accept(drm_dev.export_sock, NULL, NULL)) >= 0) {
+		fcntl(sock, F_SETFD, FD_CLOEXEC);
+
+		if (drm_dev.export_cnt == DRM_EXPORT_CLIENTS) {
+			info("drm: too many buffer export consumers");
+			close(sock);
+			continue;
+		}
+
+		client = &drm_dev.export_clients[drm_dev.export_cnt++];
+		memset(client, 0, sizeof(*client));
+		client->sock = sock;
+	}
+
+	c = 0;
+	while (c < drm_dev.export_cnt) {
+		client = &drm_dev.export_clients[c];
+		ret = 0;
+
+		for (i = 0; i < drm_dev.output_cnt + drm_dev.layer_cnt && (!ret || ret == -EAGAIN); i++) {
+			out = &drm_dev.outputs[i];
+			if (!out->export_flip)
+				continue;
+
+			if (client->gen[i] != out->export_gen) {
+				ret = drm_export_buffers(client, i);
+				if (ret)
+					continue;
+			}
+
+			memset(&msg, 0, sizeof(msg));
+			msg.type = DRM_EXPORT_MSG_FRAME;
+			msg.output = i;
+			msg.buf = out->scanout - out->drm_bufs;
+			msg.frame = out->scanout->frame;
+			msg.sequence = out->flip_seq;
+			ret = drm_export_send(client->sock, &msg, NULL, 0);
+		}
+
+		/* Gone or broken */
+		if (ret && ret != -EAGAIN) {
+			close(client->sock);
+			*client = drm_dev.export_clients[--drm_dev.export_cnt];
+			continue;
+		}
+
+		c++;
+	}
+
+	for (i = 0; i < drm_dev.output_cnt + drm_dev.layer_cnt; i++)
+		drm_dev.outputs[i].export_flip = false;
+}
+
+static void drm_export_open(void)
+{
+	struct sockaddr_un addr;
+
+	drm_dev.export_sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (drm_dev.export_sock < 0) {
+		err("export socket failed: %s", strerror(errno));
+		return;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, DRM_EXPORT_SOCKET, sizeof(addr.sun_path) - 1);
+
+	/* Left over by an earlier run */
+	unlink(addr.sun_path);
+
+	if (bind(drm_dev.export_sock, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(drm_dev.export_sock, DRM_EXPORT_CLIENTS)) {
+		err("export socket %s failed: %s", DRM_EXPORT_SOCKET, strerror(errno));
+		close(drm_dev.export_sock);
+		return;
+	}
+
+	drm_dev.export_cnt = 0;
+	drm_dev.exporting = true;
+
+	info("drm: exporting the buffers on %s", DRM_EXPORT_SOCKET);
+}
+
+static void drm_export_close(void)
+{
+	uint32_t i;
+
+	if (!drm_dev.exporting)
+		return;
+
+	for (i = 0; i < drm_dev.export_cnt; i++)
+		close(drm_dev.export_clients[i].sock);
+
+	close(drm_dev.export_sock);
+	unlink(DRM_EXPORT_SOCKET);
+	drm_dev.exporting = false;
+}
+#endif /* DRM_EXPORT */
+
+#if DRM_WRITEBACK
+/* Hand the captures the writeback connectors finished to the callbacks, called with the lock held */
+static void drm_capture_done(void)
+{
+	struct drm_output *out;
+	struct pollfd pfd;
+	drm_capture_t cap;
+	uint32_t i;
+
+	for (i = 0; i < drm_dev.output_cnt; i++) {
+		out = &drm_dev.outputs[i];
+		if (!out->capture_busy)
+			continue;
+
+		pfd.fd = out->wb_fence;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 0) != 1)
+			continue;
+
+		close(out->wb_fence);
+		out->wb_fence = -1;
+		out->capture_busy = false;
+
+		cap.data = out->wb_buf.map;
+		cap.width = out->wb_width;
+		cap.height = out->wb_height;
+		cap.pitch = out->wb_buf.pitch;
+		cap.fourcc = out->wb_format->fourcc;
+		cap.composited = true;
+		out->capture_cb(out, &cap, out->capture_user_data);
+	}
+}
+#endif
+
+/*
+ * Commit what waited for the page flips handled before and let LVGL
+ * continue. Called with the lock held.
+ */
+static void drm_flips_handled(void)
+{
+	struct drm_output *out;
+	uint32_t i;
+
+	drm_commit_queued();
+
+#if DRM_CURSOR
+	/* The cursor moved while the last refresh was on its way */
+	for (i = 0; i < drm_dev.output_cnt + drm_dev.layer_cnt; i++)
+		if (drm_dev.outputs[i].cursor_dirty)
+			drm_show_again(&drm_dev.outputs[i]);
+#endif
+
+#if DRM_EXPORT
+	drm_export_flips();
+#endif
+
+#if DRM_WRITEBACK
+	drm_capture_done();
+#endif
+
+	for (i = 0; i < drm_dev.output_cnt + drm_dev.layer_cnt; i++) {
+		out = &drm_dev.outputs[i];
+		out->swap_stats.queued = out->queue_cnt + (out->flip_buf ? 1 : 0);
+
+		/* A buffer is free now, LVGL may flush the next refresh */
+		if (out->ready_drv && drm_has_free_buffer(out)) {
+			lv_disp_flush_ready(out->ready_drv);
+			out->ready_drv = NULL;
+		}
+	}
+
+#if DRM_NONBLOCK
+	pthread_cond_broadcast(&drm_dev.flip_cond);
+#endif
+}
+
+/* Account the time from the flush of a refresh until its page flip */
+static void drm_latency_add(struct drm_output *out, uint32_t latency_us)
+{
+	drm_swap_stats_t *stats = &out->swap_stats;
+
+	stats->latency_us = latency_us;
+	if (latency_us > stats->max_latency_us)
+		stats->max_latency_us = latency_us;
+
+	/* Running average over about the last 16 refreshes */
+	if (stats->avg_latency_us)
+		stats->avg_latency_us = stats->avg_latency_us - stats->avg_latency_us / 16 + latency_us / 16;
+	else
+		stats->avg_latency_us = latency_us;
+}
+
+/* Page flips per second since fps_start_us */
+static uint32_t drm_fps(struct drm_output *out, uint64_t now)
+{
+	return (out->fps_flips * 1000000ull + (now - out->fps_start_us) / 2) / (now - out->fps_start_us);
+}
+
+/* Called by drmHandleEvent() with the lock held */
+static void page_flip_handler(int fd, unsigned int sequence, unsigned int tv_sec,
+			      unsigned int tv_usec, unsigned int crtc_id, void *user_data)
+{
+	struct drm_output *out;
+	struct drm_buffer *buf;
+	uint64_t flip_us;
+	uint32_t i;
+
+	dbg("flip");
+
+	/* The start of the vblank the buffers are shown from */
+	flip_us = drm_dev.monotonic_ts ? (uint64_t)tv_sec * 1000000 + tv_usec : drm_time_us();
+
+	/* One event for the output and the layers committed together on the CRTC */
+	for (i = 0; i < drm_dev.output_cnt + drm_dev.layer_cnt; i++) {
+		out = &drm_dev.outputs[i];
+		if (out->crtc_id != crtc_id || !out->flip_buf)
+			continue;
+
+		buf = out->flip_buf;
+
+		/* A queued refresh can't be shown before the vblank after the previous flip */
+		if (buf->vblank_seq && out->flips) {
+			unsigned int first = buf->vblank_seq;
+
+			if ((int)(out->flip_seq + 1 - first) > 0)
+				first = out->flip_seq + 1;
+			if ((int)(sequence - first) > 0)
+				out->swap_stats.missed_vblanks += sequence - first;
+		}
+
+		/* The screen repeated the old frame while this one was rendered */
+		if (out->flips && buf->refr_flips < out->flips &&
+		    sequence > out->flip_seq + 1)
+			out->swap_stats.dropped_frames += sequence - out->flip_seq - 1;
+		out->flip_seq = sequence;
+		out->flips++;
+		out->swap_stats.flips++;
+		out->swap_stats.flip_us = flip_us;
+
+		if (buf->flush_us && flip_us > buf->flush_us)
+			drm_latency_add(out, flip_us - buf->flush_us);
+
+		if (flip_us - out->fps_start_us >= 1000000) {
+			if (out->fps_start_us)
+				out->swap_stats.fps = drm_fps(out, flip_us);
+			out->fps_start_us = flip_us;
+			out->fps_flips = 0;
+		}
+		out->fps_flips++;
+
+		if (out->scanout)
+			out->scanout->state = DRM_BUF_FREE;
+		buf->state = DRM_BUF_SCANOUT;
+		out->scanout = buf;
+		out->flip_buf = NULL;
+#if DRM_EXPORT
+		out->export_flip = true;
+#endif
+	}
+}
+
+#if DRM_NONBLOCK
+static void *drm_event_thread(void *arg)
+{
+	struct pollfd fds[2 + DRM_OUTPUTS];
+	nfds_t nfds = 2;
+	int ret;
+
+	fds[0].fd = drm_dev.fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = drm_dev.wake_pipe[0];
+	fds[1].events = POLLIN;
+
+	while (1) {
+		uint64_t now = drm_time_us();
+		int timeout = -1;
+		char c;
+
+		drm_lock();
+		if (drm_dev.gather_until)
+			timeout = drm_dev.gather_until > now ?
+				  DIV_ROUND_UP(drm_dev.gather_until - now, 1000) : 0;
+#if DRM_WRITEBACK
+		/* Wake up for the captures too, poll() skips negative fds */
+		for (nfds = 2; nfds < 2 + drm_dev.output_cnt; nfds++) {
+			fds[nfds].fd = drm_dev.outputs[nfds - 2].capture_busy ?
+				       drm_dev.outputs[nfds - 2].wb_fence : -1;
+			fds[nfds].events = POLLIN;
+		}
+#endif
+		drm_unlock();
+
+		ret = poll(fds, nfds, timeout);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			err("poll failed: %s", strerror(errno));
+			break;
+		}
+
+		if (fds[1].revents & POLLIN) {
+			if (read(drm_dev.wake_pipe[0], &c, 1) != 1 || !c)
+				break;
+		}
+
+		/* The flips and a gather timeout both may let the queued refreshes go */
+		drm_lock();
+		if (fds[0].revents & POLLIN)
+			drmHandleEvent(drm_dev.fd, &drm_dev.drm_event_ctx);
+		drm_flips_handled();
+		drm_unlock();
+	}
+
+	return NULL;
+}
+
+static int drm_start_event_thread(void)
+{
+	if (pipe(drm_dev.wake_pipe)) {
+		err("pipe failed: %s", strerror(errno));
+		return -1;
+	}
+
+	pthread_mutex_init(&drm_dev.lock, NULL);
+	pthread_cond_init(&drm_dev.flip_cond, NULL);
+
+	if (pthread_create(&drm_dev.event_thread, NULL, drm_event_thread, NULL)) {
+		err("cannot create the event thread");
+		close(drm_dev.wake_pipe[0]);
+		close(drm_dev.wake_pipe[1]);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void drm_stop_event_thread(void)
+{
+	char c = 0;
+
+	if (write(drm_dev.wake_pipe[1], &c, 1) != 1)
+		err("cannot stop the event thread");
+	pthread_join(drm_dev.event_thread, NULL);
+
+	close(drm_dev.wake_pipe[0]);
+	close(drm_dev.wake_pipe[1]);
+	pthread_cond_destroy(&drm_dev.flip_cond);
+	pthread_mutex_destroy(&drm_dev.lock);
+}
+#endif
+
+static bool drm_plane_used(uint32_t plane_id)
+{
+	uint32_t i;
+
+	for (i = 0; i < drm_dev.output_cnt + drm_dev.layer_cnt; i++) {
+		if (drm_dev.outputs[i].plane_id == plane_id)
+			return true;
+#if DRM_CURSOR
+		if (drm_dev.outputs[i].cursor_plane_id == plane_id)
+			return true;
+#endif
+	}
+
+	return false;
+}
+
+static bool drm_crtc_used(uint32_t crtc_id)
+{
+	uint32_t i;
+
+	for (i = 0; i < drm_dev.output_cnt; i++)
+		if (drm_dev.outputs[i].crtc_id == crtc_id)
+			return true;
+
+	return false;
+}
+
+/* Get the type of a plane: DRM_PLANE_TYPE_PRIMARY, _OVERLAY or _CURSOR */
+static int drm_get_plane_type(uint32_t plane_id)
+{
+	drmModeObjectPropertiesPtr props;
+	drmModePropertyPtr prop;
+	int type = -1;
+	uint32_t i;
+
+	props = drmModeObjectGetProperties(drm_dev.fd, plane_id, DRM_MODE_OBJECT_PLANE);
+	if (!props)
+		return -1;
+
+	for (i = 0; i < props->count_props && type < 0; i++) {
+		prop = drmModeGetProperty(drm_dev.fd, props->props[i]);
+		if (prop && !strcmp(prop->name, "type"))
+			type = props->prop_values[i];
+		drmModeFreeProperty(prop);
+	}
+
+	drmModeFreeObjectProperties(props);
+
+	return type;
+}
+
+static int find_plane(unsigned int fourcc, int type, uint32_t *plane_id, uint32_t crtc_id, uint32_t crtc_idx)
+{
+	drmModePlaneResPtr planes;
+	drmModePlanePtr plane;
+	unsigned int i;
+	unsigned int j;
+	int ret = 0;
+	unsigned int format = fourcc;
+
+	planes = drmModeGetPlaneResources(drm_dev.fd);
+	if (!planes) {
+		err("drmModeGetPlaneResources failed");
+		return -1;
+	}
+
+	dbg("drm: found planes %u", planes->count_planes);
+
+	for (i = 0; i < planes->count_planes; ++i) {
+		plane = drmModeGetPlane(drm_dev.fd, planes->planes[i]);
+		if (!plane) {
+			err("drmModeGetPlane failed: %s", strerror(errno));
+			break;
+		}
+
+		if (!(plane->possible_crtcs & (1 << crtc_idx)) || drm_plane_used(plane->plane_id) ||
+		    drm_get_plane_type(plane->plane_id) != type) {
+			drmModeFreePlane(plane);
+			continue;
+		}
+
+		for (j = 0; j < plane->count_formats; ++j) {
+			if (plane->formats[j] == format)
+				break;
+		}
+
+		if (j == plane->count_formats) {
+			drmModeFreePlane(plane);
+			continue;
+		}
+
+		*plane_id = plane->plane_id;
+		drmModeFreePlane(plane);
+
+		dbg("found plane %d", *plane_id);
+
+		break;
+	}
+
+	if (i == planes->count_planes)
+		ret = -1;
+
+	drmModeFreePlaneResources(planes);
+
+	return ret;
+}
+
+/*
+ * Find a plane of `type` for an output in the first format of drm_formats it
+ * supports and which LVGL renders or can be converted to.
+ */
+static int drm_find_plane_format(struct drm_output *out, int type)
+{
+	const char *name;
+	drm_conv_cb_t conv;
+	uint32_t i;
+
+	for (i = 0; i < sizeof(drm_formats) / sizeof(drm_formats[0]); i++) {
+		conv = drm_blit_get_conv(drm_formats[i].fourcc, &name);
+		if (!conv && drm_formats[i].bpp != LV_COLOR_DEPTH)
+			continue;
+
+		if (find_plane(drm_formats[i].fourcc, type, &out->plane_id, out->crtc_id, out->crtc_idx))
+			continue;
+
+		out->fourcc = drm_formats[i].fourcc;
+		out->bpp = drm_formats[i].bpp;
+		out->conv = conv;
+		if (conv)
+			info("drm: plane %u converts the pixels: %s", out->plane_id, name);
+
+		return 0;
+	}
+
+	return -1;
+}
+
+/* Pick a free CRTC for a connector */
+static int drm_find_crtc(struct drm_output *out, drmModeRes *res, drmModeConnector *conn)
 {
-	drmModeConnector *conn = NULL;
 	drmModeEncoder *enc = NULL;
+	int i;
+
+	for (i = 0 ; i < res->count_encoders; i++) {
+		enc = drmModeGetEncoder(drm_dev.fd, res->encoders[i]);
+		if (!enc)
+			continue;
+
+		dbg("enc%d enc_id %d conn enc_id %d", i, enc->encoder_id, conn->encoder_id);
+
+		if (enc->encoder_id == conn->encoder_id && enc->crtc_id && !drm_crtc_used(enc->crtc_id))
+			break;
+
+		drmModeFreeEncoder(enc);
+		enc = NULL;
+	}
+
+	if (enc) {
+		out->enc_id = enc->encoder_id;
+		dbg("enc_id: %d", out->enc_id);
+		out->crtc_id = enc->crtc_id;
+		dbg("crtc_id: %d", out->crtc_id);
+		drmModeFreeEncoder(enc);
+	} else {
+		/* Encoder hasn't been associated yet, look it up */
+		for (i = 0; i < conn->count_encoders; i++) {
+			int crtc, crtc_id = -1;
+
+			enc = drmModeGetEncoder(drm_dev.fd, conn->encoders[i]);
+			if (!enc)
+				continue;
+
+			for (crtc = 0 ; crtc < res->count_crtcs; crtc++) {
+				uint32_t crtc_mask = 1 << crtc;
+
+				dbg("enc_id %d crtc%d id %d mask %x possible %x", enc->encoder_id, crtc, res->crtcs[crtc], crtc_mask, enc->possible_crtcs);
+
+				if ((enc->possible_crtcs & crtc_mask) && !drm_crtc_used(res->crtcs[crtc])) {
+					crtc_id = res->crtcs[crtc];
+					break;
+				}
+			}
+
+			if (crtc_id > 0) {
+				out->enc_id = enc->encoder_id;
+				dbg("enc_id: %d", out->enc_id);
+				out->crtc_id = crtc_id;
+				dbg("crtc_id: %d", out->crtc_id);
+				break;
+			}
+
+			drmModeFreeEncoder(enc);
+			enc = NULL;
+		}
+
+		if (!enc) {
+			err("suitable encoder not found");
+			return -1;
+		}
+
+		drmModeFreeEncoder(enc);
+	}
+
+	out->crtc_idx = -1;
+
+	for (i = 0; i < res->count_crtcs; ++i) {
+		if (out->crtc_id == res->crtcs[i]) {
+			out->crtc_idx = i;
+			break;
+		}
+	}
+
+	if (out->crtc_idx == -1) {
+		err("drm: CRTC not found");
+		return -1;
+	}
+
+	dbg("crtc_idx: %d", out->crtc_idx);
+
+	return 0;
+}
+
+/*
+ * Find a mode of a connector, 0 matches any width, height or refresh rate.
+ * The kernel lists the preferred mode first, then the larger and faster ones.
+ */
+static bool drm_mode_matches(const drmModeModeInfo *mode, uint32_t width, uint32_t height,
+			     uint32_t refresh)
+{
+	return (!width || mode->hdisplay == width) &&
+	       (!height || mode->vdisplay == height) &&
+	       (!refresh || mode->vrefresh == refresh);
+}
+
+static drmModeModeInfo *drm_find_mode(drmModeConnector *conn, uint32_t width, uint32_t height,
+				      uint32_t refresh)
+{
+	int i;
+
+	for (i = 0; i < conn->count_modes; i++)
+		if (drm_mode_matches(&conn->modes[i], width, height, refresh))
+			return &conn->modes[i];
+
+	return NULL;
+}
+
+/* The mode asked for in lv_drv_conf.h, else the preferred one */
+static drmModeModeInfo *drm_pick_mode(drmModeConnector *conn)
+{
+	drmModeModeInfo *mode;
+
+	mode = drm_find_mode(conn, DRM_MODE_WIDTH, DRM_MODE_HEIGHT, DRM_MODE_REFRESH);
+	if (!mode) {
+		info("drm: connector %d has no %dx%d@%d mode, using the preferred one",
+		     conn->connector_id, DRM_MODE_WIDTH, DRM_MODE_HEIGHT, DRM_MODE_REFRESH);
+		mode = &conn->modes[0];
+	}
+
+	return mode;
+}
+
+/*
+ * Take over the mode the CRTC of the connector runs (e.g. set by the
+ * bootloader or the console) if it's the one asked for. Its framebuffer stays
+ * on the screen until the first refresh, which is then a page flip instead of
+ * a modeset blanking the screen.
+ */
+static bool drm_adopt_mode(struct drm_output *out, drmModeConnector *conn)
+{
+	drmModeCrtc *crtc;
+	bool adopt;
+
+	/* drm_find_crtc() kept the CRTC the connector is routed to */
+	if (!conn->encoder_id || out->enc_id != conn->encoder_id)
+		return false;
+
+	crtc = drmModeGetCrtc(drm_dev.fd, out->crtc_id);
+	if (!crtc)
+		return false;
+
+	adopt = crtc->mode_valid && crtc->buffer_id &&
+		drm_mode_matches(&crtc->mode, DRM_MODE_WIDTH, DRM_MODE_HEIGHT, DRM_MODE_REFRESH);
+	if (adopt) {
+		memcpy(&out->mode, &crtc->mode, sizeof(drmModeModeInfo));
+		out->crtc_active = true;
+		info("drm: connector %d keeps its %dx%d@%d mode", conn->connector_id,
+		     crtc->mode.hdisplay, crtc->mode.vdisplay, crtc->mode.vrefresh);
+	}
+
+	drmModeFreeCrtc(crtc);
+
+	return adopt;
+}
+
+/* Set up `out` for a connector with a CRTC and a mode, -1 if it's not connected or no CRTC is free */
+static int drm_probe_connector(struct drm_output *out, drmModeRes *res, drmModeConnector *conn)
+{
+#if DRM_CONNECTOR_ID >= 0
+	if (conn->connector_id != DRM_CONNECTOR_ID)
+		return -1;
+#endif
+
+	if (conn->connection == DRM_MODE_CONNECTED) {
+		dbg("drm: connector %d: connected", conn->connector_id);
+	} else if (conn->connection == DRM_MODE_DISCONNECTED) {
+		dbg("drm: connector %d: disconnected", conn->connector_id);
+	} else if (conn->connection == DRM_MODE_UNKNOWNCONNECTION) {
+		dbg("drm: connector %d: unknownconnection", conn->connector_id);
+	} else {
+		dbg("drm: connector %d: unknown", conn->connector_id);
+	}
+
+	/* A writeback connector has modes but no screen */
+	if (conn->connection != DRM_MODE_CONNECTED || conn->count_modes <= 0 ||
+	    conn->connector_type == DRM_MODE_CONNECTOR_WRITEBACK)
+		return -1;
+
+	memset(out, 0, sizeof(*out));
+
+	out->conn_id = conn->connector_id;
+	dbg("conn_id: %d", out->conn_id);
+	out->mmWidth = conn->mmWidth;
+	out->mmHeight = conn->mmHeight;
+
+	/* Keep looking if every CRTC which could drive it is taken */
+	if (drm_find_crtc(out, res, conn))
+		return -1;
+
+	if (!drm_adopt_mode(out, conn))
+		memcpy(&out->mode, drm_pick_mode(conn), sizeof(drmModeModeInfo));
+
+	out->period_us = 1000000 / (out->mode.vrefresh ? out->mode.vrefresh : 60);
+
+	out->width = DRM_RENDER_WIDTH ? DRM_RENDER_WIDTH : out->mode.hdisplay;
+	out->height = DRM_RENDER_HEIGHT ? DRM_RENDER_HEIGHT : out->mode.vdisplay;
+
+	if (drmModeCreatePropertyBlob(drm_dev.fd, &out->mode, sizeof(out->mode),
+				      &out->blob_id)) {
+		err("error creating mode blob");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int drm_find_connectors(void)
+{
+	drmModeConnector *conn = NULL;
+	drmModeRes *res;
+	int i, ret;
+
+	if ((res = drmModeGetResources(drm_dev.fd)) == NULL) {
+		err("drmModeGetResources() failed");
+		return -1;
+	}
+
+	if (res->count_crtcs <= 0) {
+		err("no Crtcs");
+		goto free_res;
+	}
+
+	drm_dev.output_cnt = 0;
+
+	/* find all available connectors */
+	for (i = 0; i < res->count_connectors && drm_dev.output_cnt < DRM_OUTPUTS; i++) {
+		conn = drmModeGetConnector(drm_dev.fd, res->connectors[i]);
+		if (!conn)
+			continue;
+
+		ret = drm_probe_connector(&drm_dev.outputs[drm_dev.output_cnt], res, conn);
+		drmModeFreeConnector(conn);
+
+		if (!ret)
+			drm_dev.output_cnt++;
+	};
+
+	if (!drm_dev.output_cnt) {
+		err("suitable connector not found");
+		goto free_res;
+	}
+
+	drmModeFreeResources(res);
+
+	return 0;
+
+free_res:
+	drmModeFreeResources(res);
+
+	return -1;
+}
+
+static int drm_open(const char *path)
+{
+	int fd, flags;
+	uint64_t has_dumb;
+	int ret;
+
+	fd = open(path, O_RDWR);
+	if (fd < 0) {
+		err("cannot open \"%s\"", path);
+		return -1;
+	}
+
+	/* set FD_CLOEXEC flag */
+	if ((flags = fcntl(fd, F_GETFD)) < 0 ||
+	     fcntl(fd, F_SETFD, flags | FD_CLOEXEC) < 0) {
+		err("fcntl FD_CLOEXEC failed");
+		goto err;
+	}
+
+	/* check capability */
+	ret = drmGetCap(fd, DRM_CAP_DUMB_BUFFER, &has_dumb);
+	if (ret < 0 || has_dumb == 0) {
+		err("drmGetCap DRM_CAP_DUMB_BUFFER failed or doesn't have dumb "
+		    "buffer");
+		goto err;
+	}
+
+	return fd;
+err:
+	close(fd);
+	return -1;
+}
+
+static int drm_setup_output(struct drm_output *out)
+{
+	int ret;
+
+	/* Keep the cursor plane for the cursor */
+	ret = drm_find_plane_format(out, DRM_PLANE_TYPE_PRIMARY);
+	if (ret)
+		ret = drm_find_plane_format(out, DRM_PLANE_TYPE_OVERLAY);
+	if (ret) {
+		err("Cannot find plane");
+		return -1;
+	}
+
+	out->plane = drmModeGetPlane(drm_dev.fd, out->plane_id);
+	if (!out->plane) {
+		err("Cannot get plane");
+		return -1;
+	}
+
+	out->crtc = drmModeGetCrtc(drm_dev.fd, out->crtc_id);
+	if (!out->crtc) {
+		err("Cannot get crtc");
+		return -1;
+	}
+
+	out->conn = drmModeGetConnector(drm_dev.fd, out->conn_id);
+	if (!out->conn) {
+		err("Cannot get connector");
+		return -1;
+	}
+
+	ret = drm_get_plane_props(out->plane_id, &out->plane_props);
+	if (ret) {
+		err("Cannot get plane props");
+		return -1;
+	}
+
+	ret = drm_get_crtc_props(out);
+	if (ret) {
+		err("Cannot get crtc props");
+		return -1;
+	}
+
+	ret = drm_get_conn_props(out);
+	if (ret) {
+		err("Cannot get connector props");
+		return -1;
+	}
+
+	out->has_damage_clips = out->plane_props.fb_damage_clips != 0;
+	out->dirty_fb = true;
+	out->modeset = !out->crtc_active;
+
+	info("drm: Found plane_id: %u connector_id: %d crtc_id: %d",
+		out->plane_id, out->conn_id, out->crtc_id);
+
+	info("drm: %dx%d@%d (%dmm X% dmm) pixel format %c%c%c%c",
+	     out->mode.hdisplay, out->mode.vdisplay, out->mode.vrefresh, out->mmWidth, out->mmHeight,
+	     (out->fourcc>>0)&0xff, (out->fourcc>>8)&0xff, (out->fourcc>>16)&0xff, (out->fourcc>>24)&0xff);
+
+	return 0;
+}
+
+static int drm_setup(void)
+{
+	uint32_t i, cnt;
+	uint64_t cap;
+	int ret;
+
+	drm_dev.fd = drm_open(DRM_CARD);
+	if (drm_dev.fd < 0)
+		return -1;
+
+	ret = drmSetClientCap(drm_dev.fd, DRM_CLIENT_CAP_ATOMIC, 1);
+	if (ret) {
+		err("No atomic modesetting support: %s", strerror(errno));
+		goto err;
+	}
+
+#if DRM_WRITEBACK
+	if (drmSetClientCap(drm_dev.fd, DRM_CLIENT_CAP_WRITEBACK_CONNECTORS, 1))
+		info("drm: no writeback connector support");
+#endif
+
+	/* Else the timestamps of the page flips are taken when they are handled */
+	drm_dev.monotonic_ts = !drmGetCap(drm_dev.fd, DRM_CAP_TIMESTAMP_MONOTONIC, &cap) && cap;
+
+	ret = drm_find_connectors();
+	if (ret) {
+		err("available drm devices not found");
+		goto err;
+	}
+
+	/* Drop the outputs which can't be set up, e.g. no plane is left for them */
+	cnt = drm_dev.output_cnt;
+	drm_dev.output_cnt = 0;
+	for (i = 0; i < cnt; i++) {
+		if (i != drm_dev.output_cnt)
+			drm_dev.outputs[drm_dev.output_cnt] = drm_dev.outputs[i];
+
+		ret = drm_setup_output(&drm_dev.outputs[drm_dev.output_cnt]);
+		if (ret) {
+			err("Cannot set up connector %d", drm_dev.outputs[drm_dev.output_cnt].conn_id);
+			continue;
+		}
+
+		drm_dev.output_cnt++;
+	}
+
+	if (!drm_dev.output_cnt)
+		goto err;
+
+	drm_dev.drm_event_ctx.version = DRM_EVENT_CONTEXT_VERSION;
+	drm_dev.drm_event_ctx.page_flip_handler2 = page_flip_handler;
+
+	return 0;
+
+err:
+	close(drm_dev.fd);
+	return -1;
+}
+
+static int drm_allocate_dumb(struct drm_buffer *buf, uint32_t width, uint32_t height,
+			     uint32_t bpp, uint32_t fourcc)
+{
+	struct drm_mode_create_dumb creq;
+	struct drm_mode_map_dumb mreq;
+	uint32_t handles[4] = {0}, pitches[4] = {0}, offsets[4] = {0};
+	int ret;
+
+	/* create dumb buffer */
+	memset(&creq, 0, sizeof(creq));
+	creq.width = width;
+	creq.height = height;
+	creq.bpp = bpp;
+	ret = drmIoctl(drm_dev.fd, DRM_IOCTL_MODE_CREATE_DUMB, &creq);
+	if (ret < 0) {
+		err("DRM_IOCTL_MODE_CREATE_DUMB fail");
+		return -1;
+	}
+
+	buf->handle = creq.handle;
+	buf->pitch = creq.pitch;
+	dbg("pitch %d", buf->pitch);
+	buf->size = creq.size;
+	dbg("size %d", buf->size);
+
+	/* prepare buffer for memory mapping */
+	memset(&mreq, 0, sizeof(mreq));
+	mreq.handle = creq.handle;
+	ret = drmIoctl(drm_dev.fd, DRM_IOCTL_MODE_MAP_DUMB, &mreq);
+	if (ret) {
+		err("DRM_IOCTL_MODE_MAP_DUMB fail");
+		return -1;
+	}
+
+	buf->offset = mreq.offset;
+
+	/* perform actual memory mapping */
+	buf->map = mmap(0, creq.size, PROT_READ | PROT_WRITE, MAP_SHARED, drm_dev.fd, mreq.offset);
+	if (buf->map == MAP_FAILED) {
+		err("mmap fail");
+		return -1;
+	}
+
+	/* clear the framebuffer to 0 (= full transparency in ARGB8888) */
+	memset(buf->map, 0, creq.size);
+
+	/* create framebuffer object for the dumb-buffer */
+	handles[0] = creq.handle;
+	pitches[0] = creq.pitch;
+	offsets[0] = 0;
+	ret = drmModeAddFB2(drm_dev.fd, width, height, fourcc,
+			    handles, pitches, offsets, &buf->fb_handle, 0);
+	if (ret) {
+		err("drmModeAddFB fail");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int drm_setup_buffers(struct drm_output *out)
+{
+	uint32_t cnt = LV_CLAMP(2, DRM_BUFFERS, DRM_BUFFERS_MAX);
+	uint32_t i;
+
+	/* Zeroed like the dumb buffers, so all of them are in sync at frame 0 */
+	out->shadow_pitch = out->width * (LV_COLOR_SIZE / 8);
+	out->shadow = calloc(out->height, out->shadow_pitch);
+	if (!out->shadow) {
+		err("shadow buffer allocation failed");
+		return -1;
+	}
+	out->frame = 0;
+
+	/* Allocate DUMB buffers, the swap chain gets shorter if memory runs out */
+	out->buf_cnt = 0;
+	for (i = 0; i < cnt; i++) {
+		if (drm_allocate_dumb(&out->drm_bufs[i], out->width, out->height,
+				      out->bpp, out->fourcc))
+			break;
+
+		out->drm_bufs[i].frame = 0;
+		out->drm_bufs[i].state = DRM_BUF_FREE;
+		out->buf_cnt++;
+	}
+
+	if (out->buf_cnt < 2)
+		return -1;
+
+	if (out->buf_cnt < cnt)
+		info("drm: only %u of %u buffers allocated", out->buf_cnt, cnt);
+
+	/* Set buffering handling */
+	out->back = NULL;
+	out->queue_cnt = 0;
+	out->flip_buf = NULL;
+	out->scanout = NULL;
+	memset(&out->swap_stats, 0, sizeof(out->swap_stats));
+
+	return 0;
+}
+
+static void drm_free_dumb(struct drm_buffer *buf)
+{
+	struct drm_mode_destroy_dumb dreq;
+
+	drmModeRmFB(drm_dev.fd, buf->fb_handle);
+	munmap(buf->map, buf->size);
+
+	memset(&dreq, 0, sizeof(dreq));
+	dreq.handle = buf->handle;
+	drmIoctl(drm_dev.fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
+}
+
+static void drm_free_buffers(struct drm_output *out)
+{
+	uint32_t i;
+
+	for (i = 0; i < out->buf_cnt; i++) {
+		if (out->drm_bufs[i].damage_blob) {
+			drmModeDestroyPropertyBlob(drm_dev.fd, out->drm_bufs[i].damage_blob);
+			out->drm_bufs[i].damage_blob = 0;
+		}
+		drm_free_dumb(&out->drm_bufs[i]);
+	}
+
+	out->buf_cnt = 0;
+	out->last = NULL;
+
+	free(out->shadow);
+	out->shadow = NULL;
+}
+
+#if DRM_CURSOR
+/* Find a cursor plane for the output and allocate the buffers of the image */
+static int drm_setup_cursor(struct drm_output *out)
+{
+	uint64_t cap;
+	uint32_t i;
+
+	if (find_plane(DRM_FORMAT_ARGB8888, DRM_PLANE_TYPE_CURSOR, &out->cursor_plane_id,
+		       out->crtc_id, out->crtc_idx))
+		return -1;
+
+	if (drm_get_plane_props(out->cursor_plane_id, &out->cursor_props))
+		goto err;
+
+	out->cursor_w = drmGetCap(drm_dev.fd, DRM_CAP_CURSOR_WIDTH, &cap) ? 64 : cap;
+	out->cursor_h = drmGetCap(drm_dev.fd, DRM_CAP_CURSOR_HEIGHT, &cap) ? 64 : cap;
+
+	for (i = 0; i < 2; i++) {
+		if (drm_allocate_dumb(&out->cursor_bufs[i], out->cursor_w, out->cursor_h,
+				      32, DRM_FORMAT_ARGB8888)) {
+			if (i)
+				drm_free_dumb(&out->cursor_bufs[0]);
+			goto err;
+		}
+	}
+
+	info("drm: cursor plane_id: %u %ux%u", out->cursor_plane_id, out->cursor_w, out->cursor_h);
+
+	return 0;
+
+err:
+	out->cursor_plane_id = 0;
+	return -1;
+}
+#endif
+
+#if DRM_WRITEBACK
+static bool drm_wb_used(uint32_t conn_id)
+{
+	uint32_t i;
+
+	for (i = 0; i < drm_dev.output_cnt; i++)
+		if (drm_dev.outputs[i].wb_conn_id == conn_id)
+			return true;
+
+	return false;
+}
+
+/* The first format of drm_formats in the WRITEBACK_PIXEL_FORMATS blob of the connector */
+static const struct drm_format *drm_wb_format(struct drm_output *out)
+{
+	const struct drm_format *format = NULL;
+	drmModeObjectPropertiesPtr props;
+	drmModePropertyBlobPtr blob = NULL;
+	const uint32_t *fourccs;
+	uint32_t i, j;
+
+	props = drmModeObjectGetProperties(drm_dev.fd, out->wb_conn_id, DRM_MODE_OBJECT_CONNECTOR);
+	if (!props)
+		return NULL;
+
+	for (i = 0; i < props->count_props; i++)
+		if (props->props[i] == out->wb_props.pixel_formats)
+			blob = drmModeGetPropertyBlob(drm_dev.fd, props->prop_values[i]);
+
+	drmModeFreeObjectProperties(props);
+	if (!blob)
+		return NULL;
+
+	fourccs = blob->data;
+	for (i = 0; i < sizeof(drm_formats) / sizeof(drm_formats[0]) && !format; i++)
+		for (j = 0; j < blob->length / sizeof(uint32_t); j++)
+			if (fourccs[j] == drm_formats[i].fourcc)
+				format = &drm_formats[i];
+
+	drmModeFreePropertyBlob(blob);
+
+	return format;
+}
+
+/* Find a writeback connector which can capture the CRTC of the output */
+static int drm_setup_writeback(struct drm_output *out)
+{
+	drmModeConnector *conn;
+	drmModeEncoder *enc;
 	drmModeRes *res;
-	int i;
+	int i, j;
+
+	res = drmModeGetResources(drm_dev.fd);
+	if (!res)
+		return -1;
+
+	for (i = 0; i < res->count_connectors && !out->wb_conn_id; i++) {
+		conn = drmModeGetConnector(drm_dev.fd, res->connectors[i]);
+		if (!conn)
+			continue;
+
+		if (conn->connector_type == DRM_MODE_CONNECTOR_WRITEBACK &&
+		    !drm_wb_used(conn->connector_id)) {
+			for (j = 0; j < conn->count_encoders && !out->wb_conn_id; j++) {
+				enc = drmModeGetEncoder(drm_dev.fd, conn->encoders[j]);
+				if (!enc)
+					continue;
+
+				if (enc->possible_crtcs & (1 << out->crtc_idx))
+					out->wb_conn_id = conn->connector_id;
+				drmModeFreeEncoder(enc);
+			}
+		}
+
+		drmModeFreeConnector(conn);
+	}
+
+	drmModeFreeResources(res);
+
+	if (!out->wb_conn_id)
+		return -1;
+
+	if (drm_get_prop_ids(out->wb_conn_id, DRM_MODE_OBJECT_CONNECTOR, drm_wb_prop_names,
+			     sizeof(drm_wb_prop_names) / sizeof(drm_wb_prop_names[0]), &out->wb_props))
+		goto err;
+
+	out->wb_format = drm_wb_format(out);
+	if (!out->wb_format)
+		goto err;
+
+	out->wb_fence = -1;
+
+	info("drm: writeback connector %u", out->wb_conn_id);
+
+	return 0;
+
+err:
+	out->wb_conn_id = 0;
+	return -1;
+}
+#endif
+
+/* Ask the kernel whether the plane can show a buffer with the output's mode */
+static int drm_test_output(struct drm_output *out)
+{
+	drm_req_reset();
+
+	out->flip_buf = &out->drm_bufs[0];
+	drm_add_output(out);
+	out->flip_buf = NULL;
+
+	return drm_req_commit(DRM_MODE_ATOMIC_TEST_ONLY | DRM_MODE_ATOMIC_ALLOW_MODESET);
+}
+
+/*
+ * (Re)allocate the buffers of an output to render `width` x `height` pixels.
+ * Smaller than the mode they are scaled up by the plane if it can do so.
+ */
+static int drm_resize_output(struct drm_output *out, uint32_t width, uint32_t height)
+{
+	bool test;
+	uint32_t i;
+
+	drm_free_buffers(out);
+
+	out->width = width;
+	out->height = height;
+	out->plane_dirty = true;
+#if DRM_EXPORT
+	out->export_gen++;
+#endif
+	if (!out->parent && !out->crtc_active)
+		out->modeset = true;
+
+	/* The layers of an output are scaled like it */
+	for (i = 0; i < drm_dev.output_cnt + drm_dev.layer_cnt; i++)
+		if (drm_dev.outputs[i].parent == out)
+			drm_dev.outputs[i].plane_dirty = true;
+
+	if (drm_setup_buffers(out))
+		return -1;
+
+	/* Scaling and overlays may be beyond the hardware, a layer is tested once the CRTC is on */
+	if (out->parent)
+		test = !out->parent->modeset;
+	else
+		test = width != out->mode.hdisplay || height != out->mode.vdisplay;
+
+	if (test && drm_test_output(out)) {
+		info("drm: plane %d can't show %ux%u on connector %d", out->plane_id, width, height,
+		     out->conn_id);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Allocate the buffers of an output set up by drm_setup_output(), its cursor and writeback */
+static int drm_start_output(struct drm_output *out)
+{
+	int ret;
+
+	ret = drm_resize_output(out, out->width, out->height);
+
+	/* Render at the mode's size if the plane can't scale */
+	if (ret && (out->width != out->mode.hdisplay || out->height != out->mode.vdisplay))
+		ret = drm_resize_output(out, out->mode.hdisplay, out->mode.vdisplay);
+
+	if (ret)
+		return ret;
+
+#if DRM_CURSOR
+	if (drm_setup_cursor(out))
+		info("drm: no cursor plane for connector %d", out->conn_id);
+#endif
+
+#if DRM_WRITEBACK
+	if (drm_setup_writeback(out))
+		info("drm: no writeback connector for connector %d, captures read the shadow buffer",
+		     out->conn_id);
+#endif
+
+	return 0;
+}
+
+/* Wait for a pending page flip, called with the lock held */
+static int drm_wait_flip(void)
+{
+#if DRM_NONBLOCK
+	return pthread_cond_wait(&drm_dev.flip_cond, &drm_dev.lock);
+#else
+	struct pollfd pfd;
+	int ret;
+
+	pfd.fd = drm_dev.fd;
+	pfd.events = POLLIN;
+
+	do {
+		ret = poll(&pfd, 1, -1);
+	} while (ret == -1 && errno == EINTR);
+
+	if (ret < 0) {
+		err("poll failed: %s", strerror(errno));
+		return -1;
+	}
+
+	ret = drmHandleEvent(drm_dev.fd, &drm_dev.drm_event_ctx);
+	drm_flips_handled();
+
+	return ret;
+#endif
+}
+
+void drm_wait_vsync(lv_disp_drv_t *disp_drv)
+{
+	drm_lock();
+
+	/*
+	 * The queued refreshes are committed after the flips. A layer waiting for
+	 * its output's first refresh has no flip to wait for, it stays queued.
+	 */
+	while (drm_commit_pending())
+		if (drm_wait_flip())
+			break;
+
+	drm_unlock();
+}
+
+#if !DRM_NONBLOCK
+/* Handle the page flips which already happened, without waiting for more */
+static void drm_poll_flips(void)
+{
+	struct pollfd pfd = { .fd = drm_dev.fd, .events = POLLIN };
+
+	while (drm_flip_pending() && poll(&pfd, 1, 0) > 0) {
+		if (drmHandleEvent(drm_dev.fd, &drm_dev.drm_event_ctx))
+			break;
+		drm_flips_handled();
+	}
+}
+#endif
+
+/* Take a free buffer for the next refresh, wait for a page flip if there is none */
+static struct drm_buffer *drm_acquire_buffer(struct drm_output *out)
+{
+	struct drm_buffer *buf = NULL;
+	uint32_t i;
+
+#if !DRM_NONBLOCK
+	/* Show the queue soon */
+	drm_poll_flips();
+#endif
+
+	drm_lock();
+
+	if (!drm_has_free_buffer(out))
+		out->swap_stats.stalls++;
+
+	/* The back buffer of a direct mode output may be held for the gather */
+	while (!drm_has_free_buffer(out) && drm_commit_pending())
+		if (drm_wait_flip())
+			break;
+
+	for (i = 0; i < out->buf_cnt; i++) {
+		if (out->drm_bufs[i].state == DRM_BUF_FREE) {
+			buf = &out->drm_bufs[i];
+			buf->state = DRM_BUF_BACK;
+			buf->refr_flips = out->flips;
+			break;
+		}
+	}
 
-	if ((res = drmModeGetResources(drm_dev.fd)) == NULL) {
-		err("drmModeGetResources() failed");
-		return -1;
+	drm_unlock();
+
+	return buf;
+}
+
+static void drm_damage_add(struct drm_damage *damage, const lv_area_t *area)
+{
+	lv_area_t a = *area;
+	uint32_t i = 0;
+
+	/* Merge the overlapping ones to copy every pixel once */
+	while (i < damage->cnt) {
+		if (_lv_area_is_on(&damage->areas[i], &a)) {
+			_lv_area_join(&a, &a, &damage->areas[i]);
+			damage->areas[i] = damage->areas[--damage->cnt];
+			i = 0;
+		} else {
+			i++;
+		}
 	}
 
-	if (res->count_crtcs <= 0) {
-		err("no Crtcs");
-		goto free_res;
+	/* No more space: grow the last one */
+	if (damage->cnt == DRM_DAMAGE_MAX)
+		_lv_area_join(&damage->areas[DRM_DAMAGE_MAX - 1], &damage->areas[DRM_DAMAGE_MAX - 1], &a);
+	else
+		damage->areas[damage->cnt++] = a;
+}
+
+/* Copy an area of LVGL's pixels to a buffer, converted to its format if needed */
+static void drm_copy_area(struct drm_output *out, struct drm_buffer *buf, const uint8_t *src,
+			  uint32_t src_pitch, const lv_area_t *area)
+{
+	uint32_t w = area->x2 - area->x1 + 1;
+	uint8_t *dst = (uint8_t *)buf->map + buf->pitch * area->y1 + area->x1 * (out->bpp / 8);
+	int32_t y;
+
+	for (y = area->y1; y <= area->y2; y++) {
+		if (out->conv)
+			out->conv(dst, (const lv_color_t *)src, w);
+		else
+			memcpy(dst, src, w * (LV_COLOR_SIZE / 8));
+
+		dst += buf->pitch;
+		src += src_pitch;
 	}
+}
 
-	/* find all available connectors */
-	for (i = 0; i < res->count_connectors; i++) {
-		conn = drmModeGetConnector(drm_dev.fd, res->connectors[i]);
-		if (!conn)
-			continue;
+static void drm_copy_forward(struct drm_output *out, struct drm_buffer *buf, const uint8_t *src,
+			     uint32_t src_pitch, const lv_area_t *area)
+{
+	src += src_pitch * area->y1 + area->x1 * (LV_COLOR_SIZE / 8);
+	drm_copy_area(out, buf, src, src_pitch, area);
+}
 
-#if DRM_CONNECTOR_ID >= 0
-		if (conn->connector_id != DRM_CONNECTOR_ID) {
-			drmModeFreeConnector(conn);
-			continue;
+/*
+ * Bring a buffer up to date like with EGL's buffer age: copy the union of
+ * the areas refreshed since its content was last updated from the shadow,
+ * or in direct mode from the buffer of the newest frame.
+ */
+static void drm_update_buffer(struct drm_output *out, struct drm_buffer *buf)
+{
+	struct drm_damage damage;
+	uint32_t age = out->frame - buf->frame;
+	const uint8_t *src = out->shadow;
+	uint32_t src_pitch = out->shadow_pitch;
+	uint32_t f, i;
+
+	if (out->direct) {
+		if (!out->last || out->last == buf)
+			return;
+		src = out->last->map;
+		src_pitch = out->last->pitch;
+	}
+
+	if (age > DRM_DAMAGE_HISTORY) {
+		lv_area_t full = {0, 0, out->width - 1, out->height - 1};
+		drm_copy_forward(out, buf, src, src_pitch, &full);
+	} else {
+		damage.cnt = 0;
+		for (f = buf->frame + 1; f != out->frame + 1; f++)
+			for (i = 0; i < out->damage[f % DRM_DAMAGE_HISTORY].cnt; i++)
+				drm_damage_add(&damage, &out->damage[f % DRM_DAMAGE_HISTORY].areas[i]);
+
+		for (i = 0; i < damage.cnt; i++)
+			drm_copy_forward(out, buf, src, src_pitch, &damage.areas[i]);
+	}
+
+	buf->frame = out->frame;
+}
+
+/* Take the back buffer of the next refresh and bring it up to date */
+static struct drm_buffer *drm_start_refresh(struct drm_output *out)
+{
+	struct drm_buffer *buf;
+
+	buf = drm_acquire_buffer(out);
+	if (!buf)
+		return NULL;
+
+	/* Only the areas changed since buf was on the screen */
+	drm_update_buffer(out, buf);
+	out->damage[(out->frame + 1) % DRM_DAMAGE_HISTORY].cnt = 0;
+	out->back = buf;
+
+	return buf;
+}
+
+static void drm_flush_output(struct drm_output *out, lv_disp_drv_t *disp_drv, const lv_area_t *area,
+			     lv_color_t *color_p)
+{
+	struct drm_buffer *fbuf = out->back;
+	struct drm_damage *damage = &out->damage[(out->frame + 1) % DRM_DAMAGE_HISTORY];
+	lv_coord_t w = (area->x2 - area->x1 + 1);
+	uint32_t x = area->x1 * (LV_COLOR_SIZE / 8);
+	bool ready = true;
+	int i, y;
+
+	dbg("x %d:%d y %d:%d w %d", area->x1, area->x2, area->y1, area->y2, w);
+
+#if DRM_HOTPLUG
+	out->drv = disp_drv;
+
+	/* Nothing to show it on, the screen is redrawn when it's plugged in again */
+	if ((out->parent ? out->parent : out)->unplugged) {
+		lv_disp_flush_ready(disp_drv);
+		return;
+	}
+#endif
+
+	if (!fbuf)
+		fbuf = drm_start_refresh(out);
+
+	if (!fbuf) {
+		err("No free buffer");
+		lv_disp_flush_ready(disp_drv);
+		return;
+	}
+
+	/* In direct mode LVGL has rendered into fbuf already */
+	if (!out->direct) {
+		for (y = 0, i = area->y1 ; i <= area->y2 ; ++i, ++y) {
+			const uint8_t *src = (uint8_t *)color_p + (w * (LV_COLOR_SIZE/8) * y);
+
+			memcpy(out->shadow + x + (out->shadow_pitch * i), src, w * (LV_COLOR_SIZE/8));
 		}
+
+		drm_copy_area(out, fbuf, (uint8_t *)color_p, w * (LV_COLOR_SIZE/8), area);
+	}
+
+	drm_damage_add(damage, area);
+
+	/* Show the refresh at once with the merged damage */
+	if (!lv_disp_flush_is_last(disp_drv)) {
+		lv_disp_flush_ready(disp_drv);
+		return;
+	}
+
+	out->back = NULL;
+	out->frame++;
+	fbuf->frame = out->frame;
+
+	/* Queue fbuf, it may wait for the pending page flips to be committed with other outputs */
+	drm_lock();
+
+	fbuf->state = DRM_BUF_QUEUED;
+	out->queue[out->queue_cnt++] = fbuf;
+	out->last = fbuf;
+	fbuf->flush_us = drm_time_us();
+	/* The vblanks passed since the last flip tell the one it can be shown from */
+	fbuf->vblank_seq = 0;
+	if (out->flips && out->period_us && fbuf->flush_us > out->swap_stats.flip_us)
+		fbuf->vblank_seq = out->flip_seq + 1 +
+			(fbuf->flush_us - out->swap_stats.flip_us) / out->period_us;
+#if DRM_NONBLOCK
+	out->prev_queue_us = out->queue_us;
+	out->queue_us = fbuf->flush_us;
+#endif
+	/*
+	 * Without DRM_NONBLOCK nothing could commit a held refresh later, so an
+	 * output is only committed with the others which are ready at this moment
+	 */
+	drm_commit_queued();
+
+#if !DRM_NONBLOCK
+	/*
+	 * Nothing reads the events while LVGL is idle: wait for the flip the
+	 * refresh is queued behind and commit it, or it's never shown
+	 */
+	while (out->queue_cnt && drm_flip_pending())
+		if (drm_wait_flip())
+			break;
+#endif
+
+	out->swap_stats.frames++;
+	out->swap_stats.queued = out->queue_cnt + (out->flip_buf ? 1 : 0);
+	if (out->swap_stats.queued > out->swap_stats.max_queued)
+		out->swap_stats.max_queued = out->swap_stats.queued;
+
+#if DRM_NONBLOCK
+	/* Let the page flip handler continue LVGL when a buffer gets free */
+	if (!out->direct && !drm_has_free_buffer(out)) {
+		out->ready_drv = disp_drv;
+		ready = false;
+	}
 #endif
 
-		if (conn->connection == DRM_MODE_CONNECTED) {
-			dbg("drm: connector %d: connected", conn->connector_id);
-		} else if (conn->connection == DRM_MODE_DISCONNECTED) {
-			dbg("drm: connector %d: disconnected", conn->connector_id);
-		} else if (conn->connection == DRM_MODE_UNKNOWNCONNECTION) {
-			dbg("drm: connector %d: unknownconnection", conn->connector_id);
+	drm_unlock();
+
+#if DRM_DIRECT_RENDER
+	/* Point LVGL to the next back buffer before it renders again */
+	if (out->direct) {
+		fbuf = drm_start_refresh(out);
+		if (fbuf) {
+			disp_drv->draw_buf->buf1 = fbuf->map;
+			disp_drv->draw_buf->buf_act = fbuf->map;
 		} else {
-			dbg("drm: connector %d: unknown", conn->connector_id);
+			err("No free buffer");
 		}
+	}
+#endif
 
-		if (conn->connection == DRM_MODE_CONNECTED && conn->count_modes > 0)
-			break;
+	if (ready)
+		lv_disp_flush_ready(disp_drv);
+}
 
-		drmModeFreeConnector(conn);
-		conn = NULL;
-	};
+void drm_flush(lv_disp_drv_t *disp_drv, const lv_area_t *area, lv_color_t *color_p)
+{
+	drm_flush_output(&drm_dev.outputs[0], disp_drv, area, color_p);
+}
 
-	if (!conn) {
-		err("suitable connector not found");
-		goto free_res;
+/**
+ * Flush a buffer to the output bound to `drv` by `drm_bind()`
+ * @param drv pointer to driver where this function belongs
+ * @param area an area where to copy `color_p`
+ * @param color_p an array of pixel to copy to the `area` part of the screen
+ */
+void drm_output_flush(lv_disp_drv_t *drv, const lv_area_t *area, lv_color_t *color_p)
+{
+	drm_flush_output(drv->user_data, drv, area, color_p);
+}
+
+static void drm_output_swap_stats(struct drm_output *out, drm_swap_stats_t *stats)
+{
+	uint64_t now = drm_time_us();
+
+	if (!out || !stats)
+		return;
+
+	drm_lock();
+	*stats = out->swap_stats;
+	stats->buf_cnt = out->buf_cnt;
+	stats->refresh_rate = (out->parent ? out->parent : out)->mode.vrefresh;
+
+	/* Let the rate drop if the flips stopped */
+	if (out->fps_start_us && now - out->fps_start_us >= 2000000)
+		stats->fps = drm_fps(out, now);
+	drm_unlock();
+}
+
+/**
+ * Get the statistics of the swap chain
+ * @param stats the statistics are copied here
+ */
+void drm_get_swap_stats(drm_swap_stats_t *stats)
+{
+	drm_output_swap_stats(&drm_dev.outputs[0], stats);
+}
+
+/**
+ * Get the statistics of the swap chain of an output
+ * @param out an output returned by `drm_get_output()`
+ * @param stats the statistics are copied here
+ */
+void drm_output_get_swap_stats(drm_output_t *out, drm_swap_stats_t *stats)
+{
+	drm_output_swap_stats(out, stats);
+}
+
+#if DRM_DIRECT_RENDER
+/**
+ * Set up `drv` to render directly into the dumb buffers in LVGL's direct mode
+ * (or full refresh mode if `drv->full_refresh` is set), so flushing is only an
+ * atomic commit. Call it after `drm_init()` (and `drm_bind()`) and before
+ * registering `drv`.
+ * The damage of partial refreshes is carried forward between the buffers.
+ * @param drv pointer to an initialized display driver
+ * @param draw_buf a draw buffer to initialize with the back buffer
+ * @return true: direct mode is set up; false: the buffers don't allow it
+ */
+bool drm_set_direct_render(lv_disp_drv_t *drv, lv_disp_draw_buf_t *draw_buf)
+{
+	struct drm_output *out = drv->flush_cb == drm_output_flush ? drv->user_data : &drm_dev.outputs[0];
+	struct drm_buffer *buf;
+
+	if (drm_dev.fd < 0 || out->buf_cnt < 2)
+		return false;
+
+	/* The flushed areas are not copied, so they can't be rotated */
+	if (drv->rotated != LV_DISP_ROT_NONE) {
+		err("Direct render doesn't support rotation");
+		return false;
+	}
+
+	/* LVGL can only render into buffers in its own format */
+	if (out->conv) {
+		err("Direct render needs a plane in LVGL's pixel format");
+		return false;
 	}
 
-	drm_dev.conn_id = conn->connector_id;
-	dbg("conn_id: %d", drm_dev.conn_id);
-	drm_dev.mmWidth = conn->mmWidth;
-	drm_dev.mmHeight = conn->mmHeight;
+	/* LVGL addresses the buffer with `hor_res` pixel wide rows */
+	if (out->drm_bufs[0].pitch != out->width * (LV_COLOR_SIZE / 8)) {
+		err("Direct render needs dumb buffers without row padding");
+		return false;
+	}
 
-	memcpy(&drm_dev.mode, &conn->modes[0], sizeof(drmModeModeInfo));
+	out->direct = true;
 
-	if (drmModeCreatePropertyBlob(drm_dev.fd, &drm_dev.mode, sizeof(drm_dev.mode),
-				      &drm_dev.blob_id)) {
-		err("error creating mode blob");
-		goto free_res;
+	buf = out->back ? out->back : drm_start_refresh(out);
+	if (!buf) {
+		out->direct = false;
+		return false;
 	}
 
-	drm_dev.width = conn->modes[0].hdisplay;
-	drm_dev.height = conn->modes[0].vdisplay;
+	/* The newest frame is in the dumb buffers from now on */
+	free(out->shadow);
+	out->shadow = NULL;
 
-	for (i = 0 ; i < res->count_encoders; i++) {
-		enc = drmModeGetEncoder(drm_dev.fd, res->encoders[i]);
-		if (!enc)
-			continue;
+	/* The driver swaps `buf1` to the next back buffer on the last flush */
+	lv_disp_draw_buf_init(draw_buf, buf->map, NULL, out->width * out->height);
 
-		dbg("enc%d enc_id %d conn enc_id %d", i, enc->encoder_id, conn->encoder_id);
+	drv->draw_buf = draw_buf;
+	if (!drv->full_refresh)
+		drv->direct_mode = 1;
+	drv->hor_res = out->width;
+	drv->ver_res = out->height;
 
-		if (enc->encoder_id == conn->encoder_id)
-			break;
+	return true;
+}
+#endif /* DRM_DIRECT_RENDER */
 
-		drmModeFreeEncoder(enc);
-		enc = NULL;
+/**
+ * Get the resolution and the DPI of an output
+ * @param out an output returned by `drm_get_output()`
+ * @param width store the horizontal resolution here (can be NULL)
+ * @param height store the vertical resolution here (can be NULL)
+ * @param dpi store the DPI here if the size of the screen is known (can be NULL)
+ */
+void drm_output_get_sizes(drm_output_t *out, lv_coord_t *width, lv_coord_t *height, uint32_t *dpi)
+{
+	if (width)
+		*width = out->width;
+
+	if (height)
+		*height = out->height;
+
+	if (dpi && out->mmWidth)
+		*dpi = DIV_ROUND_UP(out->width * 25400, out->mmWidth * 1000);
+}
+
+void drm_get_sizes(lv_coord_t *width, lv_coord_t *height, uint32_t *dpi)
+{
+	drm_output_get_sizes(&drm_dev.outputs[0], width, height, dpi);
+}
+
+/* The buffers can be changed if no refresh is in progress and LVGL doesn't render into them */
+static int drm_output_idle(struct drm_output *out)
+{
+	if (out->parent) {
+		err("the size of a layer is fixed");
+		return -1;
 	}
 
-	if (enc) {
-		drm_dev.enc_id = enc->encoder_id;
-		dbg("enc_id: %d", drm_dev.enc_id);
-		drm_dev.crtc_id = enc->crtc_id;
-		dbg("crtc_id: %d", drm_dev.crtc_id);
-		drmModeFreeEncoder(enc);
+	if (out->back || out->direct) {
+		err("buffers of connector %d are in use", out->conn_id);
+		return -1;
+	}
+
+	/* Let the queued refreshes complete */
+	drm_wait_vsync(NULL);
+
+	return 0;
+}
+
+/*
+ * Set `mode` with the next refresh. If the output rendered at the size of the
+ * old mode it continues with the size of the new one. No refresh may be in
+ * progress.
+ */
+static int drm_output_apply_mode(struct drm_output *out, const drmModeModeInfo *mode)
+{
+	drmModeModeInfo old_mode = out->mode;
+	uint32_t old_blob = out->blob_id;
+	uint32_t old_width = out->width, old_height = out->height;
+	bool native = out->width == out->mode.hdisplay && out->height == out->mode.vdisplay;
+	uint32_t width, height;
+
+	if (drmModeCreatePropertyBlob(drm_dev.fd, mode, sizeof(*mode), &out->blob_id)) {
+		err("error creating mode blob");
+		out->blob_id = old_blob;
+		return -1;
+	}
+
+	memcpy(&out->mode, mode, sizeof(drmModeModeInfo));
+	out->period_us = 1000000 / (out->mode.vrefresh ? out->mode.vrefresh : 60);
+	out->crtc_active = false;
+
+	if (native) {
+		width = out->mode.hdisplay;
+		height = out->mode.vdisplay;
 	} else {
-		/* Encoder hasn't been associated yet, look it up */
-		for (i = 0; i < conn->count_encoders; i++) {
-			int crtc, crtc_id = -1;
+		width = out->width;
+		height = out->height;
+	}
 
-			enc = drmModeGetEncoder(drm_dev.fd, conn->encoders[i]);
-			if (!enc)
-				continue;
+	/* The buffers fit the same size, e.g. LVGL keeps rendering into them in direct mode */
+	if (out->mode.hdisplay == old_mode.hdisplay && out->mode.vdisplay == old_mode.vdisplay) {
+		out->modeset = true;
+	} else if (out->direct || drm_resize_output(out, width, height)) {
+		if (out->direct)
+			err("connector %d renders directly, its size can't change", out->conn_id);
+		drmModeDestroyPropertyBlob(drm_dev.fd, out->blob_id);
+		out->blob_id = old_blob;
+		out->mode = old_mode;
+		out->period_us = 1000000 / (out->mode.vrefresh ? out->mode.vrefresh : 60);
+		if (!out->direct)
+			drm_resize_output(out, old_width, old_height);
+		return -1;
+	}
 
-			for (crtc = 0 ; crtc < res->count_crtcs; crtc++) {
-				uint32_t crtc_mask = 1 << crtc;
+	drmModeDestroyPropertyBlob(drm_dev.fd, old_blob);
+	info("drm: connector %d set to %dx%d@%d", out->conn_id,
+	     out->mode.hdisplay, out->mode.vdisplay, out->mode.vrefresh);
 
-				crtc_id = res->crtcs[crtc];
+	return 0;
+}
 
-				dbg("enc_id %d crtc%d id %d mask %x possible %x", enc->encoder_id, crtc, crtc_id, crtc_mask, enc->possible_crtcs);
+/**
+ * Change the mode of an output, it's set with the next refresh.
+ * If the output rendered at the size of the old mode it continues
+ * with the size of the new one. Call `drm_output_get_sizes()` and update
+ * the display driver after it, the screen has to be redrawn.
+ * @param out an output returned by `drm_get_output()`
+ * @param width horizontal resolution of the mode or 0 for any
+ * @param height vertical resolution of the mode or 0 for any
+ * @param refresh refresh rate in Hz or 0 for any
+ * @return 0 on success, -1 if the connector has no such mode or the buffers can't be allocated
+ */
+int drm_output_set_mode(drm_output_t *out, uint32_t width, uint32_t height, uint32_t refresh)
+{
+	drmModeModeInfo *mode;
 
-				if (enc->possible_crtcs & crtc_mask)
-					break;
-			}
+	if (drm_output_idle(out))
+		return -1;
 
-			if (crtc_id > 0) {
-				drm_dev.enc_id = enc->encoder_id;
-				dbg("enc_id: %d", drm_dev.enc_id);
-				drm_dev.crtc_id = crtc_id;
-				dbg("crtc_id: %d", drm_dev.crtc_id);
-				break;
-			}
+	mode = drm_find_mode(out->conn, width, height, refresh);
+	if (!mode) {
+		err("connector %d has no %ux%u@%u mode", out->conn_id, width, height, refresh);
+		return -1;
+	}
 
-			drmModeFreeEncoder(enc);
-			enc = NULL;
+	return drm_output_apply_mode(out, mode);
+}
+
+/**
+ * Render an output at a lower resolution and let its plane scale it up to the
+ * mode's size. It saves rendering and copying on large screens. Call
+ * `drm_output_get_sizes()` and update the display driver after it, the screen
+ * has to be redrawn.
+ * @param out an output returned by `drm_get_output()`
+ * @param width horizontal resolution to render at, 0 for the mode's
+ * @param height vertical resolution to render at, 0 for the mode's
+ * @return 0 on success, -1 if the plane can't scale or the buffers can't be allocated
+ */
+int drm_output_set_render_size(drm_output_t *out, uint32_t width, uint32_t height)
+{
+	uint32_t old_width = out->width, old_height = out->height;
+
+	if (!width)
+		width = out->mode.hdisplay;
+	if (!height)
+		height = out->mode.vdisplay;
+
+	if (drm_output_idle(out))
+		return -1;
+
+	if (drm_resize_output(out, width, height)) {
+		drm_resize_output(out, old_width, old_height);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Get the number of connected outputs set up by `drm_init()`, at most `DRM_OUTPUTS`
+ * @return number of outputs
+ */
+uint32_t drm_get_output_count(void)
+{
+	return drm_dev.fd < 0 ? 0 : drm_dev.output_cnt;
+}
+
+/**
+ * Get an output set up by `drm_init()`. Every output has its own CRTC and plane.
+ * @param idx index of the output, 0 is the one used by `drm_flush()`
+ * @return the output or NULL if `idx` is invalid
+ */
+drm_output_t *drm_get_output(uint32_t idx)
+{
+	return idx < drm_get_output_count() ? &drm_dev.outputs[idx] : NULL;
+}
+
+/**
+ * Make a display driver draw to an output: set its flush callback,
+ * resolution and `user_data`. Call it before registering `drv`.
+ * The refreshes of the outputs are shown with a common atomic commit.
+ * @param out an output returned by `drm_get_output()`
+ * @param drv pointer to an initialized display driver
+ */
+void drm_bind(drm_output_t *out, lv_disp_drv_t *drv)
+{
+#if DRM_HOTPLUG
+	out->drv = drv;
+#endif
+	drv->user_data = out;
+	drv->flush_cb = drm_output_flush;
+	drv->hor_res = out->width;
+	drv->ver_res = out->height;
+}
+
+#if DRM_CURSOR
+/**
+ * Show an image with the cursor plane of an output. It's drawn by the display
+ * hardware on top of the screen, so LVGL doesn't have to redraw anything when
+ * the pointer moves. Use it instead of `lv_indev_set_cursor()`.
+ * @param out an output returned by `drm_get_output()`
+ * @param img image of the cursor, at most 64x64 pixels on most hardware, NULL to hide the cursor
+ * @param hot_x x coordinate of the image's point placed at the pointer
+ * @param hot_y y coordinate of the image's point placed at the pointer
+ * @return false if the output has no cursor plane or the image is too large
+ */
+bool drm_cursor_set_image(drm_output_t *out, const lv_img_dsc_t *img, lv_coord_t hot_x, lv_coord_t hot_y)
+{
+	struct drm_buffer *buf;
+	lv_color_t color;
+	uint32_t c, *px;
+	lv_opa_t a;
+	lv_coord_t x, y;
+
+	if (!out->cursor_plane_id)
+		return false;
+
+	if (img && (img->header.w > out->cursor_w || img->header.h > out->cursor_h)) {
+		err("cursor image is larger than %ux%u", out->cursor_w, out->cursor_h);
+		return false;
+	}
+
+	drm_lock();
+
+	if (img) {
+		/* Premultiplied ARGB8888, the rest of the buffer is transparent */
+		buf = &out->cursor_bufs[out->cursor_idx ^ 1];
+		memset(buf->map, 0, buf->size);
+		for (y = 0; y < img->header.h; y++) {
+			px = (uint32_t *)((uint8_t *)buf->map + buf->pitch * y);
+			for (x = 0; x < img->header.w; x++) {
+				color = lv_img_buf_get_px_color((lv_img_dsc_t *)img, x, y, lv_color_black());
+				a = lv_img_buf_get_px_alpha((lv_img_dsc_t *)img, x, y);
+				if (img->header.cf == LV_IMG_CF_TRUE_COLOR_CHROMA_KEYED &&
+				    color.full == LV_COLOR_CHROMA_KEY.full)
+					a = LV_OPA_TRANSP;
+
+				c = lv_color_to32(color);
+				px[x] = (uint32_t)a << 24 |
+					(((c >> 16) & 0xff) * a / 255) << 16 |
+					(((c >> 8) & 0xff) * a / 255) << 8 |
+					((c & 0xff) * a / 255);
+			}
 		}
 
-		if (!enc) {
-			err("suitable encoder not found");
-			goto free_res;
+		out->cursor_idx ^= 1;
+		out->hot_x = hot_x;
+		out->hot_y = hot_y;
+	}
+
+	out->cursor_visible = img != NULL;
+	out->cursor_dirty = true;
+
+	/* Else it's set with the next refresh or after the pending page flip */
+	drm_show_again(out);
+
+	drm_unlock();
+
+	return true;
+}
+
+/**
+ * Move the cursor of an output. Only the position of the cursor plane is
+ * changed, nothing is rendered. Call it from the pointer's `read_cb`.
+ * @param out an output returned by `drm_get_output()`
+ * @param x x coordinate of the pointer in LVGL's coordinates
+ * @param y y coordinate of the pointer in LVGL's coordinates
+ */
+void drm_cursor_move(drm_output_t *out, lv_coord_t x, lv_coord_t y)
+{
+	if (!out->cursor_plane_id || (out->cursor_x == x && out->cursor_y == y))
+		return;
+
+#if !DRM_NONBLOCK
+	/* Nothing else reads the events while LVGL is idle */
+	drm_poll_flips();
+#endif
+
+	drm_lock();
+
+	out->cursor_x = x;
+	out->cursor_y = y;
+
+	/*
+	 * The position of the cursor plane is set with an atomic commit, so it
+	 * changes at a vblank. It goes with the refresh on the way, else the
+	 * buffer on the screen is committed again with it.
+	 */
+	if (out->cursor_visible) {
+		out->cursor_dirty = true;
+		drm_show_again(out);
+	}
+
+	drm_unlock();
+}
+#endif /* DRM_CURSOR */
+
+/* Hand the newest refresh LVGL flushed to `cb`, in the format LVGL renders */
+static int drm_capture_readback(struct drm_output *out, drm_capture_cb_t cb, void *user_data)
+{
+	drm_capture_t cap;
+
+	if (!out->last) {
+		err("connector %d has shown nothing yet", out->conn_id);
+		return -1;
+	}
+
+	/* In direct mode LVGL renders into the dumb buffers */
+	if (out->shadow) {
+		cap.data = out->shadow;
+		cap.pitch = out->shadow_pitch;
+	} else {
+		cap.data = out->last->map;
+		cap.pitch = out->last->pitch;
+	}
+
+	cap.width = out->width;
+	cap.height = out->height;
+	cap.fourcc = drm_formats[0].fourcc;
+	cap.composited = false;
+	cb(out, &cap, user_data);
+
+	return 0;
+}
+
+/**
+ * Capture the screen of an output. A writeback connector of the CRTC writes
+ * what the display shows, the planes blended and scaled, with the next
+ * refresh (or a repeat of the current one if LVGL refreshes nothing) without
+ * stalling the rendering. The callback is called once the writeback is done,
+ * from the event thread with DRM_NONBLOCK, else by the next `drm_flush()` or
+ * `drm_wait_vsync()`, with the lock held: it shall not call the driver.
+ * Without a writeback connector, and for layers, the callback gets the
+ * pixels LVGL flushed last right away.
+ * @param out an output returned by `drm_get_output()` or a layer
+ * @param cb called with the capture
+ * @param user_data passed to `cb`
+ * @return 0 on success, -1 if a capture is already in progress or nothing was shown yet
+ */
+int drm_output_capture(drm_output_t *out, drm_capture_cb_t cb, void *user_data)
+{
+#if DRM_WRITEBACK
+	if (out->wb_conn_id && !out->unplugged) {
+		drm_lock();
+
+		if (out->capture_req || out->capture_busy) {
+			drm_unlock();
+			err("a capture of connector %d is in progress", out->conn_id);
+			return -1;
 		}
 
-		drmModeFreeEncoder(enc);
-	}
-
-	drm_dev.crtc_idx = -1;
+		/* The writeback has the size of the mode, which may have changed */
+		if (out->wb_width != out->mode.hdisplay || out->wb_height != out->mode.vdisplay) {
+			if (out->wb_buf.map)
+				drm_free_dumb(&out->wb_buf);
+			out->wb_width = 0;
+			out->wb_height = 0;
+
+			if (drm_allocate_dumb(&out->wb_buf, out->mode.hdisplay, out->mode.vdisplay,
+					      out->wb_format->bpp, out->wb_format->fourcc)) {
+				memset(&out->wb_buf, 0, sizeof(out->wb_buf));
+				drm_unlock();
+				err("cannot allocate the writeback buffer of connector %d", out->conn_id);
+				return drm_capture_readback(out, cb, user_data);
+			}
 
-	for (i = 0; i < res->count_crtcs; ++i) {
-		if (drm_dev.crtc_id == res->crtcs[i]) {
-			drm_dev.crtc_idx = i;
-			break;
+			out->wb_width = out->mode.hdisplay;
+			out->wb_height = out->mode.vdisplay;
 		}
-	}
 
-	if (drm_dev.crtc_idx == -1) {
-		err("drm: CRTC not found");
-		goto free_res;
-	}
+		out->capture_cb = cb;
+		out->capture_user_data = user_data;
+		out->capture_req = true;
 
-	dbg("crtc_idx: %d", drm_dev.crtc_idx);
+		/* Else the capture goes with the next refresh */
+		drm_show_again(out);
 
-	return 0;
+		drm_unlock();
 
-free_res:
-	drmModeFreeResources(res);
+		return 0;
+	}
+#endif
 
-	return -1;
+	return drm_capture_readback(out, cb, user_data);
 }
 
-static int drm_open(const char *path)
+#if DRM_LAYERS
+/**
+ * Create an overlay layer: an overlay plane with its own buffers over an area
+ * of an output. Bind it to a display driver with `drm_bind()` like an output.
+ * The display hardware blends the layer over the output, so a changing layer
+ * (e.g. a video region) is rendered and committed without redrawing the
+ * static screen under it, and the other way around. Transparent layers need
+ * LV_COLOR_DEPTH 32 and `screen_transp` in the display driver.
+ * @param out an output returned by `drm_get_output()`
+ * @param x x coordinate of the layer's area on the output
+ * @param y y coordinate of the layer's area on the output
+ * @param width width of the layer
+ * @param height height of the layer
+ * @return the layer or NULL if there is no free overlay plane for it
+ */
+drm_output_t *drm_layer_create(drm_output_t *out, lv_coord_t x, lv_coord_t y,
+			       lv_coord_t width, lv_coord_t height)
 {
-	int fd, flags;
-	uint64_t has_dumb;
-	int ret;
-
-	fd = open(path, O_RDWR);
-	if (fd < 0) {
-		err("cannot open \"%s\"", path);
-		return -1;
+	struct drm_output *layer;
+
+	if (out->parent || drm_dev.layer_cnt >= DRM_LAYERS)
+		return NULL;
+
+	drm_lock();
+
+	layer = &drm_dev.outputs[drm_dev.output_cnt + drm_dev.layer_cnt];
+	memset(layer, 0, sizeof(*layer));
+	layer->parent = out;
+	layer->conn_id = out->conn_id;
+	layer->crtc_id = out->crtc_id;
+	layer->crtc_idx = out->crtc_idx;
+	layer->period_us = out->period_us;
+	layer->mmWidth = out->mmWidth * width / out->width;
+	layer->mmHeight = out->mmHeight * height / out->height;
+	layer->x = x;
+	layer->y = y;
+
+	if (drm_find_plane_format(layer, DRM_PLANE_TYPE_OVERLAY)) {
+		info("drm: no overlay plane left for connector %d", out->conn_id);
+		goto err;
 	}
 
-	/* set FD_CLOEXEC flag */
-	if ((flags = fcntl(fd, F_GETFD)) < 0 ||
-	     fcntl(fd, F_SETFD, flags | FD_CLOEXEC) < 0) {
-		err("fcntl FD_CLOEXEC failed");
+	if (drm_get_plane_props(layer->plane_id, &layer->plane_props))
 		goto err;
-	}
 
-	/* check capability */
-	ret = drmGetCap(fd, DRM_CAP_DUMB_BUFFER, &has_dumb);
-	if (ret < 0 || has_dumb == 0) {
-		err("drmGetCap DRM_CAP_DUMB_BUFFER failed or doesn't have dumb "
-		    "buffer");
+	layer->has_damage_clips = layer->plane_props.fb_damage_clips != 0;
+	layer->dirty_fb = true;
+
+	if (drm_resize_output(layer, width, height)) {
+		drm_free_buffers(layer);
 		goto err;
 	}
 
-	return fd;
+	drm_dev.layer_cnt++;
+
+	drm_unlock();
+
+	info("drm: layer plane_id: %u %dx%d at %d,%d", layer->plane_id, width, height, x, y);
+
+	return layer;
+
 err:
-	close(fd);
-	return -1;
+	drm_unlock();
+
+	return NULL;
 }
 
-static int drm_setup(unsigned int fourcc)
+/**
+ * Move a layer on its output, it's moved with its next refresh
+ * @param layer a layer returned by `drm_layer_create()`
+ * @param x new x coordinate of the layer's area on the output
+ * @param y new y coordinate of the layer's area on the output
+ */
+void drm_layer_set_pos(drm_output_t *layer, lv_coord_t x, lv_coord_t y)
 {
-	int ret;
+	drm_lock();
+	layer->x = x;
+	layer->y = y;
+	layer->plane_dirty = true;
+	drm_unlock();
+}
+#endif /* DRM_LAYERS */
 
-	drm_dev.fd = drm_open(DRM_CARD);
-	if (drm_dev.fd < 0)
-		return -1;
+#if DRM_HOTPLUG
+/* Switch off the CRTC of an unplugged output and its planes, called with the lock held */
+static int drm_output_off(struct drm_output *out)
+{
+	struct drm_output *plane;
+	uint32_t i;
 
-	ret = drmSetClientCap(drm_dev.fd, DRM_CLIENT_CAP_ATOMIC, 1);
-	if (ret) {
-		err("No atomic modesetting support: %s", strerror(errno));
-		goto err;
-	}
+	drm_req_reset();
 
-	ret = drm_find_connector();
-	if (ret) {
-		err("available drm devices not found");
-		goto err;
-	}
+	for (i = 0; i < drm_dev.output_cnt + drm_dev.layer_cnt; i++) {
+		plane = &drm_dev.outputs[i];
+		if (plane != out && plane->parent != out)
+			continue;
 
-	ret = find_plane(fourcc, &drm_dev.plane_id, drm_dev.crtc_id, drm_dev.crtc_idx);
-	if (ret) {
-		err("Cannot find plane");
-		goto err;
-	}
+		drm_req_add(plane->plane_id, plane->plane_props.fb_id, 0);
+		drm_req_add(plane->plane_id, plane->plane_props.crtc_id, 0);
+		plane->plane_dirty = true;
 
-	drm_dev.plane = drmModeGetPlane(drm_dev.fd, drm_dev.plane_id);
-	if (!drm_dev.plane) {
-		err("Cannot get plane");
-		goto err;
+		if (plane->scanout) {
+			plane->scanout->state = DRM_BUF_FREE;
+			plane->scanout = NULL;
+		}
 	}
 
-	drm_dev.crtc = drmModeGetCrtc(drm_dev.fd, drm_dev.crtc_id);
-	if (!drm_dev.crtc) {
-		err("Cannot get crtc");
-		goto err;
+#if DRM_CURSOR
+	if (out->cursor_plane_id) {
+		drm_req_add(out->cursor_plane_id, out->cursor_props.fb_id, 0);
+		drm_req_add(out->cursor_plane_id, out->cursor_props.crtc_id, 0);
+		out->cursor_dirty = true;
 	}
+#endif
 
-	drm_dev.conn = drmModeGetConnector(drm_dev.fd, drm_dev.conn_id);
-	if (!drm_dev.conn) {
-		err("Cannot get connector");
-		goto err;
+#if DRM_WRITEBACK
+	if (out->wb_attached) {
+		drm_req_add(out->wb_conn_id, out->wb_props.crtc_id, 0);
+		out->wb_attached = false;
 	}
+#endif
 
-	ret = drm_get_plane_props();
-	if (ret) {
-		err("Cannot get plane props");
-		goto err;
-	}
+	drm_req_add(out->conn_id, out->conn_props.crtc_id, 0);
+	drm_req_add(out->crtc_id, out->crtc_props.active, 0);
+	drm_req_add(out->crtc_id, out->crtc_props.mode_id, 0);
 
-	ret = drm_get_crtc_props();
-	if (ret) {
-		err("Cannot get crtc props");
-		goto err;
+	out->crtc_active = false;
+	out->modeset = true;
+
+	return drm_req_commit(DRM_MODE_ATOMIC_ALLOW_MODESET);
+}
+
+static void drm_hotplug_notify_one(struct drm_output *out, bool connected)
+{
+	lv_disp_t *disp = NULL;
+
+	if (drm_dev.hotplug_cb) {
+		drm_dev.hotplug_cb(out, connected, drm_dev.hotplug_user_data);
+		return;
 	}
 
-	ret = drm_get_conn_props();
-	if (ret) {
-		err("Cannot get connector props");
-		goto err;
+	if (!connected || !out->drv)
+		return;
+
+	while ((disp = lv_disp_get_next(disp)) && disp->driver != out->drv)
+		;
+	if (!disp)
+		return;
+
+	/* The draw buffers of these modes have the size of the screen */
+	if ((out->drv->hor_res != out->width || out->drv->ver_res != out->height) &&
+	    (out->drv->full_refresh || out->drv->direct_mode)) {
+		err("connector %d changed its size, set a hotplug callback to update the display",
+		    out->conn_id);
+		return;
 	}
 
-	drm_dev.drm_event_ctx.version = DRM_EVENT_CONTEXT_VERSION;
-	drm_dev.drm_event_ctx.page_flip_handler = page_flip_handler;
-	drm_dev.fourcc = fourcc;
+	out->drv->hor_res = out->width;
+	out->drv->ver_res = out->height;
+	lv_disp_drv_update(disp, out->drv);
+}
 
-	info("drm: Found plane_id: %u connector_id: %d crtc_id: %d",
-		drm_dev.plane_id, drm_dev.conn_id, drm_dev.crtc_id);
+/* Let the application know, by default the displays of a plugged in output and its layers are redrawn */
+static void drm_hotplug_notify(struct drm_output *out, bool connected)
+{
+	uint32_t i;
 
-	info("drm: %dx%d (%dmm X% dmm) pixel format %c%c%c%c",
-	     drm_dev.width, drm_dev.height, drm_dev.mmWidth, drm_dev.mmHeight,
-	     (fourcc>>0)&0xff, (fourcc>>8)&0xff, (fourcc>>16)&0xff, (fourcc>>24)&0xff);
+	for (i = 0; i < drm_dev.output_cnt + drm_dev.layer_cnt; i++)
+		if (&drm_dev.outputs[i] == out || drm_dev.outputs[i].parent == out)
+			drm_hotplug_notify_one(&drm_dev.outputs[i], connected);
+}
 
-	return 0;
+static void drm_output_unplug(struct drm_output *out)
+{
+	/* Let the queued refreshes complete */
+	drm_wait_vsync(NULL);
 
-err:
-	close(drm_dev.fd);
-	return -1;
+	drm_lock();
+	if (drm_output_off(out))
+		err("cannot switch off connector %d: %s", out->conn_id, strerror(errno));
+	out->unplugged = true;
+	drm_unlock();
+
+	info("drm: connector %d unplugged", out->conn_id);
+	drm_hotplug_notify(out, false);
 }
 
-static int drm_allocate_dumb(struct drm_buffer *buf)
+/* Set the mode again for the screen plugged in, the output takes `conn` */
+static void drm_output_plug(struct drm_output *out, drmModeConnector *conn)
 {
-	struct drm_mode_create_dumb creq;
-	struct drm_mode_map_dumb mreq;
-	uint32_t handles[4] = {0}, pitches[4] = {0}, offsets[4] = {0};
 	int ret;
 
-	/* create dumb buffer */
-	memset(&creq, 0, sizeof(creq));
-	creq.width = drm_dev.width;
-	creq.height = drm_dev.height;
-	creq.bpp = LV_COLOR_DEPTH;
-	ret = drmIoctl(drm_dev.fd, DRM_IOCTL_MODE_CREATE_DUMB, &creq);
-	if (ret < 0) {
-		err("DRM_IOCTL_MODE_CREATE_DUMB fail");
-		return -1;
-	}
+	drm_wait_vsync(NULL);
 
-	buf->handle = creq.handle;
-	buf->pitch = creq.pitch;
-	dbg("pitch %d", buf->pitch);
-	buf->size = creq.size;
-	dbg("size %d", buf->size);
+	drmModeFreeConnector(out->conn);
+	out->conn = conn;
+	out->mmWidth = conn->mmWidth;
+	out->mmHeight = conn->mmHeight;
+
+	drm_lock();
+	ret = drm_output_apply_mode(out, drm_pick_mode(conn));
+	if (!ret)
+		out->unplugged = false;
+	drm_unlock();
 
-	/* prepare buffer for memory mapping */
-	memset(&mreq, 0, sizeof(mreq));
-	mreq.handle = creq.handle;
-	ret = drmIoctl(drm_dev.fd, DRM_IOCTL_MODE_MAP_DUMB, &mreq);
 	if (ret) {
-		err("DRM_IOCTL_MODE_MAP_DUMB fail");
-		return -1;
+		err("cannot set up connector %d again", out->conn_id);
+		if (!out->unplugged)
+			drm_output_unplug(out);
+		return;
 	}
 
-	buf->offset = mreq.offset;
-
-	/* perform actual memory mapping */
-	buf->map = mmap(0, creq.size, PROT_READ | PROT_WRITE, MAP_SHARED, drm_dev.fd, mreq.offset);
-	if (buf->map == MAP_FAILED) {
-		err("mmap fail");
-		return -1;
-	}
+	info("drm: connector %d plugged in", out->conn_id);
+	drm_hotplug_notify(out, true);
+}
 
-	/* clear the framebuffer to 0 (= full transparency in ARGB8888) */
-	memset(buf->map, 0, creq.size);
+static bool drm_conn_used(uint32_t conn_id)
+{
+	uint32_t i;
 
-	/* create framebuffer object for the dumb-buffer */
-	handles[0] = creq.handle;
-	pitches[0] = creq.pitch;
-	offsets[0] = 0;
-	ret = drmModeAddFB2(drm_dev.fd, drm_dev.width, drm_dev.height, drm_dev.fourcc,
-			    handles, pitches, offsets, &buf->fb_handle, 0);
-	if (ret) {
-		err("drmModeAddFB fail");
-		return -1;
-	}
+	for (i = 0; i < drm_dev.output_cnt; i++)
+		if (drm_dev.outputs[i].conn_id == conn_id)
+			return true;
 
-	return 0;
+	return false;
 }
 
-static int drm_setup_buffers(void)
+/* Make outputs of the connectors plugged in, there is room after the outputs until a layer is created */
+static void drm_hotplug_add(void)
 {
-	int ret;
+	drmModeConnector *conn;
+	struct drm_output *out;
+	drmModeRes *res;
+	int i, ret;
 
-	/* Allocate DUMB buffers */
-	ret = drm_allocate_dumb(&drm_dev.drm_bufs[0]);
-	if (ret)
-		return ret;
+	if (drm_dev.layer_cnt || drm_dev.output_cnt >= DRM_OUTPUTS)
+		return;
 
-	ret = drm_allocate_dumb(&drm_dev.drm_bufs[1]);
-	if (ret)
-		return ret;
+	res = drmModeGetResources(drm_dev.fd);
+	if (!res)
+		return;
 
-	/* Set buffering handling */
-	drm_dev.cur_bufs[0] = NULL;
-	drm_dev.cur_bufs[1] = &drm_dev.drm_bufs[0];
+	for (i = 0; i < res->count_connectors && drm_dev.output_cnt < DRM_OUTPUTS; i++) {
+		if (drm_conn_used(res->connectors[i]))
+			continue;
 
-	return 0;
+		conn = drmModeGetConnector(drm_dev.fd, res->connectors[i]);
+		if (!conn)
+			continue;
+
+		out = &drm_dev.outputs[drm_dev.output_cnt];
+		ret = drm_probe_connector(out, res, conn);
+		drmModeFreeConnector(conn);
+		if (ret)
+			continue;
+
+		/* The test commit of a resize uses the request the event thread commits with */
+		drm_lock();
+		if (drm_setup_output(out) || drm_start_output(out)) {
+			drm_unlock();
+			err("Cannot set up connector %d", out->conn_id);
+			drmModeDestroyPropertyBlob(drm_dev.fd, out->blob_id);
+			continue;
+		}
+
+		/* The event thread looks at the outputs */
+		drm_dev.output_cnt++;
+		drm_unlock();
+
+		info("drm: connector %d plugged in", out->conn_id);
+		drm_hotplug_notify(out, true);
+	}
+
+	drmModeFreeResources(res);
 }
 
-void drm_wait_vsync(lv_disp_drv_t *disp_drv)
+/* Follow the connectors after a hotplug event */
+static void drm_reprobe(void)
 {
-	int ret;
-	fd_set fds;
-	FD_ZERO(&fds);
-	FD_SET(drm_dev.fd, &fds);
+	drmModeConnector *conn;
+	struct drm_output *out;
+	uint32_t i, cnt = drm_dev.output_cnt;
+	bool connected;
+	int j;
 
-	do {
-		ret = select(drm_dev.fd + 1, &fds, NULL, NULL, NULL);
-	} while (ret == -1 && errno == EINTR);
+	for (i = 0; i < cnt; i++) {
+		out = &drm_dev.outputs[i];
 
-	if (ret < 0) {
-		err("select failed: %s", strerror(errno));
-		drmModeAtomicFree(drm_dev.req);
-		drm_dev.req = NULL;
-		return;
-	}
+		/* Probes the connector again */
+		conn = drmModeGetConnector(drm_dev.fd, out->conn_id);
+		connected = conn && conn->connection == DRM_MODE_CONNECTED && conn->count_modes > 0;
+
+		/* Another screen may have been plugged in without the mode of the old one */
+		for (j = 0; connected && !out->unplugged && j < conn->count_modes; j++)
+			if (!memcmp(&conn->modes[j], &out->mode, offsetof(drmModeModeInfo, type)))
+				break;
+
+		if (!connected && !out->unplugged) {
+			drm_output_unplug(out);
+		} else if (connected && (out->unplugged || j == conn->count_modes)) {
+			drm_output_plug(out, conn);
+			conn = NULL;
+		}
 
-	if (FD_ISSET(drm_dev.fd, &fds))
-		drmHandleEvent(drm_dev.fd, &drm_dev.drm_event_ctx);
+		if (conn)
+			drmModeFreeConnector(conn);
+	}
 
-	drmModeAtomicFree(drm_dev.req);
-	drm_dev.req = NULL;
+	drm_hotplug_add();
 }
 
-void drm_flush(lv_disp_drv_t *disp_drv, const lv_area_t *area, lv_color_t *color_p)
+/* True if a uevent (NUL separated KEY=VALUE strings) has `var` */
+static bool drm_uevent_has(const char *buf, size_t len, const char *var)
 {
-	struct drm_buffer *fbuf = drm_dev.cur_bufs[1];
-	lv_coord_t w = (area->x2 - area->x1 + 1);
-	lv_coord_t h = (area->y2 - area->y1 + 1);
-	int i, y;
+	size_t i;
+
+	for (i = 0; i < len; i += strlen(buf + i) + 1)
+		if (!strcmp(buf + i, var))
+			return true;
+
+	return false;
+}
 
-	dbg("x %d:%d y %d:%d w %d h %d", area->x1, area->x2, area->y1, area->y2, w, h);
+static void drm_hotplug_timer(lv_timer_t *timer)
+{
+	char buf[4096];
+	bool hotplug = false;
+	ssize_t len;
 
-	/* Partial update */
-	if ((w != drm_dev.width || h != drm_dev.height) && drm_dev.cur_bufs[0])
-		memcpy(fbuf->map, drm_dev.cur_bufs[0]->map, fbuf->size);
+	(void)timer;
 
-	for (y = 0, i = area->y1 ; i <= area->y2 ; ++i, ++y) {
-                memcpy((uint8_t *)fbuf->map + (area->x1 * (LV_COLOR_SIZE/8)) + (fbuf->pitch * i),
-                       (uint8_t *)color_p + (w * (LV_COLOR_SIZE/8) * y),
-		       w * (LV_COLOR_SIZE/8));
+	while ((len = recv(drm_dev.uevent_sock, buf, sizeof(buf) - 1, 0)) > 0) {
+		buf[len] = '\0';
+		if (drm_uevent_has(buf, len, "SUBSYSTEM=drm") && drm_uevent_has(buf, len, "HOTPLUG=1"))
+			hotplug = true;
 	}
 
-	if (drm_dev.req)
-		drm_wait_vsync(disp_drv);
+	/* One re-probe for a burst of events */
+	if (hotplug)
+		drm_reprobe();
+}
 
-	/* show fbuf plane */
-	if (drm_dmabuf_set_plane(fbuf)) {
-		err("Flush fail");
+/* Listen to the kernel's uevents like udev does, LVGL's timer handler reads them */
+static void drm_hotplug_open(void)
+{
+	struct sockaddr_nl addr;
+
+	drm_dev.uevent_sock = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+				     NETLINK_KOBJECT_UEVENT);
+	if (drm_dev.uevent_sock < 0) {
+		err("uevent socket failed: %s", strerror(errno));
 		return;
 	}
-	else
-		dbg("Flush done");
 
-	if (!drm_dev.cur_bufs[0])
-		drm_dev.cur_bufs[1] = &drm_dev.drm_bufs[1];
-	else
-		drm_dev.cur_bufs[1] = drm_dev.cur_bufs[0];
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = 1; /* the kernel's, not udev's */
 
-	drm_dev.cur_bufs[0] = fbuf;
+	if (bind(drm_dev.uevent_sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		err("uevent socket failed: %s", strerror(errno));
+		close(drm_dev.uevent_sock);
+		drm_dev.uevent_sock = -1;
+		return;
+	}
 
-	lv_disp_flush_ready(disp_drv);
+	drm_dev.hotplug_timer = lv_timer_create(drm_hotplug_timer, 100, NULL);
 }
 
-#if LV_COLOR_DEPTH == 32
-#define DRM_FOURCC DRM_FORMAT_ARGB8888
-#elif LV_COLOR_DEPTH == 16
-#define DRM_FOURCC DRM_FORMAT_RGB565
-#else
-#error LV_COLOR_DEPTH not supported
-#endif
-
-void drm_get_sizes(lv_coord_t *width, lv_coord_t *height, uint32_t *dpi)
+static void drm_hotplug_close(void)
 {
-	if (width)
-		*width = drm_dev.width;
+	if (drm_dev.uevent_sock < 0)
+		return;
 
-	if (height)
-		*height = drm_dev.height;
+	lv_timer_del(drm_dev.hotplug_timer);
+	close(drm_dev.uevent_sock);
+	drm_dev.uevent_sock = -1;
+}
 
-	if (dpi && drm_dev.mmWidth)
-		*dpi = DIV_ROUND_UP(drm_dev.width * 25400, drm_dev.mmWidth * 1000);
+/**
+ * Set the function called when an output is unplugged or plugged in (also
+ * one found after `drm_init()`, which needs a display driver bound to it).
+ * It's called from LVGL's timer handler once the output's buffers are set
+ * up for the screen plugged in: update the display driver with
+ * `drm_output_get_sizes()` and `lv_disp_drv_update()`. Without it the display
+ * driver of the output gets the new size and is redrawn.
+ * @param cb the function or NULL
+ * @param user_data passed to `cb`
+ */
+void drm_set_hotplug_cb(drm_hotplug_cb_t cb, void *user_data)
+{
+	drm_dev.hotplug_cb = cb;
+	drm_dev.hotplug_user_data = user_data;
 }
+#endif /* DRM_HOTPLUG */
 
 void drm_init(void)
 {
+	uint32_t i;
 	int ret;
 
-	ret = drm_setup(DRM_FOURCC);
+#if DRM_HOTPLUG
+	/* drm_exit() after a failed drm_init() has no socket to close */
+	drm_dev.uevent_sock = -1;
+#endif
+
+	ret = drm_setup();
 	if (ret) {
 		close(drm_dev.fd);
 		drm_dev.fd = -1;
 		return;
 	}
 
-	ret = drm_setup_buffers();
+	for (i = 0; i < drm_dev.output_cnt; i++) {
+		if (drm_start_output(&drm_dev.outputs[i])) {
+			err("DRM buffer allocation failed");
+			close(drm_dev.fd);
+			drm_dev.fd = -1;
+			return;
+		}
+	}
+
+#if DRM_EXPORT
+	drm_export_open();
+#endif
+
+#if DRM_HOTPLUG
+	drm_hotplug_open();
+#endif
+
+#if DRM_NONBLOCK
+	ret = drm_start_event_thread();
 	if (ret) {
-		err("DRM buffer allocation failed");
+#if DRM_EXPORT
+		drm_export_close();
+#endif
+#if DRM_HOTPLUG
+		drm_hotplug_close();
+#endif
 		close(drm_dev.fd);
 		drm_dev.fd = -1;
 		return;
 	}
+#endif
 
 	info("DRM subsystem and buffer mapped successfully");
 }
 
 void drm_exit(void)
 {
+	uint32_t i;
+
+	/* Let the queued refreshes complete */
+	drm_wait_vsync(NULL);
+
+#if DRM_NONBLOCK
+	drm_stop_event_thread();
+#endif
+
+#if DRM_EXPORT
+	drm_export_close();
+#endif
+
+#if DRM_HOTPLUG
+	drm_hotplug_close();
+#endif
+
+	for (i = 0; i < drm_dev.output_cnt + drm_dev.layer_cnt; i++) {
+		drm_free_buffers(&drm_dev.outputs[i]);
+#if DRM_CURSOR
+		if (drm_dev.outputs[i].cursor_plane_id) {
+			drm_free_dumb(&drm_dev.outputs[i].cursor_bufs[0]);
+			drm_free_dumb(&drm_dev.outputs[i].cursor_bufs[1]);
+		}
+#endif
+#if DRM_WRITEBACK
+		if (drm_dev.outputs[i].capture_busy)
+			close(drm_dev.outputs[i].wb_fence);
+		if (drm_dev.outputs[i].wb_buf.map)
+			drm_free_dumb(&drm_dev.outputs[i].wb_buf);
+#endif
+	}
+
 	close(drm_dev.fd);
 	drm_dev.fd = -1;
 }
@@ -36,6 +36,66 @@ extern "C" {
 /**********************
  *      TYPEDEFS
  **********************/
+/* An output (connector, CRTC and plane) of the card, see `drm_get_output()` */
+typedef struct drm_output drm_output_t;
+
+typedef struct {
+	uint32_t buf_cnt;	/* dumb buffers in the swap chain */
+	uint32_t frames;	/* refreshes queued to be shown */
+	uint32_t flips;		/* refreshes shown */
+	uint32_t queued;	/* refreshes waiting to be shown now */
+	uint32_t max_queued;
+	uint32_t stalls;	/* refreshes which had to wait for a free buffer */
+	uint32_t dropped_frames;	/* vblanks passed while a refresh was in progress */
+	uint32_t shared_commits;	/* flips committed together with other outputs */
+	uint32_t commit_cpu_us;	/* CPU time of the last atomic commit */
+	uint32_t max_commit_cpu_us;
+	uint64_t flip_us;	/* CLOCK_MONOTONIC time of the last page flip */
+	uint32_t latency_us;	/* flush to scanout of the last refresh */
+	uint32_t avg_latency_us;
+	uint32_t max_latency_us;
+	uint32_t missed_vblanks;	/* vblanks flushed refreshes weren't shown from, not counting the wait in the queue */
+	uint32_t fps;		/* page flips per second */
+	uint32_t refresh_rate;	/* of the mode in Hz */
+} drm_swap_stats_t;
+
+/*
+ * Messages on the DRM_EXPORT_SOCKET (SOCK_SEQPACKET). A consumer first gets
+ * the buffers of every output, then a frame message after each page flip.
+ * A buffer keeps its content until the driver renders into it again, which
+ * is after the next frame message of its output at the earliest.
+ */
+#define DRM_EXPORT_MSG_BUFFERS	1	/* the buffers' dma-buf fds are attached (SCM_RIGHTS) */
+#define DRM_EXPORT_MSG_FRAME	2	/* a buffer is on the screen */
+
+typedef struct {
+	uint32_t type;		/* DRM_EXPORT_MSG_... */
+	uint32_t output;	/* index of the output, the layers follow the outputs */
+	uint32_t buf;		/* frame: index of the buffer on the screen */
+	uint32_t buf_cnt;	/* buffers: number of fds attached, they replace the earlier ones */
+	uint32_t width;		/* buffers: size, row pitch in bytes and DRM fourcc */
+	uint32_t height;
+	uint32_t pitch;
+	uint32_t fourcc;
+	uint32_t frame;		/* frame: number of the refresh, gaps are frames not sent */
+	uint32_t sequence;	/* frame: vblank counter of the page flip */
+} drm_export_msg_t;
+
+/* A capture of the screen, see `drm_output_capture()` */
+typedef struct {
+	const void *data;	/* first row */
+	uint32_t width;
+	uint32_t height;
+	uint32_t pitch;		/* bytes per row */
+	uint32_t fourcc;	/* DRM format of the pixels */
+	bool composited;	/* all planes as the display shows them, else the output's own pixels */
+} drm_capture_t;
+
+/* Called with a capture, `cap` is NULL if it failed. The data is valid during the call */
+typedef void (*drm_capture_cb_t)(drm_output_t * out, const drm_capture_t * cap, void * user_data);
+
+/* Called when an output is unplugged or plugged in (`connected`), see `drm_set_hotplug_cb()` */
+typedef void (*drm_hotplug_cb_t)(drm_output_t * out, bool connected, void * user_data);
 
 /**********************
  * GLOBAL PROTOTYPES
@@ -45,6 +105,32 @@ void drm_get_sizes(lv_coord_t *width, lv_coord_t *height, uint32_t *dpi);
 void drm_exit(void);
 void drm_flush(lv_disp_drv_t * drv, const lv_area_t * area, lv_color_t * color_p);
 void drm_wait_vsync(lv_disp_drv_t * drv);
+void drm_get_swap_stats(drm_swap_stats_t * stats);
+bool drm_set_direct_render(lv_disp_drv_t * drv, lv_disp_draw_buf_t * draw_buf);
+
+/* Multiple outputs */
+uint32_t drm_get_output_count(void);
+drm_output_t * drm_get_output(uint32_t idx);
+void drm_bind(drm_output_t * out, lv_disp_drv_t * drv);
+void drm_output_flush(lv_disp_drv_t * drv, const lv_area_t * area, lv_color_t * color_p);
+void drm_output_get_sizes(drm_output_t * out, lv_coord_t *width, lv_coord_t *height, uint32_t *dpi);
+void drm_output_get_swap_stats(drm_output_t * out, drm_swap_stats_t * stats);
+int drm_output_set_mode(drm_output_t * out, uint32_t width, uint32_t height, uint32_t refresh);
+int drm_output_set_render_size(drm_output_t * out, uint32_t width, uint32_t height);
+
+/* Overlay layers, bound with drm_bind() like the outputs */
+drm_output_t * drm_layer_create(drm_output_t * out, lv_coord_t x, lv_coord_t y, lv_coord_t width, lv_coord_t height);
+void drm_layer_set_pos(drm_output_t * layer, lv_coord_t x, lv_coord_t y);
+
+/* Hardware cursor */
+bool drm_cursor_set_image(drm_output_t * out, const lv_img_dsc_t * img, lv_coord_t hot_x, lv_coord_t hot_y);
+void drm_cursor_move(drm_output_t * out, lv_coord_t x, lv_coord_t y);
+
+/* Screen capture */
+int drm_output_capture(drm_output_t * out, drm_capture_cb_t cb, void * user_data);
+
+/* Hotplug */
+void drm_set_hotplug_cb(drm_hotplug_cb_t cb, void * user_data);
 
 
 /**********************
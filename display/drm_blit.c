@@ -0,0 +1,536 @@
+/**
+ * @file drm_blit.c
+ * Pixel conversion kernels of the DRM driver
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+#include "drm_blit.h"
+#if USE_DRM
+
+#include <stdbool.h>
+#include <string.h>
+
+#include <drm_fourcc.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define DRM_BLIT_AVX2 1
+#define DRM_AVX2_FUNC __attribute__((target("avx2")))
+#else
+#define DRM_BLIT_AVX2 0
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define DRM_BLIT_NEON 1
+#else
+#define DRM_BLIT_NEON 0
+#endif
+
+/*********************
+ *      DEFINES
+ *********************/
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+/**********************
+ *  STATIC PROTOTYPES
+ **********************/
+#if DRM_BLIT_AVX2
+static bool cpu_has_avx2(void);
+#endif
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+
+/**********************
+ *      MACROS
+ **********************/
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+
+/*
+ * The 10 bit channels of XRGB2101010 repeat the high bits in the low ones, so
+ * black and white stay black and white.
+ */
+
+#if LV_COLOR_DEPTH == 32
+/*
+ * LV_COLOR_DEPTH 32: B, G, R, A bytes
+ */
+
+/* RGB888: B, G, R bytes */
+static void conv_32_to_888(uint8_t *dst, const lv_color_t *src, uint32_t px_cnt)
+{
+	uint32_t i;
+
+	/* Pack 4 pixels into 3 words */
+	for (i = 0; i + 4 <= px_cnt; i += 4) {
+		uint32_t p0 = src[i].full;
+		uint32_t p1 = src[i + 1].full;
+		uint32_t p2 = src[i + 2].full;
+		uint32_t p3 = src[i + 3].full;
+		uint32_t w[3];
+
+		w[0] = (p0 & 0xFFFFFF) | (p1 << 24);
+		w[1] = ((p1 >> 8) & 0xFFFF) | (p2 << 16);
+		w[2] = ((p2 >> 16) & 0xFF) | (p3 << 8);
+		memcpy(dst, w, 12);
+		dst += 12;
+	}
+
+	for (; i < px_cnt; i++) {
+		dst[0] = src[i].ch.blue;
+		dst[1] = src[i].ch.green;
+		dst[2] = src[i].ch.red;
+		dst += 3;
+	}
+}
+
+#if DRM_BLIT_AVX2
+DRM_AVX2_FUNC
+static void conv_32_to_888_avx2(uint8_t *dst, const lv_color_t *src, uint32_t px_cnt)
+{
+	/* Drop the alpha bytes in both lanes, then move the 2 x 12 bytes next to each other */
+	const __m256i shuf = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+					      0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	const __m256i perm = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+	uint32_t i;
+
+	for (i = 0; i + 8 <= px_cnt; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)&src[i]);
+
+		v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, shuf), perm);
+		/* Store exactly 24 bytes to not overwrite the pixels after the area */
+		_mm_storeu_si128((__m128i *)(dst + i * 3), _mm256_castsi256_si128(v));
+		_mm_storel_epi64((__m128i *)(dst + i * 3 + 16), _mm256_extracti128_si256(v, 1));
+	}
+
+	conv_32_to_888(dst + i * 3, src + i, px_cnt - i);
+}
+#endif
+
+#if DRM_BLIT_NEON
+static void conv_32_to_888_neon(uint8_t *dst, const lv_color_t *src, uint32_t px_cnt)
+{
+	uint32_t i;
+
+	for (i = 0; i + 16 <= px_cnt; i += 16) {
+		uint8x16x4_t v = vld4q_u8((const uint8_t *)&src[i]);
+		uint8x16x3_t o;
+
+		o.val[0] = v.val[0];
+		o.val[1] = v.val[1];
+		o.val[2] = v.val[2];
+		vst3q_u8(dst + i * 3, o);
+	}
+
+	conv_32_to_888(dst + i * 3, src + i, px_cnt - i);
+}
+#endif
+
+/* XRGB2101010 */
+static void conv_32_to_2101010(uint8_t *dst, const lv_color_t *src, uint32_t px_cnt)
+{
+	uint32_t i;
+
+	for (i = 0; i < px_cnt; i++) {
+		uint32_t r = src[i].ch.red;
+		uint32_t g = src[i].ch.green;
+		uint32_t b = src[i].ch.blue;
+		uint32_t p = (((r << 2) | (r >> 6)) << 20) | (((g << 2) | (g >> 6)) << 10) |
+			     ((b << 2) | (b >> 6));
+
+		memcpy(dst, &p, 4);
+		dst += 4;
+	}
+}
+
+#if defined(__SSE2__)
+static inline __m128i pack_2101010_sse2(__m128i v)
+{
+	const __m128i m = _mm_set1_epi32(0xFF);
+	__m128i r = _mm_and_si128(_mm_srli_epi32(v, 16), m);
+	__m128i g = _mm_and_si128(_mm_srli_epi32(v, 8), m);
+	__m128i b = _mm_and_si128(v, m);
+
+	r = _mm_or_si128(_mm_slli_epi32(r, 2), _mm_srli_epi32(r, 6));
+	g = _mm_or_si128(_mm_slli_epi32(g, 2), _mm_srli_epi32(g, 6));
+	b = _mm_or_si128(_mm_slli_epi32(b, 2), _mm_srli_epi32(b, 6));
+
+	return _mm_or_si128(_mm_slli_epi32(r, 20), _mm_or_si128(_mm_slli_epi32(g, 10), b));
+}
+
+static void conv_32_to_2101010_sse2(uint8_t *dst, const lv_color_t *src, uint32_t px_cnt)
+{
+	uint32_t i;
+
+	for (i = 0; i + 4 <= px_cnt; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&src[i]);
+
+		_mm_storeu_si128((__m128i *)(dst + i * 4), pack_2101010_sse2(v));
+	}
+
+	conv_32_to_2101010(dst + i * 4, src + i, px_cnt - i);
+}
+#endif
+
+#if DRM_BLIT_AVX2
+DRM_AVX2_FUNC
+static inline __m256i pack_2101010_avx2(__m256i v)
+{
+	const __m256i m = _mm256_set1_epi32(0xFF);
+	__m256i r = _mm256_and_si256(_mm256_srli_epi32(v, 16), m);
+	__m256i g = _mm256_and_si256(_mm256_srli_epi32(v, 8), m);
+	__m256i b = _mm256_and_si256(v, m);
+
+	r = _mm256_or_si256(_mm256_slli_epi32(r, 2), _mm256_srli_epi32(r, 6));
+	g = _mm256_or_si256(_mm256_slli_epi32(g, 2), _mm256_srli_epi32(g, 6));
+	b = _mm256_or_si256(_mm256_slli_epi32(b, 2), _mm256_srli_epi32(b, 6));
+
+	return _mm256_or_si256(_mm256_slli_epi32(r, 20), _mm256_or_si256(_mm256_slli_epi32(g, 10), b));
+}
+
+DRM_AVX2_FUNC
+static void conv_32_to_2101010_avx2(uint8_t *dst, const lv_color_t *src, uint32_t px_cnt)
+{
+	uint32_t i;
+
+	for (i = 0; i + 8 <= px_cnt; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)&src[i]);
+
+		_mm256_storeu_si256((__m256i *)(dst + i * 4), pack_2101010_avx2(v));
+	}
+
+	conv_32_to_2101010(dst + i * 4, src + i, px_cnt - i);
+}
+#endif
+
+#if DRM_BLIT_NEON
+static void conv_32_to_2101010_neon(uint8_t *dst, const lv_color_t *src, uint32_t px_cnt)
+{
+	const uint32x4_t m = vdupq_n_u32(0xFF);
+	uint32_t i;
+
+	for (i = 0; i + 4 <= px_cnt; i += 4) {
+		uint32x4_t v = vld1q_u32((const uint32_t *)&src[i]);
+		uint32x4_t r = vandq_u32(vshrq_n_u32(v, 16), m);
+		uint32x4_t g = vandq_u32(vshrq_n_u32(v, 8), m);
+		uint32x4_t b = vandq_u32(v, m);
+
+		r = vorrq_u32(vshlq_n_u32(r, 2), vshrq_n_u32(r, 6));
+		g = vorrq_u32(vshlq_n_u32(g, 2), vshrq_n_u32(g, 6));
+		b = vorrq_u32(vshlq_n_u32(b, 2), vshrq_n_u32(b, 6));
+		v = vorrq_u32(vshlq_n_u32(r, 20), vorrq_u32(vshlq_n_u32(g, 10), b));
+		vst1q_u32((uint32_t *)(dst + i * 4), v);
+	}
+
+	conv_32_to_2101010(dst + i * 4, src + i, px_cnt - i);
+}
+#endif
+
+#endif /* LV_COLOR_DEPTH == 32 */
+
+#if LV_COLOR_DEPTH == 16 && LV_COLOR_16_SWAP == 0
+/*
+ * LV_COLOR_DEPTH 16: RGB565
+ */
+
+/* XRGB8888 */
+static void conv_565_to_8888(uint8_t *dst, const lv_color_t *src, uint32_t px_cnt)
+{
+	uint32_t i;
+
+	for (i = 0; i < px_cnt; i++) {
+		uint32_t p = src[i].full;
+		uint32_t r = ((p >> 8) & 0xF8) | (p >> 13);
+		uint32_t g = ((p >> 3) & 0xFC) | ((p >> 9) & 0x03);
+		uint32_t b = ((p << 3) & 0xF8) | ((p >> 2) & 0x07);
+		uint32_t c = 0xFF000000 | (r << 16) | (g << 8) | b;
+
+		memcpy(dst, &c, 4);
+		dst += 4;
+	}
+}
+
+#if defined(__SSE2__)
+static void conv_565_to_8888_sse2(uint8_t *dst, const lv_color_t *src, uint32_t px_cnt)
+{
+	const __m128i m_f8 = _mm_set1_epi16(0xF8);
+	const __m128i m_fc = _mm_set1_epi16(0xFC);
+	const __m128i m_03 = _mm_set1_epi16(0x03);
+	const __m128i m_07 = _mm_set1_epi16(0x07);
+	const __m128i alpha = _mm_set1_epi16((short)0xFF00);
+	uint32_t i;
+
+	for (i = 0; i + 8 <= px_cnt; i += 8) {
+		__m128i p = _mm_loadu_si128((const __m128i *)&src[i]);
+		__m128i r = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(p, 8), m_f8), _mm_srli_epi16(p, 13));
+		__m128i g = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(p, 3), m_fc),
+					 _mm_and_si128(_mm_srli_epi16(p, 9), m_03));
+		__m128i b = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(p, 3), m_f8),
+					 _mm_and_si128(_mm_srli_epi16(p, 2), m_07));
+		__m128i gb = _mm_or_si128(_mm_slli_epi16(g, 8), b);
+		__m128i ar = _mm_or_si128(alpha, r);
+
+		_mm_storeu_si128((__m128i *)(dst + i * 4), _mm_unpacklo_epi16(gb, ar));
+		_mm_storeu_si128((__m128i *)(dst + i * 4 + 16), _mm_unpackhi_epi16(gb, ar));
+	}
+
+	conv_565_to_8888(dst + i * 4, src + i, px_cnt - i);
+}
+#endif
+
+#if DRM_BLIT_NEON
+/* Expand 8 RGB565 pixels to 8 bit channels, the high bits are repeated in the low ones */
+static inline void unpack_565_neon(uint16x8_t p, uint8x8_t *r, uint8x8_t *g, uint8x8_t *b)
+{
+	*r = vand_u8(vshrn_n_u16(p, 8), vdup_n_u8(0xF8));
+	*g = vand_u8(vshrn_n_u16(p, 3), vdup_n_u8(0xFC));
+	*b = vmovn_u16(vshlq_n_u16(p, 3));
+	*r = vsri_n_u8(*r, *r, 5);
+	*g = vsri_n_u8(*g, *g, 6);
+	*b = vsri_n_u8(*b, *b, 5);
+}
+
+static void conv_565_to_8888_neon(uint8_t *dst, const lv_color_t *src, uint32_t px_cnt)
+{
+	uint32_t i;
+
+	for (i = 0; i + 8 <= px_cnt; i += 8) {
+		uint8x8x4_t o;
+
+		unpack_565_neon(vld1q_u16((const uint16_t *)&src[i]), &o.val[2], &o.val[1], &o.val[0]);
+		o.val[3] = vdup_n_u8(0xFF);
+		vst4_u8(dst + i * 4, o);
+	}
+
+	conv_565_to_8888(dst + i * 4, src + i, px_cnt - i);
+}
+#endif
+
+/* RGB888: B, G, R bytes */
+static void conv_565_to_888(uint8_t *dst, const lv_color_t *src, uint32_t px_cnt)
+{
+	uint32_t i;
+
+	for (i = 0; i < px_cnt; i++) {
+		uint32_t p = src[i].full;
+
+		dst[0] = ((p << 3) & 0xF8) | ((p >> 2) & 0x07);
+		dst[1] = ((p >> 3) & 0xFC) | ((p >> 9) & 0x03);
+		dst[2] = ((p >> 8) & 0xF8) | (p >> 13);
+		dst += 3;
+	}
+}
+
+#if DRM_BLIT_NEON
+static void conv_565_to_888_neon(uint8_t *dst, const lv_color_t *src, uint32_t px_cnt)
+{
+	uint32_t i;
+
+	for (i = 0; i + 8 <= px_cnt; i += 8) {
+		uint8x8x3_t o;
+
+		unpack_565_neon(vld1q_u16((const uint16_t *)&src[i]), &o.val[2], &o.val[1], &o.val[0]);
+		vst3_u8(dst + i * 3, o);
+	}
+
+	conv_565_to_888(dst + i * 3, src + i, px_cnt - i);
+}
+#endif
+
+/* XRGB2101010 */
+static void conv_565_to_2101010(uint8_t *dst, const lv_color_t *src, uint32_t px_cnt)
+{
+	uint32_t i;
+
+	for (i = 0; i < px_cnt; i++) {
+		uint32_t p = src[i].full;
+		uint32_t r = p >> 11;
+		uint32_t g = (p >> 5) & 0x3F;
+		uint32_t b = p & 0x1F;
+		uint32_t c = (((r << 5) | r) << 20) | (((g << 4) | (g >> 2)) << 10) | ((b << 5) | b);
+
+		memcpy(dst, &c, 4);
+		dst += 4;
+	}
+}
+
+#if defined(__SSE2__)
+static inline __m128i pack_565_2101010_sse2(__m128i p)
+{
+	__m128i r = _mm_srli_epi32(p, 11);
+	__m128i g = _mm_and_si128(_mm_srli_epi32(p, 5), _mm_set1_epi32(0x3F));
+	__m128i b = _mm_and_si128(p, _mm_set1_epi32(0x1F));
+
+	r = _mm_or_si128(_mm_slli_epi32(r, 5), r);
+	g = _mm_or_si128(_mm_slli_epi32(g, 4), _mm_srli_epi32(g, 2));
+	b = _mm_or_si128(_mm_slli_epi32(b, 5), b);
+
+	return _mm_or_si128(_mm_slli_epi32(r, 20), _mm_or_si128(_mm_slli_epi32(g, 10), b));
+}
+
+static void conv_565_to_2101010_sse2(uint8_t *dst, const lv_color_t *src, uint32_t px_cnt)
+{
+	const __m128i zero = _mm_setzero_si128();
+	uint32_t i;
+
+	for (i = 0; i + 8 <= px_cnt; i += 8) {
+		__m128i p = _mm_loadu_si128((const __m128i *)&src[i]);
+
+		_mm_storeu_si128((__m128i *)(dst + i * 4), pack_565_2101010_sse2(_mm_unpacklo_epi16(p, zero)));
+		_mm_storeu_si128((__m128i *)(dst + i * 4 + 16), pack_565_2101010_sse2(_mm_unpackhi_epi16(p, zero)));
+	}
+
+	conv_565_to_2101010(dst + i * 4, src + i, px_cnt - i);
+}
+#endif
+
+#if DRM_BLIT_NEON
+static inline uint32x4_t pack_565_2101010_neon(uint32x4_t p)
+{
+	uint32x4_t r = vshrq_n_u32(p, 11);
+	uint32x4_t g = vandq_u32(vshrq_n_u32(p, 5), vdupq_n_u32(0x3F));
+	uint32x4_t b = vandq_u32(p, vdupq_n_u32(0x1F));
+
+	r = vorrq_u32(vshlq_n_u32(r, 5), r);
+	g = vorrq_u32(vshlq_n_u32(g, 4), vshrq_n_u32(g, 2));
+	b = vorrq_u32(vshlq_n_u32(b, 5), b);
+
+	return vorrq_u32(vshlq_n_u32(r, 20), vorrq_u32(vshlq_n_u32(g, 10), b));
+}
+
+static void conv_565_to_2101010_neon(uint8_t *dst, const lv_color_t *src, uint32_t px_cnt)
+{
+	uint32_t i;
+
+	for (i = 0; i + 8 <= px_cnt; i += 8) {
+		uint16x8_t p = vld1q_u16((const uint16_t *)&src[i]);
+
+		vst1q_u32((uint32_t *)(dst + i * 4), pack_565_2101010_neon(vmovl_u16(vget_low_u16(p))));
+		vst1q_u32((uint32_t *)(dst + i * 4 + 16), pack_565_2101010_neon(vmovl_u16(vget_high_u16(p))));
+	}
+
+	conv_565_to_2101010(dst + i * 4, src + i, px_cnt - i);
+}
+#endif
+
+#endif /* LV_COLOR_DEPTH == 16 && LV_COLOR_16_SWAP == 0 */
+
+drm_conv_cb_t drm_blit_get_conv(uint32_t fourcc, const char **name)
+{
+	const char *dummy_name;
+
+	if (!name)
+		name = &dummy_name;
+
+#if DRM_BLIT_AVX2
+	bool avx2 = cpu_has_avx2();
+	LV_UNUSED(avx2);
+#endif
+
+#if LV_COLOR_DEPTH == 32
+	if (fourcc == DRM_FORMAT_RGB888) {
+#if DRM_BLIT_NEON
+		*name = "XRGB8888 to RGB888 (NEON)";
+		return conv_32_to_888_neon;
+#else
+#if DRM_BLIT_AVX2
+		if (avx2) {
+			*name = "XRGB8888 to RGB888 (AVX2)";
+			return conv_32_to_888_avx2;
+		}
+#endif
+		*name = "XRGB8888 to RGB888";
+		return conv_32_to_888;
+#endif
+	}
+
+	if (fourcc == DRM_FORMAT_XRGB2101010) {
+#if DRM_BLIT_NEON
+		*name = "XRGB8888 to XRGB2101010 (NEON)";
+		return conv_32_to_2101010_neon;
+#else
+#if DRM_BLIT_AVX2
+		if (avx2) {
+			*name = "XRGB8888 to XRGB2101010 (AVX2)";
+			return conv_32_to_2101010_avx2;
+		}
+#endif
+#if defined(__SSE2__)
+		*name = "XRGB8888 to XRGB2101010 (SSE2)";
+		return conv_32_to_2101010_sse2;
+#else
+		*name = "XRGB8888 to XRGB2101010";
+		return conv_32_to_2101010;
+#endif
+#endif
+	}
+#elif LV_COLOR_DEPTH == 16 && LV_COLOR_16_SWAP == 0
+	if (fourcc == DRM_FORMAT_XRGB8888) {
+#if DRM_BLIT_NEON
+		*name = "RGB565 to XRGB8888 (NEON)";
+		return conv_565_to_8888_neon;
+#elif defined(__SSE2__)
+		*name = "RGB565 to XRGB8888 (SSE2)";
+		return conv_565_to_8888_sse2;
+#else
+		*name = "RGB565 to XRGB8888";
+		return conv_565_to_8888;
+#endif
+	}
+
+	if (fourcc == DRM_FORMAT_RGB888) {
+#if DRM_BLIT_NEON
+		*name = "RGB565 to RGB888 (NEON)";
+		return conv_565_to_888_neon;
+#else
+		*name = "RGB565 to RGB888";
+		return conv_565_to_888;
+#endif
+	}
+
+	if (fourcc == DRM_FORMAT_XRGB2101010) {
+#if DRM_BLIT_NEON
+		*name = "RGB565 to XRGB2101010 (NEON)";
+		return conv_565_to_2101010_neon;
+#elif defined(__SSE2__)
+		*name = "RGB565 to XRGB2101010 (SSE2)";
+		return conv_565_to_2101010_sse2;
+#else
+		*name = "RGB565 to XRGB2101010";
+		return conv_565_to_2101010;
+#endif
+	}
+#endif
+
+	LV_UNUSED(fourcc);
+	*name = "none";
+	return NULL;
+}
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+
+#if DRM_BLIT_AVX2
+static bool cpu_has_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+#endif
+
+#endif /* USE_DRM */
@@ -0,0 +1,54 @@
+/**
+ * @file drm_blit.h
+ * Pixel conversion kernels of the DRM driver
+ */
+
+#ifndef DRM_BLIT_H
+#define DRM_BLIT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*********************
+ *      INCLUDES
+ *********************/
+#include "drm.h"
+
+#if USE_DRM
+
+/*********************
+ *      DEFINES
+ *********************/
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+/* Convert `px_cnt` LVGL pixels to the format of a plane */
+typedef void (*drm_conv_cb_t)(uint8_t *dst, const lv_color_t *src, uint32_t px_cnt);
+
+/**********************
+ * GLOBAL PROTOTYPES
+ **********************/
+
+/**
+ * Select the fastest conversion from `lv_color_t` to a DRM format for the CPU
+ * the program runs on.
+ * @param fourcc DRM_FORMAT_RGB888 or DRM_FORMAT_XRGB2101010 (and DRM_FORMAT_XRGB8888
+ *               with LV_COLOR_DEPTH 16)
+ * @param name if not NULL the name of the selected kernel is stored here
+ * @return the conversion function or NULL if there is none for the format
+ */
+drm_conv_cb_t drm_blit_get_conv(uint32_t fourcc, const char **name);
+
+/**********************
+ *      MACROS
+ **********************/
+
+#endif /* USE_DRM */
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* DRM_BLIT_H */
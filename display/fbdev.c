@@ -9,11 +9,16 @@
 #include "fbdev.h"
 #if USE_FBDEV || USE_BSD_FBDEV
 
+#include "fbdev_blit.h"
+
 #include <stdlib.h>
 #include <unistd.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
 
@@ -33,9 +38,93 @@
 #define FBDEV_PATH  "/dev/fb0"
 #endif
 
+#ifndef FBDEV_DOUBLE_BUFFER
+#define FBDEV_DOUBLE_BUFFER 0
+#endif
+
+#if USE_BSD_FBDEV
+/*Panning is not available on the BSD frame buffer interface*/
+#undef FBDEV_DOUBLE_BUFFER
+#define FBDEV_DOUBLE_BUFFER 0
+#endif
+
+#ifndef FBDEV_VSYNC
+#define FBDEV_VSYNC 0
+#endif
+
+#ifndef FBDEV_DIRECT_RENDER
+#define FBDEV_DIRECT_RENDER 0
+#endif
+
+#ifndef FBDEV_DIRECT_SHADOW
+#define FBDEV_DIRECT_SHADOW 1
+#endif
+
+/*Dithering on 1 bpp frame buffers: 0: threshold, 1: ordered (8x8 Bayer), 2: Floyd-Steinberg*/
+#ifndef FBDEV_1BPP_DITHER
+#define FBDEV_1BPP_DITHER   0
+#endif
+
+#ifndef FBDEV_THREADS
+#define FBDEV_THREADS       0
+#endif
+
+#ifndef FBDEV_THREAD_MIN_PX
+#define FBDEV_THREAD_MIN_PX (128 * 1024)
+#endif
+
+#ifndef FBDEV_FAST_BOOT
+#define FBDEV_FAST_BOOT     0
+#endif
+
+#ifndef FBDEV_STREAM_COPY
+#define FBDEV_STREAM_COPY   0
+#endif
+
+#ifndef FBDEV_STREAM_MIN_ROW
+#define FBDEV_STREAM_MIN_ROW    256
+#endif
+
+/*Height of the stripes is rounded to this to keep whole tiles for the rotation*/
+#define FBDEV_STRIPE_ALIGN  32
+
+/*Used if the timings of the mode are unknown*/
+#define FBDEV_DEF_REFR_PERIOD_US    16667
+
+/*Number of vblanks to wait at start up to measure the refresh period*/
+#define FBDEV_VSYNC_CALIB_CNT       8
+
+/*Areas remembered per refresh to bring the other page up to date after a flip*/
+#define FBDEV_DAMAGE_MAX    16
+
 /**********************
  *      TYPEDEFS
  **********************/
+#if FBDEV_THREADS
+/*A part of a flushed area copied by a worker thread*/
+typedef struct {
+    fbdev_ctx_t * ctx;
+    uint32_t xoffset;
+    uint32_t yoffset;
+    lv_area_t area;
+    const lv_color_t * color_p;
+    lv_coord_t src_w;
+    lv_disp_rot_t rot;
+} fbdev_stripe_t;
+
+typedef struct {
+    pthread_t threads[FBDEV_THREADS];
+    uint32_t thread_cnt;
+    pthread_mutex_t lock;
+    pthread_cond_t start_cond;          /*Signaled when new stripes are ready*/
+    pthread_cond_t done_cond;           /*Signaled when the last stripe is copied*/
+    fbdev_stripe_t stripes[FBDEV_THREADS];
+    uint32_t generation;                /*Incremented for each split area*/
+    uint32_t pending;                   /*Stripes not copied yet*/
+    uint32_t users;                     /*Number of opened devices*/
+    bool quit;
+} fbdev_pool_t;
+#endif
 
 /**********************
  *      STRUCTURES
@@ -54,23 +143,107 @@ struct bsd_fb_fix_info{
     long int smem_len;
 };
 
+/*State of an opened frame buffer device*/
+struct _fbdev_ctx_t {
+#if USE_BSD_FBDEV
+    struct bsd_fb_var_info vinfo;
+    struct bsd_fb_fix_info finfo;
+#else
+    struct fb_var_screeninfo vinfo;
+    struct fb_fix_screeninfo finfo;
+#endif /* USE_BSD_FBDEV */
+    char *fbp;
+    long int screensize;
+    int fbfd;
+    fbdev_px_format_t px_format;
+    fbdev_conv_cb_t conv_cb;            /*Converts to the frame buffer's format or NULL to copy*/
+    fbdev_copy_cb_t copy_cb;            /*Streaming copy for long rows or NULL to use memcpy*/
+    lv_color_t * rot_line;              /*A rotated row collected before converting it*/
+#if FBDEV_1BPP_DITHER == 2 && LV_COLOR_DEPTH > 1
+    int16_t * fs_err[2];                /*Error of the current and the next row for Floyd-Steinberg*/
+#endif
+
+#if FBDEV_DOUBLE_BUFFER
+    uint32_t page_cnt;                  /*2 if the virtual screen could hold 2 pages*/
+    uint32_t back_page;                 /*Page which is currently drawn*/
+    lv_area_t damage[FBDEV_DAMAGE_MAX];
+    uint32_t damage_cnt;
+#endif
+
+#if FBDEV_DIRECT_RENDER
+    lv_color_t * shadow_buf;            /*Screen sized system RAM buffer LVGL draws into*/
+    bool direct_fb;                     /*true: LVGL draws into the mapped memory directly*/
+#endif
+
+    fbdev_frame_stats_t frame_stats;
+    fbdev_copy_stats_t copy_stats;
+    uint64_t open_us;                   /*When `fbdev_open()` was called*/
+    bool first_frame_done;
+#if FBDEV_THREADS
+    bool pool_user;                     /*true: counted in `pool.users`*/
+#endif
+#if FBDEV_VSYNC
+    uint64_t vsync_phase_us;            /*A vblank time stamp for the timer based sync*/
+    uint64_t last_present_us;
+    uint64_t refr_start_us;             /*When the first area of the current refresh was flushed*/
+    bool refr_in_progress;
+#if FBDEV_DIRECT_RENDER
+    lv_area_t vsync_areas[FBDEV_DAMAGE_MAX];    /*Areas of the shadow written together after the vblank*/
+    uint32_t vsync_area_cnt;
+#endif
+#endif
+};
+
 /**********************
  *  STATIC PROTOTYPES
  **********************/
+static void fbdev_flush_ctx(fbdev_ctx_t * ctx, lv_disp_drv_t * drv, const lv_area_t * area, lv_color_t * color_p);
+static void fbdev_write_area(fbdev_ctx_t * ctx, uint32_t xoffset, uint32_t yoffset,
+                             int32_t x1, int32_t y1, int32_t x2, int32_t y2,
+                             const lv_color_t * color_p, lv_coord_t src_w);
+static void fbdev_write_area_1bpp(fbdev_ctx_t * ctx, uint32_t xoffset, uint32_t yoffset,
+                                  int32_t x1, int32_t y1, int32_t x2, int32_t y2,
+                                  const lv_color_t * color_p, lv_coord_t src_w);
+static void fbdev_write_area_rot(fbdev_ctx_t * ctx, uint32_t xoffset, uint32_t yoffset,
+                                 int32_t x1, int32_t y1, int32_t x2, int32_t y2,
+                                 const lv_color_t * color_p, lv_coord_t src_w, lv_disp_rot_t rot);
+static void fbdev_rotate_area(fbdev_ctx_t * ctx, lv_disp_rot_t rot, lv_area_t * area);
+static void fbdev_copy_area(fbdev_ctx_t * ctx, uint32_t xoffset, uint32_t yoffset, const lv_area_t * area,
+                            const lv_color_t * color_p, lv_coord_t src_w, lv_disp_rot_t rot);
+static void fbdev_write_stripe(fbdev_ctx_t * ctx, uint32_t xoffset, uint32_t yoffset, const lv_area_t * area,
+                               const lv_color_t * color_p, lv_coord_t src_w, lv_disp_rot_t rot);
+#if FBDEV_THREADS
+static void fbdev_pool_start(void);
+static void fbdev_pool_stop(void);
+static void fbdev_pool_copy(fbdev_ctx_t * ctx, uint32_t xoffset, uint32_t yoffset, const lv_area_t * area,
+                            const lv_color_t * color_p, lv_coord_t src_w, lv_disp_rot_t rot);
+static void * fbdev_worker(void * arg);
+#endif
+static void fbdev_setup_conv(fbdev_ctx_t * ctx);
+#if FBDEV_DOUBLE_BUFFER
+static void fbdev_setup_pages(fbdev_ctx_t * ctx);
+static void fbdev_add_damage(fbdev_ctx_t * ctx, int32_t x1, int32_t y1, int32_t x2, int32_t y2);
+static void fbdev_flip(fbdev_ctx_t * ctx, lv_disp_drv_t * drv);
+#endif
+static uint64_t get_time_us(void);
+static void fbdev_first_frame(fbdev_ctx_t * ctx);
+#if FBDEV_VSYNC
+static void fbdev_vsync_init(fbdev_ctx_t * ctx);
+static void fbdev_wait_vsync(fbdev_ctx_t * ctx);
+static void fbdev_frame_presented(fbdev_ctx_t * ctx);
+#if FBDEV_DIRECT_RENDER
+static void fbdev_vsync_add_area(fbdev_ctx_t * ctx, const lv_area_t * area);
+static void fbdev_vsync_write(fbdev_ctx_t * ctx, uint32_t xoffset, uint32_t yoffset);
+#endif
+#endif
 
 /**********************
  *  STATIC VARIABLES
  **********************/
-#if USE_BSD_FBDEV
-static struct bsd_fb_var_info vinfo;
-static struct bsd_fb_fix_info finfo;
-#else
-static struct fb_var_screeninfo vinfo;
-static struct fb_fix_screeninfo finfo;
-#endif /* USE_BSD_FBDEV */
-static char *fbp = 0;
-static long int screensize = 0;
-static int fbfd = 0;
+static fbdev_ctx_t * def_ctx = NULL;    /*Used by the `fbdev_init()` API*/
+#if FBDEV_THREADS
+static fbdev_pool_t pool;               /*Shared by all devices*/
+#endif
 
 /**********************
  *      MACROS
@@ -80,89 +253,409 @@ static int fbfd = 0;
  *   GLOBAL FUNCTIONS
  **********************/
 
+/**
+ * Open the frame buffer device given by `FBDEV_PATH`
+ * and use it with `fbdev_flush()`
+ */
 void fbdev_init(void)
 {
+    def_ctx = fbdev_open(FBDEV_PATH);
+}
+
+void fbdev_exit(void)
+{
+    fbdev_close(def_ctx);
+    def_ctx = NULL;
+}
+
+/**
+ * Open and map a frame buffer device. Any number of devices can be opened
+ * and each can be bound to its own display driver with `fbdev_bind()`.
+ * @param path path of the device, e.g. "/dev/fb1"
+ * @return the context of the device or NULL on error
+ */
+fbdev_ctx_t * fbdev_open(const char * path)
+{
+    fbdev_ctx_t * ctx = calloc(1, sizeof(fbdev_ctx_t));
+    if(ctx == NULL) {
+        perror("Error: cannot allocate the framebuffer context");
+        return NULL;
+    }
+    ctx->open_us = get_time_us();
+
     // Open the file for reading and writing
-    fbfd = open(FBDEV_PATH, O_RDWR);
-    if(fbfd == -1) {
+    ctx->fbfd = open(path, O_RDWR);
+    if(ctx->fbfd == -1) {
         perror("Error: cannot open framebuffer device");
-        return;
+        free(ctx);
+        return NULL;
     }
-    printf("The framebuffer device was opened successfully.\n");
+    printf("The framebuffer device %s was opened successfully.\n", path);
 
 #if USE_BSD_FBDEV
     struct fbtype fb;
     unsigned line_length;
 
     //Get fb type
-    if (ioctl(fbfd, FBIOGTYPE, &fb) != 0) {
+    if (ioctl(ctx->fbfd, FBIOGTYPE, &fb) != 0) {
         perror("ioctl(FBIOGTYPE)");
-        return;
+        goto fail;
     }
 
     //Get screen width
-    if (ioctl(fbfd, FBIO_GETLINEWIDTH, &line_length) != 0) {
+    if (ioctl(ctx->fbfd, FBIO_GETLINEWIDTH, &line_length) != 0) {
         perror("ioctl(FBIO_GETLINEWIDTH)");
-        return;
+        goto fail;
     }
 
-    vinfo.xres = (unsigned) fb.fb_width;
-    vinfo.yres = (unsigned) fb.fb_height;
-    vinfo.bits_per_pixel = fb.fb_depth;
-    vinfo.xoffset = 0;
-    vinfo.yoffset = 0;
-    finfo.line_length = line_length;
-    finfo.smem_len = finfo.line_length * vinfo.yres;
+    ctx->vinfo.xres = (unsigned) fb.fb_width;
+    ctx->vinfo.yres = (unsigned) fb.fb_height;
+    ctx->vinfo.bits_per_pixel = fb.fb_depth;
+    ctx->vinfo.xoffset = 0;
+    ctx->vinfo.yoffset = 0;
+    ctx->finfo.line_length = line_length;
+    ctx->finfo.smem_len = ctx->finfo.line_length * ctx->vinfo.yres;
 #else /* USE_BSD_FBDEV */
 
     // Get fixed screen information
-    if(ioctl(fbfd, FBIOGET_FSCREENINFO, &finfo) == -1) {
+    if(ioctl(ctx->fbfd, FBIOGET_FSCREENINFO, &ctx->finfo) == -1) {
         perror("Error reading fixed information");
-        return;
+        goto fail;
     }
 
     // Get variable screen information
-    if(ioctl(fbfd, FBIOGET_VSCREENINFO, &vinfo) == -1) {
+    if(ioctl(ctx->fbfd, FBIOGET_VSCREENINFO, &ctx->vinfo) == -1) {
         perror("Error reading variable information");
-        return;
+        goto fail;
     }
 #endif /* USE_BSD_FBDEV */
 
-    printf("%dx%d, %dbpp\n", vinfo.xres, vinfo.yres, vinfo.bits_per_pixel);
+#if FBDEV_DOUBLE_BUFFER
+    fbdev_setup_pages(ctx);
+#endif
+
+    printf("%dx%d, %dbpp\n", ctx->vinfo.xres, ctx->vinfo.yres, ctx->vinfo.bits_per_pixel);
+
+    fbdev_setup_conv(ctx);
+
+#if FBDEV_1BPP_DITHER == 2 && LV_COLOR_DEPTH > 1
+    if(ctx->vinfo.bits_per_pixel == 1) {
+        /*+2 for the neighbors of the first and last pixels*/
+        ctx->fs_err[0] = calloc(ctx->vinfo.xres + 2, sizeof(int16_t));
+        ctx->fs_err[1] = calloc(ctx->vinfo.xres + 2, sizeof(int16_t));
+        if(ctx->fs_err[0] == NULL || ctx->fs_err[1] == NULL) {
+            perror("Error allocating the dithering buffers");
+            goto fail;
+        }
+    }
+#endif
 
     // Figure out the size of the screen in bytes
-    screensize =  finfo.smem_len; //finfo.line_length * vinfo.yres;    
+    ctx->screensize =  ctx->finfo.smem_len; //finfo.line_length * vinfo.yres;
 
     // Map the device to memory
-    fbp = (char *)mmap(0, screensize, PROT_READ | PROT_WRITE, MAP_SHARED, fbfd, 0);
-    if((intptr_t)fbp == -1) {
+    ctx->fbp = (char *)mmap(0, ctx->screensize, PROT_READ | PROT_WRITE, MAP_SHARED, ctx->fbfd, 0);
+    if((intptr_t)ctx->fbp == -1) {
         perror("Error: failed to map framebuffer device to memory");
-        return;
+        ctx->fbp = NULL;
+        goto fail;
     }
-    memset(fbp, 0, screensize);
+#if FBDEV_FAST_BOOT
+    /*Keep what the boot loader or the kernel has drawn*/
+#else
+    memset(ctx->fbp, 0, ctx->screensize);
+#endif
+
+#if FBDEV_STREAM_COPY
+    /*Measure on one page*/
+    const char * copy_name;
+    ctx->copy_cb = fbdev_blit_select_copy((uint8_t *)ctx->fbp, ctx->finfo.line_length * ctx->vinfo.yres, &copy_name);
+    printf("Frame buffer copy: %s\n", copy_name);
+#endif
+
+#if FBDEV_DOUBLE_BUFFER
+    if(ctx->page_cnt == 2) {
+#if FBDEV_FAST_BOOT
+        /*Copy the splash to both pages before panning*/
+        long int page_size = ctx->finfo.line_length * ctx->vinfo.yres;
+        char * shown = ctx->fbp + ctx->vinfo.yoffset * ctx->finfo.line_length;
+        if(shown != ctx->fbp && shown + page_size <= ctx->fbp + ctx->screensize) memmove(ctx->fbp, shown, page_size);
+        memcpy(ctx->fbp + page_size, ctx->fbp, page_size);
+#endif
+        /*Show page 0 and draw into page 1*/
+        ctx->vinfo.xoffset = 0;
+        ctx->vinfo.yoffset = 0;
+        if(ioctl(ctx->fbfd, FBIOPAN_DISPLAY, &ctx->vinfo) == -1) {
+            perror("Error panning the display, double buffering disabled");
+            ctx->page_cnt = 1;
+        } else {
+            ctx->back_page = 1;
+        }
+    }
+#endif
+
+#if FBDEV_VSYNC
+    fbdev_vsync_init(ctx);
+#endif
+
+#if FBDEV_THREADS
+    if(pool.users == 0) fbdev_pool_start();
+    pool.users++;
+    ctx->pool_user = true;
+#endif
 
     printf("The framebuffer device was mapped to memory successfully.\n");
 
+    return ctx;
+
+fail:
+    fbdev_close(ctx);
+    return NULL;
 }
 
-void fbdev_exit(void)
+/**
+ * Unmap and close a frame buffer device
+ * @param ctx context returned by `fbdev_open()`
+ */
+void fbdev_close(fbdev_ctx_t * ctx)
 {
-    close(fbfd);
+    if(ctx == NULL) return;
+
+#if FBDEV_1BPP_DITHER == 2 && LV_COLOR_DEPTH > 1
+    free(ctx->fs_err[0]);
+    free(ctx->fs_err[1]);
+#endif
+
+#if FBDEV_DIRECT_RENDER
+    free(ctx->shadow_buf);
+#endif
+    free(ctx->rot_line);
+
+#if FBDEV_THREADS
+    if(ctx->pool_user) {
+        pool.users--;
+        if(pool.users == 0) fbdev_pool_stop();
+    }
+#endif
+
+    if(ctx->fbp) munmap(ctx->fbp, ctx->screensize);
+    close(ctx->fbfd);
+    free(ctx);
+}
+
+/**
+ * Make a display driver draw to a frame buffer device: set its flush callback,
+ * resolution and `user_data`. Call it before registering `drv`.
+ * To rotate the screen set `drv->rotated` and leave `drv->sw_rotate` 0:
+ * the pixels are rotated while copied to the frame buffer.
+ * @param ctx context returned by `fbdev_open()`
+ * @param drv pointer to an initialized display driver
+ */
+void fbdev_bind(fbdev_ctx_t * ctx, lv_disp_drv_t * drv)
+{
+    drv->user_data = ctx;
+    drv->flush_cb = fbdev_ctx_flush;
+    drv->hor_res = ctx->vinfo.xres;
+    drv->ver_res = ctx->vinfo.yres;
+}
+
+/**
+ * Set up `drv` to draw directly into the screen in LVGL's direct mode, avoiding
+ * the copy from a draw buffer. Call it after `fbdev_init()` (or `fbdev_bind()`)
+ * and before registering `drv`.
+ * With `FBDEV_DIRECT_SHADOW` LVGL draws into a screen sized buffer in system RAM
+ * (fast to read back while blending) and only its dirty areas are copied to the
+ * frame buffer. Else LVGL draws into the mapped memory (its hidden page if double buffered).
+ * @param drv pointer to an initialized display driver
+ * @param draw_buf a draw buffer to initialize with the screen sized buffer(s)
+ * @return true: direct mode is set up; false: the frame buffer's format doesn't allow it
+ *         or `FBDEV_DIRECT_RENDER` is disabled
+ */
+bool fbdev_set_direct_render(lv_disp_drv_t * drv, lv_disp_draw_buf_t * draw_buf)
+{
+#if FBDEV_DIRECT_RENDER
+    fbdev_ctx_t * ctx = drv->flush_cb == fbdev_ctx_flush ? drv->user_data : def_ctx;
+    if(ctx == NULL || ctx->fbp == NULL) return false;
+
+    /*The flushed areas are not copied, so they can't be rotated*/
+    if(drv->rotated != LV_DISP_ROT_NONE && !drv->sw_rotate) {
+        printf("Direct render doesn't support rotation\n");
+        return false;
+    }
+
+    uint32_t px_cnt = ctx->vinfo.xres * ctx->vinfo.yres;
+
+#if FBDEV_DIRECT_SHADOW
+    /*The shadow is converted while copied*/
+    if(ctx->vinfo.bits_per_pixel < 8 || (ctx->conv_cb == NULL && ctx->vinfo.bits_per_pixel != LV_COLOR_DEPTH)) {
+        printf("Direct render is not supported with %d bpp\n", ctx->vinfo.bits_per_pixel);
+        return false;
+    }
+#else
+    if(ctx->vinfo.bits_per_pixel != LV_COLOR_DEPTH || LV_COLOR_DEPTH < 8 || ctx->conv_cb != NULL) {
+        printf("Direct render needs the frame buffer in LVGL's color format\n");
+        return false;
+    }
+#endif
+
+#if FBDEV_DIRECT_SHADOW
+    free(ctx->shadow_buf);
+    ctx->shadow_buf = malloc(px_cnt * sizeof(lv_color_t));
+    if(ctx->shadow_buf == NULL) {
+        perror("Error allocating the shadow buffer");
+        return false;
+    }
+#if FBDEV_FAST_BOOT
+    /*Start from what is on the screen*/
+    uint32_t y;
+    const char * shown = ctx->fbp + ctx->vinfo.yoffset * ctx->finfo.line_length;
+    for(y = 0; y < ctx->vinfo.yres; y++) {
+        fbdev_blit_read(ctx->shadow_buf + y * ctx->vinfo.xres, (const uint8_t *)shown + y * ctx->finfo.line_length,
+                        ctx->vinfo.xres, &ctx->px_format);
+    }
+#else
+    memset(ctx->shadow_buf, 0, px_cnt * sizeof(lv_color_t));
+#endif
+    lv_disp_draw_buf_init(draw_buf, ctx->shadow_buf, NULL, px_cnt);
+#else
+    /*LVGL addresses the buffer with `hor_res` pixel wide rows*/
+    if(ctx->finfo.line_length != ctx->vinfo.xres * sizeof(lv_color_t)) {
+        printf("Direct render needs a frame buffer without row padding\n");
+        return false;
+    }
+
+    char * page0 = ctx->fbp + ctx->vinfo.yoffset * ctx->finfo.line_length;
+    char * page1 = NULL;
+#if FBDEV_DOUBLE_BUFFER
+    if(ctx->page_cnt == 2) {
+        /*LVGL starts with `buf1` which is the hidden page*/
+        page0 = ctx->fbp + ctx->back_page * ctx->vinfo.yres * ctx->finfo.line_length;
+        page1 = ctx->fbp + (ctx->back_page ? 0 : 1) * ctx->vinfo.yres * ctx->finfo.line_length;
+    }
+#endif
+    lv_disp_draw_buf_init(draw_buf, page0, page1, px_cnt);
+    ctx->direct_fb = true;
+#endif
+
+    drv->draw_buf = draw_buf;
+    drv->direct_mode = 1;
+    drv->hor_res = ctx->vinfo.xres;
+    drv->ver_res = ctx->vinfo.yres;
+
+    return true;
+#else
+    LV_UNUSED(drv);
+    LV_UNUSED(draw_buf);
+    printf("Direct render is disabled, enable FBDEV_DIRECT_RENDER\n");
+    return false;
+#endif /*FBDEV_DIRECT_RENDER*/
 }
 
 /**
- * Flush a buffer to the marked area
+ * Flush a buffer to the marked area of the device opened by `fbdev_init()`
  * @param drv pointer to driver where this function belongs
  * @param area an area where to copy `color_p`
  * @param color_p an array of pixel to copy to the `area` part of the screen
  */
 void fbdev_flush(lv_disp_drv_t * drv, const lv_area_t * area, lv_color_t * color_p)
 {
-    if(fbp == NULL ||
-            area->x2 < 0 ||
+    fbdev_flush_ctx(def_ctx, drv, area, color_p);
+}
+
+/**
+ * Flush a buffer to the marked area of the device bound to `drv` by `fbdev_bind()`
+ * @param drv pointer to driver where this function belongs
+ * @param area an area where to copy `color_p`
+ * @param color_p an array of pixel to copy to the `area` part of the screen
+ */
+void fbdev_ctx_flush(lv_disp_drv_t * drv, const lv_area_t * area, lv_color_t * color_p)
+{
+    fbdev_flush_ctx(drv->user_data, drv, area, color_p);
+}
+
+void fbdev_get_sizes(uint32_t *width, uint32_t *height) {
+    fbdev_ctx_get_sizes(def_ctx, width, height);
+}
+
+void fbdev_ctx_get_sizes(fbdev_ctx_t * ctx, uint32_t *width, uint32_t *height) {
+    if (width)
+        *width = ctx ? ctx->vinfo.xres : 0;
+
+    if (height)
+        *height = ctx ? ctx->vinfo.yres : 0;
+}
+
+/**
+ * Get the frame pacing statistics of the device opened by `fbdev_init()`.
+ * The pacing is only measured if `FBDEV_VSYNC` is enabled.
+ * The render loop can use `refresh_period_us` to throttle itself.
+ * @param stats the statistics are copied here
+ */
+void fbdev_get_frame_stats(fbdev_frame_stats_t * stats)
+{
+    fbdev_ctx_get_frame_stats(def_ctx, stats);
+}
+
+/**
+ * Get the frame pacing statistics of a device
+ * @param ctx context returned by `fbdev_open()`
+ * @param stats the statistics are copied here
+ */
+void fbdev_ctx_get_frame_stats(fbdev_ctx_t * ctx, fbdev_frame_stats_t * stats)
+{
+    if(ctx && stats) *stats = ctx->frame_stats;
+}
+
+/**
+ * Get how long copying the flushed areas took on the device opened by `fbdev_init()`.
+ * Use it to tune `FBDEV_THREADS` and `FBDEV_THREAD_MIN_PX`.
+ * @param stats the statistics are copied here
+ */
+void fbdev_get_copy_stats(fbdev_copy_stats_t * stats)
+{
+    fbdev_ctx_get_copy_stats(def_ctx, stats);
+}
+
+/**
+ * Get how long copying the flushed areas took on a device
+ * @param ctx context returned by `fbdev_open()`
+ * @param stats the statistics are copied here
+ */
+void fbdev_ctx_get_copy_stats(fbdev_ctx_t * ctx, fbdev_copy_stats_t * stats)
+{
+    if(ctx && stats) *stats = ctx->copy_stats;
+}
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+
+/**
+ * Flush a buffer to the marked area of a device
+ * @param ctx the frame buffer device
+ * @param drv pointer to driver where this function belongs
+ * @param area an area where to copy `color_p`
+ * @param color_p an array of pixel to copy to the `area` part of the screen
+ */
+static void fbdev_flush_ctx(fbdev_ctx_t * ctx, lv_disp_drv_t * drv, const lv_area_t * area, lv_color_t * color_p)
+{
+    if(ctx == NULL || ctx->fbp == NULL) {
+        lv_disp_flush_ready(drv);
+        return;
+    }
+
+    /*Rotated by the driver: `area` is in the rotated coordinate system*/
+    lv_disp_rot_t rot = drv->sw_rotate ? LV_DISP_ROT_NONE : drv->rotated;
+    bool swap = rot == LV_DISP_ROT_90 || rot == LV_DISP_ROT_270;
+    int32_t xres = ctx->vinfo.xres;
+    int32_t yres = ctx->vinfo.yres;
+    int32_t hor_res = swap ? yres : xres;
+    int32_t ver_res = swap ? xres : yres;
+
+    if(area->x2 < 0 ||
             area->y2 < 0 ||
-            area->x1 > (int32_t)vinfo.xres - 1 ||
-            area->y1 > (int32_t)vinfo.yres - 1) {
+            area->x1 > hor_res - 1 ||
+            area->y1 > ver_res - 1) {
         lv_disp_flush_ready(drv);
         return;
     }
@@ -170,82 +663,878 @@ void fbdev_flush(lv_disp_drv_t * drv, const lv_area_t * area, lv_color_t * color
     /*Truncate the area to the screen*/
     int32_t act_x1 = area->x1 < 0 ? 0 : area->x1;
     int32_t act_y1 = area->y1 < 0 ? 0 : area->y1;
-    int32_t act_x2 = area->x2 > (int32_t)vinfo.xres - 1 ? (int32_t)vinfo.xres - 1 : area->x2;
-    int32_t act_y2 = area->y2 > (int32_t)vinfo.yres - 1 ? (int32_t)vinfo.yres - 1 : area->y2;
+    int32_t act_x2 = area->x2 > hor_res - 1 ? hor_res - 1 : area->x2;
+    int32_t act_y2 = area->y2 > ver_res - 1 ? ver_res - 1 : area->y2;
+
+    /*Width of a row in `color_p`*/
+    lv_coord_t src_w = lv_area_get_width(area);
+#if FBDEV_DIRECT_RENDER
+    if(drv->direct_mode) {
+        /*`color_p` is the screen sized buffer, not only the area*/
+        src_w = drv->hor_res;
+        color_p += area->y1 * src_w + area->x1;
+    }
+#endif
+    /*Skip the pixels of the truncated part*/
+    color_p += (act_y1 - area->y1) * src_w + (act_x1 - area->x1);
+
+    lv_area_t act_area = {act_x1, act_y1, act_x2, act_y2};
 
+#if FBDEV_VSYNC
+#if FBDEV_DOUBLE_BUFFER
+    bool single_page = ctx->page_cnt == 1;
+#else
+    bool single_page = true;
+#endif
+    /*The shadow keeps the areas until the last flush: write all of them after one vblank.
+     *Else the draw buffer is reused, so only the first area follows the vblank.*/
+    bool vsync_defer = false;
+#if FBDEV_DIRECT_RENDER
+    vsync_defer = single_page && ctx->shadow_buf != NULL && drv->direct_mode;
+#endif
 
-    lv_coord_t w = (act_x2 - act_x1 + 1);
-    long int location = 0;
-    long int byte_location = 0;
-    unsigned char bit_location = 0;
+    /*Without a hidden page start copying right after a vblank to stay ahead of the scanout*/
+    if(!ctx->refr_in_progress) {
+        ctx->refr_in_progress = true;
+        ctx->refr_start_us = get_time_us();
+        if(single_page && !vsync_defer) fbdev_wait_vsync(ctx);
+    }
+#endif
 
-    /*32 or 24 bit per pixel*/
-    if(vinfo.bits_per_pixel == 32 || vinfo.bits_per_pixel == 24) {
-        uint32_t * fbp32 = (uint32_t *)fbp;
+    /*Offset of the page to draw in the virtual screen*/
+    uint32_t xoffset = ctx->vinfo.xoffset;
+    uint32_t yoffset = ctx->vinfo.yoffset;
+#if FBDEV_DOUBLE_BUFFER
+    if(ctx->page_cnt == 2) {
+#if FBDEV_DIRECT_RENDER
+        /*LVGL has drawn into one of the pages, follow it*/
+        if(ctx->direct_fb) ctx->back_page = ((char *)color_p - ctx->fbp) / (ctx->finfo.line_length * ctx->vinfo.yres);
+#endif
+        xoffset = 0;
+        yoffset = ctx->back_page * ctx->vinfo.yres;
+        /*The area on the frame buffer*/
+        lv_area_t fb_area = act_area;
+        fbdev_rotate_area(ctx, rot, &fb_area);
+        fbdev_add_damage(ctx, fb_area.x1, fb_area.y1, fb_area.x2, fb_area.y2);
+    }
+#endif
+
+#if FBDEV_VSYNC && FBDEV_DIRECT_RENDER
+    if(vsync_defer) {
+        fbdev_vsync_add_area(ctx, &act_area);
+        if(lv_disp_flush_is_last(drv)) fbdev_vsync_write(ctx, xoffset, yoffset);
+    }
+    else
+#endif
+#if FBDEV_DIRECT_RENDER
+    /*The pixels are already in place*/
+    if(!ctx->direct_fb)
+#endif
+    {
+        fbdev_copy_area(ctx, xoffset, yoffset, &act_area, color_p, src_w, rot);
+    }
+
+    //May be some direct update command is required
+    //ret = ioctl(state->fd, FBIO_UPDATE, (unsigned long)((uintptr_t)rect));
+
+#if FBDEV_DOUBLE_BUFFER
+    if(ctx->page_cnt == 2 && lv_disp_flush_is_last(drv)) fbdev_flip(ctx, drv);
+#endif
+
+#if FBDEV_VSYNC
+    if(lv_disp_flush_is_last(drv)) {
+        fbdev_frame_presented(ctx);
+        ctx->refr_in_progress = false;
+    }
+#endif
+
+    if(!ctx->first_frame_done && lv_disp_flush_is_last(drv)) fbdev_first_frame(ctx);
+
+    lv_disp_flush_ready(drv);
+}
+
+/**
+ * Copy pixels to an area of the frame buffer
+ * @param ctx the frame buffer device
+ * @param xoffset x offset of the page in the virtual screen
+ * @param yoffset y offset of the page in the virtual screen
+ * @param x1 left coordinate of the area (already truncated to the screen)
+ * @param y1 top coordinate of the area
+ * @param x2 right coordinate of the area
+ * @param y2 bottom coordinate of the area
+ * @param color_p the pixel of (x1, y1)
+ * @param src_w number of pixels between two rows in `color_p`
+ */
+static void fbdev_write_area(fbdev_ctx_t * ctx, uint32_t xoffset, uint32_t yoffset,
+                             int32_t x1, int32_t y1, int32_t x2, int32_t y2,
+                             const lv_color_t * color_p, lv_coord_t src_w)
+{
+    lv_coord_t w = (x2 - x1 + 1);
+
+    /*32, 24, 16 or 8 bit per pixel*/
+    if(ctx->vinfo.bits_per_pixel >= 8) {
+        uint32_t px_size = ctx->vinfo.bits_per_pixel / 8;
+        uint8_t * dst = (uint8_t *)ctx->fbp + (y1 + yoffset) * ctx->finfo.line_length + (x1 + xoffset) * px_size;
         int32_t y;
-        for(y = act_y1; y <= act_y2; y++) {
-            location = (act_x1 + vinfo.xoffset) + (y + vinfo.yoffset) * finfo.line_length / 4;
-            memcpy(&fbp32[location], (uint32_t *)color_p, (act_x2 - act_x1 + 1) * 4);
-            color_p += w;
+
+        /*Neither the same format nor a known conversion*/
+        if(ctx->conv_cb == NULL && px_size != sizeof(lv_color_t)) return;
+
+        /*Short rows are cheaper with memcpy*/
+        fbdev_copy_cb_t copy_cb = ctx->copy_cb;
+        if(w * px_size < FBDEV_STREAM_MIN_ROW) copy_cb = NULL;
+
+        for(y = y1; y <= y2; y++) {
+            if(ctx->conv_cb) ctx->conv_cb(dst, color_p, w, &ctx->px_format);
+            else if(copy_cb) copy_cb(dst, (const uint8_t *)color_p, w * px_size);
+            else memcpy(dst, color_p, w * px_size);
+            dst += ctx->finfo.line_length;
+            color_p += src_w;
         }
     }
-    /*16 bit per pixel*/
-    else if(vinfo.bits_per_pixel == 16) {
-        uint16_t * fbp16 = (uint16_t *)fbp;
-        int32_t y;
-        for(y = act_y1; y <= act_y2; y++) {
-            location = (act_x1 + vinfo.xoffset) + (y + vinfo.yoffset) * finfo.line_length / 2;
-            memcpy(&fbp16[location], (uint32_t *)color_p, (act_x2 - act_x1 + 1) * 2);
-            color_p += w;
+    /*1 bit per pixel*/
+    else if(ctx->vinfo.bits_per_pixel == 1) {
+        fbdev_write_area_1bpp(ctx, xoffset, yoffset, x1, y1, x2, y2, color_p, src_w);
+    } else {
+        /*Not supported bit per pixel*/
+    }
+}
+
+/**
+ * Copy pixels rotated to an area of the frame buffer
+ * @param ctx the frame buffer device
+ * @param xoffset x offset of the page in the virtual screen
+ * @param yoffset y offset of the page in the virtual screen
+ * @param x1 left coordinate of the area on the frame buffer (already rotated and truncated)
+ * @param y1 top coordinate of the area
+ * @param x2 right coordinate of the area
+ * @param y2 bottom coordinate of the area
+ * @param color_p the first pixel of the not rotated area
+ * @param src_w number of pixels between two rows in `color_p`
+ * @param rot rotation
+ */
+static void fbdev_write_area_rot(fbdev_ctx_t * ctx, uint32_t xoffset, uint32_t yoffset,
+                                 int32_t x1, int32_t y1, int32_t x2, int32_t y2,
+                                 const lv_color_t * color_p, lv_coord_t src_w, lv_disp_rot_t rot)
+{
+    int32_t w = x2 - x1 + 1;
+    int32_t h = y2 - y1 + 1;
+
+    /*Same format: write the tiles straight to their rotated place*/
+    if(ctx->conv_cb == NULL && ctx->vinfo.bits_per_pixel == LV_COLOR_DEPTH && LV_COLOR_DEPTH >= 8) {
+        uint8_t * dst = (uint8_t *)ctx->fbp + (y1 + yoffset) * ctx->finfo.line_length +
+                        (x1 + xoffset) * sizeof(lv_color_t);
+        if(rot == LV_DISP_ROT_180) fbdev_blit_rotate(dst, ctx->finfo.line_length, color_p, src_w, w, h, rot);
+        else fbdev_blit_rotate(dst, ctx->finfo.line_length, color_p, src_w, h, w, rot);
+        return;
+    }
+
+    /*Else collect a rotated row and convert it as any other*/
+    if(ctx->rot_line == NULL) {
+        ctx->rot_line = malloc(LV_MAX(ctx->vinfo.xres, ctx->vinfo.yres) * sizeof(lv_color_t));
+        if(ctx->rot_line == NULL) return;
+    }
+
+    /*Size of the not rotated area*/
+    int32_t src_h = rot == LV_DISP_ROT_180 ? h : w;
+    int32_t src_aw = rot == LV_DISP_ROT_180 ? w : h;
+    int32_t r;
+    for(r = 0; r < h; r++) {
+        /*Source of the first pixel of row `r` and the step to the next one*/
+        const lv_color_t * s;
+        int32_t step;
+        if(rot == LV_DISP_ROT_90) {
+            s = color_p + (src_aw - 1 - r);
+            step = src_w;
+        }
+        else if(rot == LV_DISP_ROT_270) {
+            s = color_p + (src_h - 1) * src_w + r;
+            step = -src_w;
         }
+        else {
+            s = color_p + (src_h - 1 - r) * src_w + (src_aw - 1);
+            step = -1;
+        }
+
+        int32_t k;
+        for(k = 0; k < w; k++) {
+            ctx->rot_line[k] = *s;
+            s += step;
+        }
+        fbdev_write_area(ctx, xoffset, yoffset, x1, y1 + r, x2, y1 + r, ctx->rot_line, w);
     }
-    /*8 bit per pixel*/
-    else if(vinfo.bits_per_pixel == 8) {
-        uint8_t * fbp8 = (uint8_t *)fbp;
-        int32_t y;
-        for(y = act_y1; y <= act_y2; y++) {
-            location = (act_x1 + vinfo.xoffset) + (y + vinfo.yoffset) * finfo.line_length;
-            memcpy(&fbp8[location], (uint32_t *)color_p, (act_x2 - act_x1 + 1));
-            color_p += w;
+}
+
+/**
+ * Map an area of LVGL's (rotated) coordinate system to the frame buffer
+ * @param ctx the frame buffer device
+ * @param rot rotation
+ * @param area the area to map, overwritten with the result
+ */
+static void fbdev_rotate_area(fbdev_ctx_t * ctx, lv_disp_rot_t rot, lv_area_t * area)
+{
+    int32_t xres = ctx->vinfo.xres;
+    int32_t yres = ctx->vinfo.yres;
+    lv_area_t a = *area;
+
+    if(rot == LV_DISP_ROT_90) {
+        area->x1 = a.y1;
+        area->x2 = a.y2;
+        area->y1 = yres - 1 - a.x2;
+        area->y2 = yres - 1 - a.x1;
+    }
+    else if(rot == LV_DISP_ROT_180) {
+        area->x1 = xres - 1 - a.x2;
+        area->x2 = xres - 1 - a.x1;
+        area->y1 = yres - 1 - a.y2;
+        area->y2 = yres - 1 - a.y1;
+    }
+    else if(rot == LV_DISP_ROT_270) {
+        area->x1 = xres - 1 - a.y2;
+        area->x2 = xres - 1 - a.y1;
+        area->y1 = a.x1;
+        area->y2 = a.x2;
+    }
+}
+
+/**
+ * Copy an area to the frame buffer. Large areas are split into row stripes
+ * copied in parallel by the worker threads.
+ * @param ctx the frame buffer device
+ * @param xoffset x offset of the page in the virtual screen
+ * @param yoffset y offset of the page in the virtual screen
+ * @param area the area in LVGL's coordinate system (already truncated to the screen)
+ * @param color_p the pixel of the top left corner of `area`
+ * @param src_w number of pixels between two rows in `color_p`
+ * @param rot rotation
+ */
+static void fbdev_copy_area(fbdev_ctx_t * ctx, uint32_t xoffset, uint32_t yoffset, const lv_area_t * area,
+                            const lv_color_t * color_p, lv_coord_t src_w, lv_disp_rot_t rot)
+{
+    uint64_t start = get_time_us();
+    uint32_t px_cnt = lv_area_get_size(area);
+    fbdev_copy_stats_t * stats = &ctx->copy_stats;
+
+#if FBDEV_THREADS
+    /*1 bpp and converting rotated rows use buffers of the context, they can't run in parallel*/
+    bool parallel = ctx->vinfo.bits_per_pixel >= 8 &&
+                    (rot == LV_DISP_ROT_NONE || (ctx->conv_cb == NULL && ctx->vinfo.bits_per_pixel == LV_COLOR_DEPTH));
+    if(pool.thread_cnt > 0 && parallel && px_cnt >= FBDEV_THREAD_MIN_PX) {
+        fbdev_pool_copy(ctx, xoffset, yoffset, area, color_p, src_w, rot);
+        stats->threaded_cnt++;
+    }
+    else
+#endif
+    {
+        fbdev_write_stripe(ctx, xoffset, yoffset, area, color_p, src_w, rot);
+    }
+
+    uint32_t t = get_time_us() - start;
+    stats->last_us = t;
+    stats->last_px_cnt = px_cnt;
+    if(t > stats->max_us) stats->max_us = t;
+    stats->avg_us = stats->flush_cnt == 0 ? t : (stats->avg_us * 7 + t) / 8;
+    stats->flush_cnt++;
+}
+
+/**
+ * Copy a (part of an) area to the frame buffer on the calling thread.
+ * The parameters are the same as for `fbdev_copy_area()`.
+ */
+static void fbdev_write_stripe(fbdev_ctx_t * ctx, uint32_t xoffset, uint32_t yoffset, const lv_area_t * area,
+                               const lv_color_t * color_p, lv_coord_t src_w, lv_disp_rot_t rot)
+{
+    lv_area_t fb_area = *area;
+    fbdev_rotate_area(ctx, rot, &fb_area);
+    if(rot != LV_DISP_ROT_NONE) {
+        fbdev_write_area_rot(ctx, xoffset, yoffset, fb_area.x1, fb_area.y1, fb_area.x2, fb_area.y2, color_p, src_w, rot);
+    }
+    else {
+        fbdev_write_area(ctx, xoffset, yoffset, fb_area.x1, fb_area.y1, fb_area.x2, fb_area.y2, color_p, src_w);
+    }
+}
+
+#if FBDEV_THREADS
+static void fbdev_pool_start(void)
+{
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.start_cond, NULL);
+    pthread_cond_init(&pool.done_cond, NULL);
+    pool.quit = false;
+    pool.generation = 0;
+    pool.thread_cnt = 0;
+
+    uint32_t i;
+    for(i = 0; i < FBDEV_THREADS; i++) {
+        if(pthread_create(&pool.threads[i], NULL, fbdev_worker, (void *)(uintptr_t)i) != 0) {
+            perror("Error creating a frame buffer worker thread");
+            break;
         }
+        pool.thread_cnt++;
     }
-    /*1 bit per pixel*/
-    else if(vinfo.bits_per_pixel == 1) {
-        uint8_t * fbp8 = (uint8_t *)fbp;
-        int32_t x;
-        int32_t y;
-        for(y = act_y1; y <= act_y2; y++) {
-            for(x = act_x1; x <= act_x2; x++) {
-                location = (x + vinfo.xoffset) + (y + vinfo.yoffset) * vinfo.xres;
-                byte_location = location / 8; /* find the byte we need to change */
-                bit_location = location % 8; /* inside the byte found, find the bit we need to change */
-                fbp8[byte_location] &= ~(((uint8_t)(1)) << bit_location);
-                fbp8[byte_location] |= ((uint8_t)(color_p->full)) << bit_location;
-                color_p++;
+}
+
+static void fbdev_pool_stop(void)
+{
+    pthread_mutex_lock(&pool.lock);
+    pool.quit = true;
+    pthread_cond_broadcast(&pool.start_cond);
+    pthread_mutex_unlock(&pool.lock);
+
+    uint32_t i;
+    for(i = 0; i < pool.thread_cnt; i++) {
+        pthread_join(pool.threads[i], NULL);
+    }
+    pool.thread_cnt = 0;
+
+    pthread_cond_destroy(&pool.done_cond);
+    pthread_cond_destroy(&pool.start_cond);
+    pthread_mutex_destroy(&pool.lock);
+}
+
+/**
+ * Split an area into row stripes, give one to each worker thread, copy the last
+ * one on the calling thread and wait for the others.
+ * The parameters are the same as for `fbdev_copy_area()`.
+ */
+static void fbdev_pool_copy(fbdev_ctx_t * ctx, uint32_t xoffset, uint32_t yoffset, const lv_area_t * area,
+                            const lv_color_t * color_p, lv_coord_t src_w, lv_disp_rot_t rot)
+{
+    int32_t h = lv_area_get_height(area);
+    uint32_t part_cnt = pool.thread_cnt + 1;
+    int32_t stripe_h = (h + part_cnt - 1) / part_cnt;
+    stripe_h = (stripe_h + FBDEV_STRIPE_ALIGN - 1) / FBDEV_STRIPE_ALIGN * FBDEV_STRIPE_ALIGN;
+
+    pthread_mutex_lock(&pool.lock);
+    int32_t y = area->y1;
+    uint32_t i;
+    for(i = 0; i < pool.thread_cnt; i++) {
+        fbdev_stripe_t * s = &pool.stripes[i];
+        s->ctx = ctx;
+        s->xoffset = xoffset;
+        s->yoffset = yoffset;
+        s->rot = rot;
+        s->src_w = src_w;
+        s->area.x1 = area->x1;
+        s->area.x2 = area->x2;
+        s->area.y1 = y;
+        s->area.y2 = LV_MIN(y + stripe_h - 1, area->y2);   /*Empty if y > area->y2*/
+        s->color_p = color_p + (y - area->y1) * src_w;
+        y += stripe_h;
+    }
+    pool.pending = pool.thread_cnt;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.start_cond);
+    pthread_mutex_unlock(&pool.lock);
+
+    /*The rest is copied here*/
+    if(y <= area->y2) {
+        lv_area_t last = {area->x1, y, area->x2, area->y2};
+        fbdev_write_stripe(ctx, xoffset, yoffset, &last, color_p + (y - area->y1) * src_w, src_w, rot);
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    while(pool.pending > 0) pthread_cond_wait(&pool.done_cond, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+static void * fbdev_worker(void * arg)
+{
+    fbdev_stripe_t * s = &pool.stripes[(uintptr_t)arg];
+    uint32_t generation = 0;
+
+    pthread_mutex_lock(&pool.lock);
+    while(1) {
+        while(!pool.quit && pool.generation == generation) pthread_cond_wait(&pool.start_cond, &pool.lock);
+        if(pool.quit) break;
+        generation = pool.generation;
+        pthread_mutex_unlock(&pool.lock);
+
+        if(s->area.y1 <= s->area.y2) {
+            fbdev_write_stripe(s->ctx, s->xoffset, s->yoffset, &s->area, s->color_p, s->src_w, s->rot);
+        }
+
+        pthread_mutex_lock(&pool.lock);
+        pool.pending--;
+        if(pool.pending == 0) pthread_cond_signal(&pool.done_cond);
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    return NULL;
+}
+#endif /*FBDEV_THREADS*/
+
+#if FBDEV_1BPP_DITHER == 1 && LV_COLOR_DEPTH > 1
+/*8x8 Bayer matrix scaled to 0..255*/
+static const uint8_t bayer8[8][8] = {
+    {  0, 128,  32, 160,   8, 136,  40, 168},
+    {192,  64, 224,  96, 200,  72, 232, 104},
+    { 48, 176,  16, 144,  56, 184,  24, 152},
+    {240, 112, 208,  80, 248, 120, 216,  88},
+    { 12, 140,  44, 172,   4, 132,  36, 164},
+    {204,  76, 236, 108, 196,  68, 228, 100},
+    { 60, 188,  28, 156,  52, 180,  20, 148},
+    {252, 124, 220,  92, 244, 116, 212,  84},
+};
+#endif
+
+/**
+ * Tell if a pixel is set on a 1 bpp frame buffer
+ * @param ctx the frame buffer device (its error rows for Floyd-Steinberg)
+ * @param c the pixel
+ * @param x screen x coordinate (for ordered dithering)
+ * @param y screen y coordinate (for ordered dithering)
+ * @param i index in the current row of the area (for Floyd-Steinberg)
+ * @return 0 or 1
+ */
+static inline uint8_t px_to_bit(fbdev_ctx_t * ctx, const lv_color_t * c, int32_t x, int32_t y, int32_t i)
+{
+#if LV_COLOR_DEPTH == 1
+    LV_UNUSED(ctx);
+    LV_UNUSED(x);
+    LV_UNUSED(y);
+    LV_UNUSED(i);
+    return c->full & 1;
+#elif FBDEV_1BPP_DITHER == 1
+    LV_UNUSED(ctx);
+    LV_UNUSED(i);
+    return lv_color_brightness(*c) > bayer8[y & 0x7][x & 0x7];
+#elif FBDEV_1BPP_DITHER == 2
+    LV_UNUSED(x);
+    LV_UNUSED(y);
+    /*fs_err[n][i + 1] belongs to the i-th pixel*/
+    int16_t * cur = ctx->fs_err[0] + 1;
+    int16_t * next = ctx->fs_err[1] + 1;
+    int32_t v = lv_color_brightness(*c) + cur[i];
+    uint8_t bit = v >= 128;
+    int32_t e = bit ? v - 255 : v;
+    cur[i + 1] += (e * 7) / 16;
+    next[i - 1] += (e * 3) / 16;
+    next[i] += (e * 5) / 16;
+    next[i + 1] += e / 16;
+    return bit;
+#else
+    LV_UNUSED(ctx);
+    LV_UNUSED(x);
+    LV_UNUSED(y);
+    LV_UNUSED(i);
+    return lv_color_brightness(*c) >= 128;
+#endif
+}
+
+/**
+ * Pack `n` (max. 8) pixels into the low bits of a byte. The leftmost pixel is the LSB.
+ */
+static inline uint8_t pack_bits(fbdev_ctx_t * ctx, const lv_color_t * c, uint32_t n, int32_t x, int32_t y, int32_t i)
+{
+#if LV_COLOR_DEPTH == 1 && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    /*Gather the lowest bit of 8 bytes into one byte with a multiplication*/
+    if(n == 8) {
+        uint64_t v;
+        memcpy(&v, c, 8);
+        return ((v & 0x0101010101010101ULL) * 0x0102040810204080ULL) >> 56;
+    }
+#endif
+
+    uint8_t bits = 0;
+    uint32_t k;
+    for(k = 0; k < n; k++) {
+        bits |= px_to_bit(ctx, &c[k], x + k, y, i + k) << k;
+    }
+    return bits;
+}
+
+/**
+ * Write an area to a 1 bpp frame buffer. Whole bytes (8 pixels) and 64 bit words (64 pixels)
+ * are written at once; only the partial bytes at the edges are read-modify-written.
+ * Parameters are the same as for `fbdev_write_area`.
+ */
+static void fbdev_write_area_1bpp(fbdev_ctx_t * ctx, uint32_t xoffset, uint32_t yoffset,
+                                  int32_t x1, int32_t y1, int32_t x2, int32_t y2,
+                                  const lv_color_t * color_p, lv_coord_t src_w)
+{
+    int32_t w = x2 - x1 + 1;
+    uint32_t first_bit = x1 + xoffset;
+    int32_t y;
+
+#if FBDEV_1BPP_DITHER == 2 && LV_COLOR_DEPTH > 1
+    if(ctx->fs_err[0] == NULL) return;
+    /*The error is diffused inside the area only*/
+    memset(ctx->fs_err[1], 0, (w + 2) * sizeof(int16_t));
+#endif
+
+    for(y = y1; y <= y2; y++) {
+        uint8_t * dst = (uint8_t *)ctx->fbp + (y + yoffset) * ctx->finfo.line_length + first_bit / 8;
+        uint32_t shift = first_bit % 8;
+        int32_t i = 0;
+
+#if FBDEV_1BPP_DITHER == 2 && LV_COLOR_DEPTH > 1
+        /*The next row of the previous line becomes the current one*/
+        int16_t * tmp = ctx->fs_err[0];
+        ctx->fs_err[0] = ctx->fs_err[1];
+        ctx->fs_err[1] = tmp;
+        memset(ctx->fs_err[1], 0, (w + 2) * sizeof(int16_t));
+#endif
+
+        /*Partial first byte*/
+        if(shift) {
+            uint32_t n = LV_MIN(8 - shift, (uint32_t)w);
+            uint8_t mask = ((1 << n) - 1) << shift;
+            uint8_t bits = pack_bits(ctx, color_p, n, x1, y, 0) << shift;
+            *dst = (*dst & ~mask) | bits;
+            dst++;
+            i = n;
+        }
+
+        /*64 pixels with one store*/
+        for(; i + 64 <= w; i += 64) {
+            uint8_t word[8];
+            uint32_t k;
+            for(k = 0; k < 8; k++) {
+                word[k] = pack_bits(ctx, &color_p[i + k * 8], 8, x1 + i + k * 8, y, i + k * 8);
             }
+            memcpy(dst, word, 8);
+            dst += 8;
+        }
 
-            color_p += area->x2 - act_x2;
+        for(; i + 8 <= w; i += 8) {
+            *dst = pack_bits(ctx, &color_p[i], 8, x1 + i, y, i);
+            dst++;
         }
-    } else {
-        /*Not supported bit per pixel*/
+
+        /*Partial last byte*/
+        if(i < w) {
+            uint32_t n = w - i;
+            uint8_t mask = (1 << n) - 1;
+            uint8_t bits = pack_bits(ctx, &color_p[i], n, x1 + i, y, i);
+            *dst = (*dst & ~mask) | bits;
+        }
+
+        color_p += src_w;
     }
+}
 
-    //May be some direct update command is required
-    //ret = ioctl(state->fd, FBIO_UPDATE, (unsigned long)((uintptr_t)rect));
+/**
+ * Find out how to copy `lv_color_t` pixels into the frame buffer
+ * from the layout of the color channels.
+ */
+static void fbdev_setup_conv(fbdev_ctx_t * ctx)
+{
+    const char * name;
 
-    lv_disp_flush_ready(drv);
+    memset(&ctx->px_format, 0, sizeof(ctx->px_format));
+    ctx->px_format.bpp = ctx->vinfo.bits_per_pixel;
+#if !USE_BSD_FBDEV
+    /*Only true color layouts are described by the bitfields*/
+    if(ctx->finfo.visual == FB_VISUAL_TRUECOLOR || ctx->finfo.visual == FB_VISUAL_DIRECTCOLOR) {
+        ctx->px_format.red_offset = ctx->vinfo.red.offset;
+        ctx->px_format.red_length = ctx->vinfo.red.length;
+        ctx->px_format.green_offset = ctx->vinfo.green.offset;
+        ctx->px_format.green_length = ctx->vinfo.green.length;
+        ctx->px_format.blue_offset = ctx->vinfo.blue.offset;
+        ctx->px_format.blue_length = ctx->vinfo.blue.length;
+        ctx->px_format.transp_offset = ctx->vinfo.transp.offset;
+        ctx->px_format.transp_length = ctx->vinfo.transp.length;
+    }
+#endif
+
+    ctx->conv_cb = fbdev_blit_get_conv(&ctx->px_format, &name);
+    printf("Pixel conversion: %s\n", name);
+
+    if(ctx->conv_cb == NULL && ctx->vinfo.bits_per_pixel >= 8 && ctx->vinfo.bits_per_pixel != sizeof(lv_color_t) * 8) {
+        printf("%d bpp is not supported with LV_COLOR_DEPTH %d\n", ctx->vinfo.bits_per_pixel, LV_COLOR_DEPTH);
+    }
 }
 
-void fbdev_get_sizes(uint32_t *width, uint32_t *height) {
-    if (width)
-        *width = vinfo.xres;
+#if FBDEV_DOUBLE_BUFFER
+/**
+ * Ask for a virtual screen with 2 pages. Must be called before mapping the memory
+ * because the driver might reallocate it. Falls back to 1 page if not possible.
+ */
+static void fbdev_setup_pages(fbdev_ctx_t * ctx)
+{
+    ctx->page_cnt = 1;
 
-    if (height)
-        *height = vinfo.yres;
+    if(ctx->vinfo.yres_virtual < ctx->vinfo.yres * 2) {
+        struct fb_var_screeninfo req = ctx->vinfo;
+        req.yres_virtual = ctx->vinfo.yres * 2;
+        req.xoffset = 0;
+        req.yoffset = 0;
+        if(ioctl(ctx->fbfd, FBIOPUT_VSCREENINFO, &req) == -1) {
+            perror("Error setting the virtual resolution, double buffering disabled");
+            return;
+        }
+
+        /*The driver might have adjusted the request and the layout*/
+        if(ioctl(ctx->fbfd, FBIOGET_VSCREENINFO, &ctx->vinfo) == -1 ||
+           ioctl(ctx->fbfd, FBIOGET_FSCREENINFO, &ctx->finfo) == -1) {
+            perror("Error reading screen information");
+            return;
+        }
+    }
+
+    if(ctx->vinfo.yres_virtual < ctx->vinfo.yres * 2 ||
+       ctx->finfo.ypanstep == 0 ||
+       ctx->vinfo.yres % ctx->finfo.ypanstep != 0 ||
+       ctx->finfo.smem_len < ctx->finfo.line_length * ctx->vinfo.yres * 2) {
+        printf("Panning is not supported, double buffering disabled\n");
+        return;
+    }
+
+    ctx->page_cnt = 2;
+    printf("Double buffering with %dx%d virtual resolution\n", ctx->vinfo.xres_virtual, ctx->vinfo.yres_virtual);
 }
 
-/**********************
- *   STATIC FUNCTIONS
- **********************/
+/**
+ * Remember an area drawn in the back page in this refresh
+ */
+static void fbdev_add_damage(fbdev_ctx_t * ctx, int32_t x1, int32_t y1, int32_t x2, int32_t y2)
+{
+    lv_area_t a;
+    a.x1 = x1;
+    a.y1 = y1;
+    a.x2 = x2;
+    a.y2 = y2;
+
+    /*Out of slots: merge into the last one*/
+    if(ctx->damage_cnt == FBDEV_DAMAGE_MAX) {
+        _lv_area_join(&ctx->damage[FBDEV_DAMAGE_MAX - 1], &ctx->damage[FBDEV_DAMAGE_MAX - 1], &a);
+        return;
+    }
+
+    ctx->damage[ctx->damage_cnt] = a;
+    ctx->damage_cnt++;
+}
+
+/**
+ * Show the back page and copy the areas drawn in it to the other page
+ * so that both are identical before the next refresh starts.
+ */
+static void fbdev_flip(fbdev_ctx_t * ctx, lv_disp_drv_t * drv)
+{
+    uint32_t front_yoffset = ctx->back_page * ctx->vinfo.yres;
+
+    ctx->vinfo.xoffset = 0;
+    ctx->vinfo.yoffset = front_yoffset;
+    if(ioctl(ctx->fbfd, FBIOPAN_DISPLAY, &ctx->vinfo) == -1) {
+        perror("Error panning the display");
+        ctx->damage_cnt = 0;
+        return;
+    }
+
+    /*Most drivers latch the new offset on the next vblank: don't touch the old page before it*/
+#if FBDEV_VSYNC
+    fbdev_wait_vsync(ctx);
+#else
+    int dummy = 0;
+    ioctl(ctx->fbfd, FBIO_WAITFORVSYNC, &dummy);
+#endif
+
+    ctx->back_page = ctx->back_page ? 0 : 1;
+
+    /*The next refresh redraws the whole screen anyway*/
+    if(drv->full_refresh) {
+        ctx->damage_cnt = 0;
+        return;
+    }
+
+    uint32_t i;
+#if FBDEV_DIRECT_RENDER
+    /*Write from the system RAM copy instead of reading the slow frame buffer memory*/
+    if(ctx->shadow_buf) {
+        for(i = 0; i < ctx->damage_cnt; i++) {
+            fbdev_copy_area(ctx, 0, ctx->back_page * ctx->vinfo.yres, &ctx->damage[i],
+                            ctx->shadow_buf + ctx->damage[i].y1 * ctx->vinfo.xres + ctx->damage[i].x1, ctx->vinfo.xres,
+                            LV_DISP_ROT_NONE);
+        }
+        ctx->damage_cnt = 0;
+        return;
+    }
+#endif
+
+    char * src_page = ctx->fbp + front_yoffset * ctx->finfo.line_length;
+    char * dst_page = ctx->fbp + ctx->back_page * ctx->vinfo.yres * ctx->finfo.line_length;
+    for(i = 0; i < ctx->damage_cnt; i++) {
+        /*Round to bytes to handle less than 8 bit per pixel too*/
+        long int start = (ctx->damage[i].x1 * ctx->vinfo.bits_per_pixel) / 8;
+        long int end = ((ctx->damage[i].x2 + 1) * ctx->vinfo.bits_per_pixel + 7) / 8;
+        fbdev_copy_cb_t copy_cb = end - start >= FBDEV_STREAM_MIN_ROW ? ctx->copy_cb : NULL;
+        int32_t y;
+        for(y = ctx->damage[i].y1; y <= ctx->damage[i].y2; y++) {
+            long int row = y * ctx->finfo.line_length;
+            if(copy_cb) copy_cb((uint8_t *)dst_page + row + start, (uint8_t *)src_page + row + start, end - start);
+            else memcpy(dst_page + row + start, src_page + row + start, end - start);
+        }
+    }
+
+    ctx->damage_cnt = 0;
+}
+#endif /*FBDEV_DOUBLE_BUFFER*/
+
+static uint64_t get_time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Record the time to the first frame
+ */
+static void fbdev_first_frame(fbdev_ctx_t * ctx)
+{
+    uint64_t now = get_time_us();
+    ctx->first_frame_done = true;
+    ctx->frame_stats.first_frame_us = now - ctx->open_us;
+
+#if defined(CLOCK_BOOTTIME)
+    /*Unlike CLOCK_MONOTONIC it includes the time spent in suspend*/
+    struct timespec ts;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    ctx->frame_stats.first_frame_boot_ms = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#else
+    ctx->frame_stats.first_frame_boot_ms = now / 1000;
+#endif
+
+    printf("First frame %u ms after opening the frame buffer, %u ms after boot\n",
+           (unsigned)(ctx->frame_stats.first_frame_us / 1000), (unsigned)ctx->frame_stats.first_frame_boot_ms);
+}
+
+#if FBDEV_VSYNC
+
+/**
+ * Check if the driver can wait for vblank and find out the refresh period:
+ * measure it on real vblanks if possible, else calculate it from the mode timings.
+ */
+static void fbdev_vsync_init(fbdev_ctx_t * ctx)
+{
+    uint32_t period_us = FBDEV_DEF_REFR_PERIOD_US;
+
+#if !USE_BSD_FBDEV
+    /*pixclock is the length of a pixel in picoseconds*/
+    uint64_t htotal = ctx->vinfo.xres + ctx->vinfo.left_margin + ctx->vinfo.right_margin + ctx->vinfo.hsync_len;
+    uint64_t vtotal = ctx->vinfo.yres + ctx->vinfo.upper_margin + ctx->vinfo.lower_margin + ctx->vinfo.vsync_len;
+    if(ctx->vinfo.pixclock != 0) {
+        uint64_t frame_ps = htotal * vtotal * ctx->vinfo.pixclock;
+        if(frame_ps >= 1000000ULL * 1000 && frame_ps <= 1000000ULL * 1000000) {
+            period_us = frame_ps / 1000000;
+        }
+    }
+
+#ifdef FBIO_WAITFORVSYNC
+    int dummy = 0;
+    if(ioctl(ctx->fbfd, FBIO_WAITFORVSYNC, &dummy) == 0) {
+        uint64_t t_start = get_time_us();
+        uint32_t i;
+        for(i = 0; i < FBDEV_VSYNC_CALIB_CNT; i++) {
+            if(ioctl(ctx->fbfd, FBIO_WAITFORVSYNC, &dummy) != 0) break;
+        }
+
+        /*Some drivers return at once instead of waiting: don't trust an implausible period*/
+        uint64_t measured_us = (get_time_us() - t_start) / FBDEV_VSYNC_CALIB_CNT;
+        if(i == FBDEV_VSYNC_CALIB_CNT && measured_us >= 1000 && measured_us <= 1000000) {
+            period_us = measured_us;
+            ctx->frame_stats.hw_vsync = true;
+        }
+    }
+#endif
+#endif /*!USE_BSD_FBDEV*/
+
+    ctx->frame_stats.refresh_period_us = period_us;
+    ctx->frame_stats.frame_interval_us = period_us;
+    ctx->vsync_phase_us = get_time_us();
+    ctx->last_present_us = ctx->vsync_phase_us;
+
+    printf("Frame pacing with %s, refresh period: %d us\n",
+           ctx->frame_stats.hw_vsync ? "FBIO_WAITFORVSYNC" : "timer", ctx->frame_stats.refresh_period_us);
+}
+
+/**
+ * Block until the next vertical blanking
+ */
+static void fbdev_wait_vsync(fbdev_ctx_t * ctx)
+{
+#ifdef FBIO_WAITFORVSYNC
+    if(ctx->frame_stats.hw_vsync) {
+        int dummy = 0;
+        if(ioctl(ctx->fbfd, FBIO_WAITFORVSYNC, &dummy) == 0) {
+            ctx->vsync_phase_us = get_time_us();
+            return;
+        }
+        perror("FBIO_WAITFORVSYNC failed, using a timer");
+        ctx->frame_stats.hw_vsync = false;
+    }
+#endif
+
+    /*Sleep until the next multiple of the period after the last known vblank*/
+    uint64_t now = get_time_us();
+    uint64_t period = ctx->frame_stats.refresh_period_us;
+    uint64_t next = ctx->vsync_phase_us + ((now - ctx->vsync_phase_us) / period + 1) * period;
+
+    struct timespec ts;
+    ts.tv_sec = next / 1000000;
+    ts.tv_nsec = (next % 1000000) * 1000;
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+
+    ctx->vsync_phase_us = next;
+}
+
+/**
+ * Update the statistics when the last area of a refresh is on the display
+ */
+static void fbdev_frame_presented(fbdev_ctx_t * ctx)
+{
+    uint64_t now = get_time_us();
+    uint64_t period = ctx->frame_stats.refresh_period_us;
+    uint64_t interval = now - ctx->last_present_us;
+
+    /*Only the refreshes started right after the previous one tell something about
+     *the achievable frame rate. After an idle period the interval is meaningless.*/
+    if(ctx->refr_start_us - ctx->last_present_us < period) {
+        uint32_t vblanks = (interval + period / 2) / period;
+        if(vblanks > 1) ctx->frame_stats.missed_frames += vblanks - 1;
+
+        /*Moving average with 1/8 weight for the new sample*/
+        ctx->frame_stats.frame_interval_us = (ctx->frame_stats.frame_interval_us * 7 + interval) / 8;
+    }
+
+    ctx->frame_stats.presented_frames++;
+    ctx->last_present_us = now;
+}
+
+#if FBDEV_DIRECT_RENDER
+/**
+ * Remember an area of the shadow flushed in this refresh
+ */
+static void fbdev_vsync_add_area(fbdev_ctx_t * ctx, const lv_area_t * area)
+{
+    /*Out of slots: merge into the last one*/
+    if(ctx->vsync_area_cnt == FBDEV_DAMAGE_MAX) {
+        _lv_area_join(&ctx->vsync_areas[FBDEV_DAMAGE_MAX - 1], &ctx->vsync_areas[FBDEV_DAMAGE_MAX - 1], area);
+        return;
+    }
+
+    ctx->vsync_areas[ctx->vsync_area_cnt] = *area;
+    ctx->vsync_area_cnt++;
+}
+
+/**
+ * Write all areas of the refresh from the shadow right after a vblank
+ */
+static void fbdev_vsync_write(fbdev_ctx_t * ctx, uint32_t xoffset, uint32_t yoffset)
+{
+    uint32_t i;
+
+    fbdev_wait_vsync(ctx);
+
+    for(i = 0; i < ctx->vsync_area_cnt; i++) {
+        fbdev_copy_area(ctx, xoffset, yoffset, &ctx->vsync_areas[i],
+                        ctx->shadow_buf + ctx->vsync_areas[i].y1 * ctx->vinfo.xres + ctx->vsync_areas[i].x1,
+                        ctx->vinfo.xres, LV_DISP_ROT_NONE);
+    }
+    ctx->vsync_area_cnt = 0;
+}
+#endif
+#endif /*FBDEV_VSYNC*/
 
 #endif
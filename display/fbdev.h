@@ -36,6 +36,27 @@ extern "C" {
 /**********************
  *      TYPEDEFS
  **********************/
+/*An opened frame buffer device, see `fbdev_open()`*/
+typedef struct _fbdev_ctx_t fbdev_ctx_t;
+
+typedef struct {
+    uint32_t refresh_period_us;     /*Refresh period of the panel*/
+    uint32_t frame_interval_us;     /*Average time between two presented frames*/
+    uint32_t presented_frames;      /*Number of refreshes sent to the display*/
+    uint32_t missed_frames;         /*Vblanks passed while a refresh was in progress*/
+    bool hw_vsync;                  /*true: FBIO_WAITFORVSYNC is used, false: a timer*/
+    uint32_t first_frame_us;        /*Time from `fbdev_open()` to the end of the first refresh*/
+    uint32_t first_frame_boot_ms;   /*Time from the system's boot to the end of the first refresh*/
+} fbdev_frame_stats_t;
+
+typedef struct {
+    uint32_t last_us;               /*Time of copying the last flushed area to the frame buffer*/
+    uint32_t avg_us;                /*Moving average of the copy times*/
+    uint32_t max_us;
+    uint32_t last_px_cnt;           /*Size of the last flushed area*/
+    uint32_t flush_cnt;
+    uint32_t threaded_cnt;          /*Flushes split among the worker threads*/
+} fbdev_copy_stats_t;
 
 /**********************
  * GLOBAL PROTOTYPES
@@ -44,6 +65,18 @@ void fbdev_init(void);
 void fbdev_exit(void);
 void fbdev_flush(lv_disp_drv_t * drv, const lv_area_t * area, lv_color_t * color_p);
 void fbdev_get_sizes(uint32_t *width, uint32_t *height);
+void fbdev_get_frame_stats(fbdev_frame_stats_t * stats);
+void fbdev_get_copy_stats(fbdev_copy_stats_t * stats);
+bool fbdev_set_direct_render(lv_disp_drv_t * drv, lv_disp_draw_buf_t * draw_buf);
+
+/*Multiple devices*/
+fbdev_ctx_t * fbdev_open(const char * path);
+void fbdev_close(fbdev_ctx_t * ctx);
+void fbdev_bind(fbdev_ctx_t * ctx, lv_disp_drv_t * drv);
+void fbdev_ctx_flush(lv_disp_drv_t * drv, const lv_area_t * area, lv_color_t * color_p);
+void fbdev_ctx_get_sizes(fbdev_ctx_t * ctx, uint32_t *width, uint32_t *height);
+void fbdev_ctx_get_frame_stats(fbdev_ctx_t * ctx, fbdev_frame_stats_t * stats);
+void fbdev_ctx_get_copy_stats(fbdev_ctx_t * ctx, fbdev_copy_stats_t * stats);
 
 
 /**********************
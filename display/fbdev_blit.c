@@ -0,0 +1,970 @@
+/**
+ * @file fbdev_blit.c
+ * Pixel copy and conversion kernels of the frame buffer driver
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+#include "fbdev_blit.h"
+#if USE_FBDEV || USE_BSD_FBDEV
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define FBDEV_BLIT_AVX2 1
+#define FBDEV_AVX2_FUNC __attribute__((target("avx2")))
+#else
+#define FBDEV_BLIT_AVX2 0
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define FBDEV_BLIT_NEON 1
+#else
+#define FBDEV_BLIT_NEON 0
+#endif
+
+/*********************
+ *      DEFINES
+ *********************/
+/*Rotation works on ROT_TILE x ROT_TILE tiles to keep the source and destination in the cache*/
+#define ROT_TILE    32
+
+#if defined(__SSE2__) || defined(__aarch64__)
+#define FBDEV_BLIT_STREAM 1
+#else
+#define FBDEV_BLIT_STREAM 0
+#endif
+
+/*Number of times each copy method is measured, the best time counts*/
+#define COPY_BENCH_CNT  3
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+/**********************
+ *  STATIC PROTOTYPES
+ **********************/
+static void conv_generic(uint8_t * dst, const lv_color_t * src, uint32_t px_cnt, const fbdev_px_format_t * fmt);
+static inline uint8_t read_channel(uint32_t px, uint8_t offset, uint8_t len);
+static bool fmt_is(const fbdev_px_format_t * fmt, uint8_t bpp, uint8_t r_ofs, uint8_t g_ofs, uint8_t b_ofs);
+static void rotate_tile(uint8_t * dst, int32_t dst_stride, const lv_color_t * src, int32_t src_stride,
+                        int32_t i0, int32_t j0, int32_t tw, int32_t th, int32_t w, int32_t h, lv_disp_rot_t rot);
+static void rotate_180(uint8_t * dst, int32_t dst_stride, const lv_color_t * src, int32_t src_stride,
+                       int32_t w, int32_t h);
+#if FBDEV_BLIT_STREAM
+static void copy_stream(uint8_t * dst, const uint8_t * src, uint32_t size);
+static void copy_memcpy(uint8_t * dst, const uint8_t * src, uint32_t size);
+static uint64_t copy_bench(fbdev_copy_cb_t copy_cb, uint8_t * dst, const uint8_t * src, uint32_t size);
+#endif
+#if FBDEV_BLIT_AVX2
+static bool cpu_has_avx2(void);
+#endif
+
+/**********************
+ *  STATIC VARIABLES
+ **********************/
+
+/**********************
+ *      MACROS
+ **********************/
+
+/**********************
+ *   GLOBAL FUNCTIONS
+ **********************/
+
+/*=====================================
+ * LV_COLOR_DEPTH 32 (B, G, R, A bytes)
+ *====================================*/
+#if LV_COLOR_DEPTH == 32
+
+/*-----------------------
+ * 32 bpp, swapped R and B
+ *----------------------*/
+static void conv_32_swap_rb(uint8_t * dst, const lv_color_t * src, uint32_t px_cnt, const fbdev_px_format_t * fmt)
+{
+    LV_UNUSED(fmt);
+    uint32_t i;
+    for(i = 0; i < px_cnt; i++) {
+        uint32_t c = src[i].full;
+        c = (c & 0xFF00FF00) | ((c >> 16) & 0xFF) | ((c & 0xFF) << 16);
+        memcpy(dst, &c, 4);
+        dst += 4;
+    }
+}
+
+#if defined(__SSE2__)
+static void conv_32_swap_rb_sse2(uint8_t * dst, const lv_color_t * src, uint32_t px_cnt, const fbdev_px_format_t * fmt)
+{
+    const __m128i ga_mask = _mm_set1_epi32(0xFF00FF00);
+    const __m128i lo_mask = _mm_set1_epi32(0x000000FF);
+    uint32_t i;
+    for(i = 0; i + 4 <= px_cnt; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&src[i]);
+        __m128i r = _mm_and_si128(_mm_srli_epi32(v, 16), lo_mask);
+        __m128i b = _mm_slli_epi32(_mm_and_si128(v, lo_mask), 16);
+        v = _mm_or_si128(_mm_and_si128(v, ga_mask), _mm_or_si128(r, b));
+        _mm_storeu_si128((__m128i *)(dst + i * 4), v);
+    }
+
+    conv_32_swap_rb(dst + i * 4, src + i, px_cnt - i, fmt);
+}
+#endif
+
+#if FBDEV_BLIT_AVX2
+FBDEV_AVX2_FUNC
+static void conv_32_swap_rb_avx2(uint8_t * dst, const lv_color_t * src, uint32_t px_cnt, const fbdev_px_format_t * fmt)
+{
+    const __m256i shuf = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+                                          2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    uint32_t i;
+    for(i = 0; i + 8 <= px_cnt; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)&src[i]);
+        _mm256_storeu_si256((__m256i *)(dst + i * 4), _mm256_shuffle_epi8(v, shuf));
+    }
+
+    conv_32_swap_rb(dst + i * 4, src + i, px_cnt - i, fmt);
+}
+#endif
+
+#if FBDEV_BLIT_NEON
+static void conv_32_swap_rb_neon(uint8_t * dst, const lv_color_t * src, uint32_t px_cnt, const fbdev_px_format_t * fmt)
+{
+    uint32_t i;
+    for(i = 0; i + 16 <= px_cnt; i += 16) {
+        uint8x16x4_t v = vld4q_u8((const uint8_t *)&src[i]);
+        uint8x16_t tmp = v.val[0];
+        v.val[0] = v.val[2];
+        v.val[2] = tmp;
+        vst4q_u8(dst + i * 4, v);
+    }
+
+    conv_32_swap_rb(dst + i * 4, src + i, px_cnt - i, fmt);
+}
+#endif
+
+/*-----------------------
+ * 24 bpp (B, G, R bytes)
+ *----------------------*/
+static void conv_32_to_24(uint8_t * dst, const lv_color_t * src, uint32_t px_cnt, const fbdev_px_format_t * fmt)
+{
+    LV_UNUSED(fmt);
+    uint32_t i;
+    /*Pack 4 pixels into 3 words*/
+    for(i = 0; i + 4 <= px_cnt; i += 4) {
+        uint32_t p0 = src[i].full;
+        uint32_t p1 = src[i + 1].full;
+        uint32_t p2 = src[i + 2].full;
+        uint32_t p3 = src[i + 3].full;
+        uint32_t w[3];
+        w[0] = (p0 & 0xFFFFFF) | (p1 << 24);
+        w[1] = ((p1 >> 8) & 0xFFFF) | (p2 << 16);
+        w[2] = ((p2 >> 16) & 0xFF) | (p3 << 8);
+        memcpy(dst, w, 12);
+        dst += 12;
+    }
+
+    for(; i < px_cnt; i++) {
+        dst[0] = src[i].ch.blue;
+        dst[1] = src[i].ch.green;
+        dst[2] = src[i].ch.red;
+        dst += 3;
+    }
+}
+
+#if FBDEV_BLIT_AVX2
+FBDEV_AVX2_FUNC
+static void conv_32_to_24_avx2(uint8_t * dst, const lv_color_t * src, uint32_t px_cnt, const fbdev_px_format_t * fmt)
+{
+    /*Drop the alpha bytes in both lanes, then move the 2 x 12 bytes next to each other*/
+    const __m256i shuf = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                          0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    const __m256i perm = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+    uint32_t i;
+    for(i = 0; i + 8 <= px_cnt; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)&src[i]);
+        v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, shuf), perm);
+        /*Store exactly 24 bytes to not overwrite the pixels after the area*/
+        _mm_storeu_si128((__m128i *)(dst + i * 3), _mm256_castsi256_si128(v));
+        _mm_storel_epi64((__m128i *)(dst + i * 3 + 16), _mm256_extracti128_si256(v, 1));
+    }
+
+    conv_32_to_24(dst + i * 3, src + i, px_cnt - i, fmt);
+}
+#endif
+
+#if FBDEV_BLIT_NEON
+static void conv_32_to_24_neon(uint8_t * dst, const lv_color_t * src, uint32_t px_cnt, const fbdev_px_format_t * fmt)
+{
+    uint32_t i;
+    for(i = 0; i + 16 <= px_cnt; i += 16) {
+        uint8x16x4_t v = vld4q_u8((const uint8_t *)&src[i]);
+        uint8x16x3_t o;
+        o.val[0] = v.val[0];
+        o.val[1] = v.val[1];
+        o.val[2] = v.val[2];
+        vst3q_u8(dst + i * 3, o);
+    }
+
+    conv_32_to_24(dst + i * 3, src + i, px_cnt - i, fmt);
+}
+#endif
+
+/*-----------------------
+ * 16 bpp (RGB565)
+ *----------------------*/
+static void conv_32_to_565(uint8_t * dst, const lv_color_t * src, uint32_t px_cnt, const fbdev_px_format_t * fmt)
+{
+    LV_UNUSED(fmt);
+    uint32_t i;
+    for(i = 0; i < px_cnt; i++) {
+        uint32_t c = src[i].full;
+        uint16_t p = ((c >> 8) & 0xF800) | ((c >> 5) & 0x07E0) | ((c >> 3) & 0x001F);
+        memcpy(dst, &p, 2);
+        dst += 2;
+    }
+}
+
+#if defined(__SSE2__)
+static inline __m128i pack_565_sse2(__m128i v)
+{
+    __m128i r = _mm_and_si128(_mm_srli_epi32(v, 8), _mm_set1_epi32(0xF800));
+    __m128i g = _mm_and_si128(_mm_srli_epi32(v, 5), _mm_set1_epi32(0x07E0));
+    __m128i b = _mm_and_si128(_mm_srli_epi32(v, 3), _mm_set1_epi32(0x001F));
+    v = _mm_or_si128(r, _mm_or_si128(g, b));
+    /*Sign extend so the signed saturation of the pack keeps the bits*/
+    return _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+}
+
+static void conv_32_to_565_sse2(uint8_t * dst, const lv_color_t * src, uint32_t px_cnt, const fbdev_px_format_t * fmt)
+{
+    uint32_t i;
+    for(i = 0; i + 8 <= px_cnt; i += 8) {
+        __m128i v0 = pack_565_sse2(_mm_loadu_si128((const __m128i *)&src[i]));
+        __m128i v1 = pack_565_sse2(_mm_loadu_si128((const __m128i *)&src[i + 4]));
+        _mm_storeu_si128((__m128i *)(dst + i * 2), _mm_packs_epi32(v0, v1));
+    }
+
+    conv_32_to_565(dst + i * 2, src + i, px_cnt - i, fmt);
+}
+#endif
+
+#if FBDEV_BLIT_AVX2
+FBDEV_AVX2_FUNC
+static inline __m256i pack_565_avx2(__m256i v)
+{
+    __m256i r = _mm256_and_si256(_mm256_srli_epi32(v, 8), _mm256_set1_epi32(0xF800));
+    __m256i g = _mm256_and_si256(_mm256_srli_epi32(v, 5), _mm256_set1_epi32(0x07E0));
+    __m256i b = _mm256_and_si256(_mm256_srli_epi32(v, 3), _mm256_set1_epi32(0x001F));
+    v = _mm256_or_si256(r, _mm256_or_si256(g, b));
+    return _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16);
+}
+
+FBDEV_AVX2_FUNC
+static void conv_32_to_565_avx2(uint8_t * dst, const lv_color_t * src, uint32_t px_cnt, const fbdev_px_format_t * fmt)
+{
+    uint32_t i;
+    for(i = 0; i + 16 <= px_cnt; i += 16) {
+        __m256i v0 = pack_565_avx2(_mm256_loadu_si256((const __m256i *)&src[i]));
+        __m256i v1 = pack_565_avx2(_mm256_loadu_si256((const __m256i *)&src[i + 8]));
+        /*The pack works per 128 bit lane: restore the order of the 64 bit blocks*/
+        __m256i v = _mm256_permute4x64_epi64(_mm256_packs_epi32(v0, v1), 0xD8);
+        _mm256_storeu_si256((__m256i *)(dst + i * 2), v);
+    }
+
+    conv_32_to_565(dst + i * 2, src + i, px_cnt - i, fmt);
+}
+#endif
+
+#if FBDEV_BLIT_NEON
+static inline uint16x8_t pack_565_neon(uint8x8_t r, uint8x8_t g, uint8x8_t b)
+{
+    uint16x8_t p = vshll_n_u8(r, 8);
+    p = vsriq_n_u16(p, vshll_n_u8(g, 8), 5);
+    return vsriq_n_u16(p, vshll_n_u8(b, 8), 11);
+}
+
+static void conv_32_to_565_neon(uint8_t * dst, const lv_color_t * src, uint32_t px_cnt, const fbdev_px_format_t * fmt)
+{
+    uint32_t i;
+    for(i = 0; i + 16 <= px_cnt; i += 16) {
+        uint8x16x4_t v = vld4q_u8((const uint8_t *)&src[i]);
+        uint16x8_t lo = pack_565_neon(vget_low_u8(v.val[2]), vget_low_u8(v.val[1]), vget_low_u8(v.val[0]));
+        uint16x8_t hi = pack_565_neon(vget_high_u8(v.val[2]), vget_high_u8(v.val[1]), vget_high_u8(v.val[0]));
+        vst1q_u16((uint16_t *)(dst + i * 2), lo);
+        vst1q_u16((uint16_t *)(dst + i * 2 + 16), hi);
+    }
+
+    conv_32_to_565(dst + i * 2, src + i, px_cnt - i, fmt);
+}
+#endif
+
+#endif /*LV_COLOR_DEPTH == 32*/
+
+/*=====================================
+ * LV_COLOR_DEPTH 16 (RGB565)
+ *====================================*/
+#if LV_COLOR_DEPTH == 16 && LV_COLOR_16_SWAP == 0
+
+/*-----------------------
+ * 32 bpp (XRGB8888)
+ *----------------------*/
+static void conv_565_to_32(uint8_t * dst, const lv_color_t * src, uint32_t px_cnt, const fbdev_px_format_t * fmt)
+{
+    LV_UNUSED(fmt);
+    uint32_t i;
+    for(i = 0; i < px_cnt; i++) {
+        uint32_t p = src[i].full;
+        uint32_t r = ((p >> 8) & 0xF8) | (p >> 13);
+        uint32_t g = ((p >> 3) & 0xFC) | ((p >> 9) & 0x03);
+        uint32_t b = ((p << 3) & 0xF8) | ((p >> 2) & 0x07);
+        uint32_t c = 0xFF000000 | (r << 16) | (g << 8) | b;
+        memcpy(dst, &c, 4);
+        dst += 4;
+    }
+}
+
+#if defined(__SSE2__)
+static void conv_565_to_32_sse2(uint8_t * dst, const lv_color_t * src, uint32_t px_cnt, const fbdev_px_format_t * fmt)
+{
+    const __m128i m_f8 = _mm_set1_epi16(0xF8);
+    const __m128i m_fc = _mm_set1_epi16(0xFC);
+    const __m128i m_03 = _mm_set1_epi16(0x03);
+    const __m128i m_07 = _mm_set1_epi16(0x07);
+    const __m128i alpha = _mm_set1_epi16((short)0xFF00);
+    uint32_t i;
+    for(i = 0; i + 8 <= px_cnt; i += 8) {
+        __m128i p = _mm_loadu_si128((const __m128i *)&src[i]);
+        __m128i r = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(p, 8), m_f8), _mm_srli_epi16(p, 13));
+        __m128i g = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(p, 3), m_fc), _mm_and_si128(_mm_srli_epi16(p, 9), m_03));
+        __m128i b = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(p, 3), m_f8), _mm_and_si128(_mm_srli_epi16(p, 2), m_07));
+        __m128i gb = _mm_or_si128(_mm_slli_epi16(g, 8), b);
+        __m128i ar = _mm_or_si128(alpha, r);
+        _mm_storeu_si128((__m128i *)(dst + i * 4), _mm_unpacklo_epi16(gb, ar));
+        _mm_storeu_si128((__m128i *)(dst + i * 4 + 16), _mm_unpackhi_epi16(gb, ar));
+    }
+
+    conv_565_to_32(dst + i * 4, src + i, px_cnt - i, fmt);
+}
+#endif
+
+#if FBDEV_BLIT_AVX2
+FBDEV_AVX2_FUNC
+static void conv_565_to_32_avx2(uint8_t * dst, const lv_color_t * src, uint32_t px_cnt, const fbdev_px_format_t * fmt)
+{
+    const __m256i m_f8 = _mm256_set1_epi16(0xF8);
+    const __m256i m_fc = _mm256_set1_epi16(0xFC);
+    const __m256i m_03 = _mm256_set1_epi16(0x03);
+    const __m256i m_07 = _mm256_set1_epi16(0x07);
+    const __m256i alpha = _mm256_set1_epi16((short)0xFF00);
+    uint32_t i;
+    for(i = 0; i + 16 <= px_cnt; i += 16) {
+        __m256i p = _mm256_loadu_si256((const __m256i *)&src[i]);
+        __m256i r = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(p, 8), m_f8), _mm256_srli_epi16(p, 13));
+        __m256i g = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(p, 3), m_fc),
+                                    _mm256_and_si256(_mm256_srli_epi16(p, 9), m_03));
+        __m256i b = _mm256_or_si256(_mm256_and_si256(_mm256_slli_epi16(p, 3), m_f8),
+                                    _mm256_and_si256(_mm256_srli_epi16(p, 2), m_07));
+        __m256i gb = _mm256_or_si256(_mm256_slli_epi16(g, 8), b);
+        __m256i ar = _mm256_or_si256(alpha, r);
+        /*The unpacks work per 128 bit lane: pixels 0..3 + 8..11 and 4..7 + 12..15*/
+        __m256i lo = _mm256_unpacklo_epi16(gb, ar);
+        __m256i hi = _mm256_unpackhi_epi16(gb, ar);
+        _mm256_storeu_si256((__m256i *)(dst + i * 4), _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *)(dst + i * 4 + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+
+    conv_565_to_32(dst + i * 4, src + i, px_cnt - i, fmt);
+}
+#endif
+
+#if FBDEV_BLIT_NEON
+static void conv_565_to_32_neon(uint8_t * dst, const lv_color_t * src, uint32_t px_cnt, const fbdev_px_format_t * fmt)
+{
+    uint32_t i;
+    for(i = 0; i + 8 <= px_cnt; i += 8) {
+        uint16x8_t p = vld1q_u16((const uint16_t *)&src[i]);
+        uint8x8x4_t o;
+        uint8x8_t r = vand_u8(vshrn_n_u16(p, 8), vdup_n_u8(0xF8));
+        uint8x8_t g = vand_u8(vshrn_n_u16(p, 3), vdup_n_u8(0xFC));
+        uint8x8_t b = vmovn_u16(vshlq_n_u16(p, 3));
+        /*Replicate the high bits into the empty low bits*/
+        o.val[0] = vsri_n_u8(b, b, 5);
+        o.val[1] = vsri_n_u8(g, g, 6);
+        o.val[2] = vsri_n_u8(r, r, 5);
+        o.val[3] = vdup_n_u8(0xFF);
+        vst4_u8(dst + i * 4, o);
+    }
+
+    conv_565_to_32(dst + i * 4, src + i, px_cnt - i, fmt);
+}
+#endif
+
+#endif /*LV_COLOR_DEPTH == 16 && LV_COLOR_16_SWAP == 0*/
+
+fbdev_conv_cb_t fbdev_blit_get_conv(const fbdev_px_format_t * fmt, const char ** name)
+{
+    const char * dummy_name;
+    if(name == NULL) name = &dummy_name;
+
+#if FBDEV_BLIT_AVX2
+    bool avx2 = cpu_has_avx2();
+    LV_UNUSED(avx2);
+#endif
+
+#if LV_COLOR_DEPTH == 32
+    if(fmt_is(fmt, 32, 16, 8, 0)) {
+        *name = "memcpy";
+        return NULL;
+    }
+
+    if(fmt_is(fmt, 32, 0, 8, 16)) {
+#if FBDEV_BLIT_NEON
+        *name = "XRGB8888 to XBGR8888 (NEON)";
+        return conv_32_swap_rb_neon;
+#else
+#if FBDEV_BLIT_AVX2
+        if(avx2) {
+            *name = "XRGB8888 to XBGR8888 (AVX2)";
+            return conv_32_swap_rb_avx2;
+        }
+#endif
+#if defined(__SSE2__)
+        *name = "XRGB8888 to XBGR8888 (SSE2)";
+        return conv_32_swap_rb_sse2;
+#else
+        *name = "XRGB8888 to XBGR8888";
+        return conv_32_swap_rb;
+#endif
+#endif
+    }
+
+    if(fmt_is(fmt, 24, 16, 8, 0)) {
+#if FBDEV_BLIT_NEON
+        *name = "XRGB8888 to RGB888 (NEON)";
+        return conv_32_to_24_neon;
+#else
+#if FBDEV_BLIT_AVX2
+        if(avx2) {
+            *name = "XRGB8888 to RGB888 (AVX2)";
+            return conv_32_to_24_avx2;
+        }
+#endif
+        *name = "XRGB8888 to RGB888";
+        return conv_32_to_24;
+#endif
+    }
+
+    if(fmt_is(fmt, 16, 11, 5, 0)) {
+#if FBDEV_BLIT_NEON
+        *name = "XRGB8888 to RGB565 (NEON)";
+        return conv_32_to_565_neon;
+#else
+#if FBDEV_BLIT_AVX2
+        if(avx2) {
+            *name = "XRGB8888 to RGB565 (AVX2)";
+            return conv_32_to_565_avx2;
+        }
+#endif
+#if defined(__SSE2__)
+        *name = "XRGB8888 to RGB565 (SSE2)";
+        return conv_32_to_565_sse2;
+#else
+        *name = "XRGB8888 to RGB565";
+        return conv_32_to_565;
+#endif
+#endif
+    }
+#elif LV_COLOR_DEPTH == 16 && LV_COLOR_16_SWAP == 0
+    if(fmt_is(fmt, 16, 11, 5, 0)) {
+        *name = "memcpy";
+        return NULL;
+    }
+
+    if(fmt_is(fmt, 32, 16, 8, 0)) {
+#if FBDEV_BLIT_NEON
+        *name = "RGB565 to XRGB8888 (NEON)";
+        return conv_565_to_32_neon;
+#else
+#if FBDEV_BLIT_AVX2
+        if(avx2) {
+            *name = "RGB565 to XRGB8888 (AVX2)";
+            return conv_565_to_32_avx2;
+        }
+#endif
+#if defined(__SSE2__)
+        *name = "RGB565 to XRGB8888 (SSE2)";
+        return conv_565_to_32_sse2;
+#else
+        *name = "RGB565 to XRGB8888";
+        return conv_565_to_32;
+#endif
+#endif
+    }
+#endif
+
+    /*Any other RGB layout: slow, but correct*/
+    if((fmt->bpp == 16 || fmt->bpp == 24 || fmt->bpp == 32) &&
+       fmt->red_length && fmt->green_length && fmt->blue_length) {
+        *name = "generic";
+        return conv_generic;
+    }
+
+    *name = "memcpy";
+    return NULL;
+}
+
+void fbdev_blit_read(lv_color_t * dst, const uint8_t * src, uint32_t px_cnt, const fbdev_px_format_t * fmt)
+{
+    /*Same format*/
+    if(fmt->bpp == LV_COLOR_DEPTH && fbdev_blit_get_conv(fmt, NULL) == NULL) {
+        memcpy(dst, src, px_cnt * sizeof(lv_color_t));
+        return;
+    }
+
+    uint32_t px_size = fmt->bpp / 8;
+    uint32_t i;
+    for(i = 0; i < px_cnt; i++) {
+        uint32_t p = 0;
+        uint32_t b;
+        for(b = 0; b < px_size; b++) {
+            p |= (uint32_t)src[b] << (b * 8);
+        }
+        dst[i] = lv_color_make(read_channel(p, fmt->red_offset, fmt->red_length),
+                               read_channel(p, fmt->green_offset, fmt->green_length),
+                               read_channel(p, fmt->blue_offset, fmt->blue_length));
+        src += px_size;
+    }
+}
+
+void fbdev_blit_rotate(uint8_t * dst, int32_t dst_stride, const lv_color_t * src, int32_t src_stride,
+                       int32_t w, int32_t h, lv_disp_rot_t rot)
+{
+    if(rot == LV_DISP_ROT_NONE) {
+        int32_t j;
+        for(j = 0; j < h; j++) {
+            memcpy(dst + j * dst_stride, src + j * src_stride, w * sizeof(lv_color_t));
+        }
+        return;
+    }
+
+    if(rot == LV_DISP_ROT_180) {
+        rotate_180(dst, dst_stride, src, src_stride, w, h);
+        return;
+    }
+
+    int32_t i0;
+    int32_t j0;
+    for(j0 = 0; j0 < h; j0 += ROT_TILE) {
+        for(i0 = 0; i0 < w; i0 += ROT_TILE) {
+            rotate_tile(dst, dst_stride, src, src_stride, i0, j0,
+                        LV_MIN(ROT_TILE, w - i0), LV_MIN(ROT_TILE, h - j0), w, h, rot);
+        }
+    }
+}
+
+fbdev_copy_cb_t fbdev_blit_select_copy(uint8_t * fb, uint32_t size, const char ** name)
+{
+    const char * dummy_name;
+    if(name == NULL) name = &dummy_name;
+    *name = "memcpy";
+
+#if FBDEV_BLIT_STREAM
+    /*Write back the current content so the screen doesn't change*/
+    uint8_t * buf = malloc(size);
+    if(buf == NULL) return NULL;
+    memcpy(buf, fb, size);
+
+    uint64_t memcpy_ns = copy_bench(copy_memcpy, fb, buf, size);
+    uint64_t stream_ns = copy_bench(copy_stream, fb, buf, size);
+    free(buf);
+
+    if(stream_ns < memcpy_ns) {
+#if defined(__SSE2__)
+        *name = "streaming stores (MOVNTDQ)";
+#else
+        *name = "streaming stores (STNP)";
+#endif
+        return copy_stream;
+    }
+#else
+    LV_UNUSED(fb);
+    LV_UNUSED(size);
+#endif
+
+    return NULL;
+}
+
+/**********************
+ *   STATIC FUNCTIONS
+ **********************/
+
+/*=====================================
+ * Streaming copy
+ *====================================*/
+#if FBDEV_BLIT_STREAM
+/**
+ * Copy with non-temporal stores which write whole lines to the memory
+ * without reading them into the cache first
+ */
+static void copy_stream(uint8_t * dst, const uint8_t * src, uint32_t size)
+{
+    /*Align the destination to 16 bytes*/
+    uint32_t head = (16 - ((uintptr_t)dst & 15)) & 15;
+    if(head > size) head = size;
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    size -= head;
+
+#if defined(__SSE2__)
+    for(; size >= 64; size -= 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)src);
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(src + 48));
+        _mm_stream_si128((__m128i *)dst, a);
+        _mm_stream_si128((__m128i *)(dst + 16), b);
+        _mm_stream_si128((__m128i *)(dst + 32), c);
+        _mm_stream_si128((__m128i *)(dst + 48), d);
+        src += 64;
+        dst += 64;
+    }
+    for(; size >= 16; size -= 16) {
+        _mm_stream_si128((__m128i *)dst, _mm_loadu_si128((const __m128i *)src));
+        src += 16;
+        dst += 16;
+    }
+    /*Order the streaming stores before anything that follows (e.g. panning)*/
+    _mm_sfence();
+#else
+    for(; size >= 64; size -= 64) {
+        uint8x16_t a = vld1q_u8(src);
+        uint8x16_t b = vld1q_u8(src + 16);
+        uint8x16_t c = vld1q_u8(src + 32);
+        uint8x16_t d = vld1q_u8(src + 48);
+        __asm__ volatile("stnp %q1, %q2, [%0]\n\t"
+                         "stnp %q3, %q4, [%0, #32]"
+                         : : "r"(dst), "w"(a), "w"(b), "w"(c), "w"(d) : "memory");
+        src += 64;
+        dst += 64;
+    }
+#endif
+
+    memcpy(dst, src, size);
+}
+
+static void copy_memcpy(uint8_t * dst, const uint8_t * src, uint32_t size)
+{
+    memcpy(dst, src, size);
+}
+
+/**
+ * Measure a copy method
+ * @return the best time of `COPY_BENCH_CNT` copies in nanoseconds
+ */
+static uint64_t copy_bench(fbdev_copy_cb_t copy_cb, uint8_t * dst, const uint8_t * src, uint32_t size)
+{
+    uint64_t best = UINT64_MAX;
+    uint32_t i;
+    for(i = 0; i < COPY_BENCH_CNT; i++) {
+        struct timespec t1;
+        struct timespec t2;
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        copy_cb(dst, src, size);
+        clock_gettime(CLOCK_MONOTONIC, &t2);
+        uint64_t ns = (uint64_t)(t2.tv_sec - t1.tv_sec) * 1000000000 + t2.tv_nsec - t1.tv_nsec;
+        if(ns < best) best = ns;
+    }
+    return best;
+}
+#endif /*FBDEV_BLIT_STREAM*/
+
+/*=====================================
+ * Rotation
+ *====================================*/
+
+/* Pixel (i, j) of the w x h source goes to
+ *  - 90 degrees:  (j, w - 1 - i)
+ *  - 270 degrees: (h - 1 - j, i)
+ * of the destination. SIMD kernels transpose K x K blocks (K pixels in a register);
+ * a transposed column is a destination row, reversed for 270 degrees.*/
+
+#if LV_COLOR_DEPTH == 32
+#define ROT_K   4
+#if defined(__SSE2__)
+#define ROT_SIMD 1
+static inline void rot_block(uint8_t * dst, int32_t dst_stride, const lv_color_t * src, int32_t src_stride,
+                             lv_disp_rot_t rot)
+{
+    __m128i r0 = _mm_loadu_si128((const __m128i *)(src));
+    __m128i r1 = _mm_loadu_si128((const __m128i *)(src + src_stride));
+    __m128i r2 = _mm_loadu_si128((const __m128i *)(src + 2 * src_stride));
+    __m128i r3 = _mm_loadu_si128((const __m128i *)(src + 3 * src_stride));
+    __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+    __m128i t1 = _mm_unpacklo_epi32(r2, r3);
+    __m128i t2 = _mm_unpackhi_epi32(r0, r1);
+    __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+    __m128i c[4];
+    c[0] = _mm_unpacklo_epi64(t0, t1);
+    c[1] = _mm_unpackhi_epi64(t0, t1);
+    c[2] = _mm_unpacklo_epi64(t2, t3);
+    c[3] = _mm_unpackhi_epi64(t2, t3);
+
+    int32_t k;
+    for(k = 0; k < 4; k++) {
+        if(rot == LV_DISP_ROT_90) {
+            _mm_storeu_si128((__m128i *)(dst + (3 - k) * dst_stride), c[k]);
+        }
+        else {
+            _mm_storeu_si128((__m128i *)(dst + k * dst_stride), _mm_shuffle_epi32(c[k], 0x1B));
+        }
+    }
+}
+#elif FBDEV_BLIT_NEON
+#define ROT_SIMD 1
+static inline void rot_block(uint8_t * dst, int32_t dst_stride, const lv_color_t * src, int32_t src_stride,
+                             lv_disp_rot_t rot)
+{
+    uint32x4x2_t t01 = vtrnq_u32(vld1q_u32((const uint32_t *)src), vld1q_u32((const uint32_t *)(src + src_stride)));
+    uint32x4x2_t t23 = vtrnq_u32(vld1q_u32((const uint32_t *)(src + 2 * src_stride)),
+                                 vld1q_u32((const uint32_t *)(src + 3 * src_stride)));
+    uint32x4_t c[4];
+    c[0] = vcombine_u32(vget_low_u32(t01.val[0]), vget_low_u32(t23.val[0]));
+    c[1] = vcombine_u32(vget_low_u32(t01.val[1]), vget_low_u32(t23.val[1]));
+    c[2] = vcombine_u32(vget_high_u32(t01.val[0]), vget_high_u32(t23.val[0]));
+    c[3] = vcombine_u32(vget_high_u32(t01.val[1]), vget_high_u32(t23.val[1]));
+
+    int32_t k;
+    for(k = 0; k < 4; k++) {
+        if(rot == LV_DISP_ROT_90) {
+            vst1q_u32((uint32_t *)(dst + (3 - k) * dst_stride), c[k]);
+        }
+        else {
+            uint32x4_t r = vrev64q_u32(c[k]);
+            vst1q_u32((uint32_t *)(dst + k * dst_stride), vcombine_u32(vget_high_u32(r), vget_low_u32(r)));
+        }
+    }
+}
+#endif
+#elif LV_COLOR_DEPTH == 16
+#define ROT_K   8
+#if defined(__SSE2__)
+#define ROT_SIMD 1
+static inline void rot_block(uint8_t * dst, int32_t dst_stride, const lv_color_t * src, int32_t src_stride,
+                             lv_disp_rot_t rot)
+{
+    __m128i r[8];
+    int32_t k;
+    for(k = 0; k < 8; k++) r[k] = _mm_loadu_si128((const __m128i *)(src + k * src_stride));
+
+    __m128i a0 = _mm_unpacklo_epi16(r[0], r[1]);
+    __m128i a1 = _mm_unpacklo_epi16(r[2], r[3]);
+    __m128i a2 = _mm_unpacklo_epi16(r[4], r[5]);
+    __m128i a3 = _mm_unpacklo_epi16(r[6], r[7]);
+    __m128i a4 = _mm_unpackhi_epi16(r[0], r[1]);
+    __m128i a5 = _mm_unpackhi_epi16(r[2], r[3]);
+    __m128i a6 = _mm_unpackhi_epi16(r[4], r[5]);
+    __m128i a7 = _mm_unpackhi_epi16(r[6], r[7]);
+    __m128i b0 = _mm_unpacklo_epi32(a0, a1);
+    __m128i b1 = _mm_unpacklo_epi32(a2, a3);
+    __m128i b2 = _mm_unpackhi_epi32(a0, a1);
+    __m128i b3 = _mm_unpackhi_epi32(a2, a3);
+    __m128i b4 = _mm_unpacklo_epi32(a4, a5);
+    __m128i b5 = _mm_unpacklo_epi32(a6, a7);
+    __m128i b6 = _mm_unpackhi_epi32(a4, a5);
+    __m128i b7 = _mm_unpackhi_epi32(a6, a7);
+    __m128i c[8];
+    c[0] = _mm_unpacklo_epi64(b0, b1);
+    c[1] = _mm_unpackhi_epi64(b0, b1);
+    c[2] = _mm_unpacklo_epi64(b2, b3);
+    c[3] = _mm_unpackhi_epi64(b2, b3);
+    c[4] = _mm_unpacklo_epi64(b4, b5);
+    c[5] = _mm_unpackhi_epi64(b4, b5);
+    c[6] = _mm_unpacklo_epi64(b6, b7);
+    c[7] = _mm_unpackhi_epi64(b6, b7);
+
+    for(k = 0; k < 8; k++) {
+        if(rot == LV_DISP_ROT_90) {
+            _mm_storeu_si128((__m128i *)(dst + (7 - k) * dst_stride), c[k]);
+        }
+        else {
+            __m128i v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(c[k], 0x1B), 0x1B);
+            _mm_storeu_si128((__m128i *)(dst + k * dst_stride), _mm_shuffle_epi32(v, 0x4E));
+        }
+    }
+}
+#elif FBDEV_BLIT_NEON
+#define ROT_SIMD 1
+static inline void rot_block(uint8_t * dst, int32_t dst_stride, const lv_color_t * src, int32_t src_stride,
+                             lv_disp_rot_t rot)
+{
+    uint16x8_t r[8];
+    int32_t k;
+    for(k = 0; k < 8; k++) r[k] = vld1q_u16((const uint16_t *)(src + k * src_stride));
+
+    uint16x8x2_t t0 = vtrnq_u16(r[0], r[1]);
+    uint16x8x2_t t1 = vtrnq_u16(r[2], r[3]);
+    uint16x8x2_t t2 = vtrnq_u16(r[4], r[5]);
+    uint16x8x2_t t3 = vtrnq_u16(r[6], r[7]);
+    uint32x4x2_t u0 = vtrnq_u32(vreinterpretq_u32_u16(t0.val[0]), vreinterpretq_u32_u16(t1.val[0]));
+    uint32x4x2_t u1 = vtrnq_u32(vreinterpretq_u32_u16(t0.val[1]), vreinterpretq_u32_u16(t1.val[1]));
+    uint32x4x2_t u2 = vtrnq_u32(vreinterpretq_u32_u16(t2.val[0]), vreinterpretq_u32_u16(t3.val[0]));
+    uint32x4x2_t u3 = vtrnq_u32(vreinterpretq_u32_u16(t2.val[1]), vreinterpretq_u32_u16(t3.val[1]));
+    uint32x4_t c[8];
+    c[0] = vcombine_u32(vget_low_u32(u0.val[0]), vget_low_u32(u2.val[0]));
+    c[1] = vcombine_u32(vget_low_u32(u1.val[0]), vget_low_u32(u3.val[0]));
+    c[2] = vcombine_u32(vget_low_u32(u0.val[1]), vget_low_u32(u2.val[1]));
+    c[3] = vcombine_u32(vget_low_u32(u1.val[1]), vget_low_u32(u3.val[1]));
+    c[4] = vcombine_u32(vget_high_u32(u0.val[0]), vget_high_u32(u2.val[0]));
+    c[5] = vcombine_u32(vget_high_u32(u1.val[0]), vget_high_u32(u3.val[0]));
+    c[6] = vcombine_u32(vget_high_u32(u0.val[1]), vget_high_u32(u2.val[1]));
+    c[7] = vcombine_u32(vget_high_u32(u1.val[1]), vget_high_u32(u3.val[1]));
+
+    for(k = 0; k < 8; k++) {
+        uint16x8_t v = vreinterpretq_u16_u32(c[k]);
+        if(rot == LV_DISP_ROT_90) {
+            vst1q_u16((uint16_t *)(dst + (7 - k) * dst_stride), v);
+        }
+        else {
+            v = vrev64q_u16(v);
+            vst1q_u16((uint16_t *)(dst + k * dst_stride), vcombine_u16(vget_high_u16(v), vget_low_u16(v)));
+        }
+    }
+}
+#endif
+#endif /*LV_COLOR_DEPTH*/
+
+/**
+ * Rotate the tw x th tile at (i0, j0) of the w x h source by 90 or 270 degrees
+ */
+static void rotate_tile(uint8_t * dst, int32_t dst_stride, const lv_color_t * src, int32_t src_stride,
+                        int32_t i0, int32_t j0, int32_t tw, int32_t th, int32_t w, int32_t h, lv_disp_rot_t rot)
+{
+    int32_t i;
+    int32_t j;
+    int32_t done_w = 0;
+    int32_t done_h = 0;
+
+#ifdef ROT_SIMD
+    /*Whole K x K blocks*/
+    done_w = tw - tw % ROT_K;
+    done_h = th - th % ROT_K;
+    for(j = j0; j < j0 + done_h; j += ROT_K) {
+        for(i = i0; i < i0 + done_w; i += ROT_K) {
+            /*Top left corner of the rotated block*/
+            int32_t dx = rot == LV_DISP_ROT_90 ? j : h - j - ROT_K;
+            int32_t dy = rot == LV_DISP_ROT_90 ? w - i - ROT_K : i;
+            rot_block(dst + dy * dst_stride + dx * sizeof(lv_color_t), dst_stride,
+                      src + j * src_stride + i, src_stride, rot);
+        }
+    }
+#endif
+
+    /*Remaining pixels on the right and bottom edges of the tile one by one.
+     *Loop on the destination rows to write consecutive addresses.*/
+    for(i = i0; i < i0 + tw; i++) {
+        int32_t dy = rot == LV_DISP_ROT_90 ? w - 1 - i : i;
+        lv_color_t * d = (lv_color_t *)(dst + dy * dst_stride);
+        for(j = i < i0 + done_w ? j0 + done_h : j0; j < j0 + th; j++) {
+            int32_t dx = rot == LV_DISP_ROT_90 ? j : h - 1 - j;
+            d[dx] = src[j * src_stride + i];
+        }
+    }
+}
+
+static void rotate_180(uint8_t * dst, int32_t dst_stride, const lv_color_t * src, int32_t src_stride,
+                       int32_t w, int32_t h)
+{
+    int32_t i;
+    int32_t j;
+    for(j = 0; j < h; j++) {
+        lv_color_t * d = (lv_color_t *)(dst + (h - 1 - j) * dst_stride) + w - 1;
+        const lv_color_t * s = src + j * src_stride;
+        for(i = 0; i < w; i++) {
+            *d = s[i];
+            d--;
+        }
+    }
+}
+
+/*=====================================
+ * Conversion
+ *====================================*/
+
+/**
+ * Scale an 8 bit channel to `len` bits
+ */
+static inline uint32_t scale_channel(uint32_t v, uint8_t len)
+{
+    if(len <= 8) return v >> (8 - len);
+    else return (v << (len - 8)) | (v >> (16 - len));
+}
+
+/**
+ * Get a `len` bit channel of a pixel scaled to 8 bits
+ */
+static inline uint8_t read_channel(uint32_t px, uint8_t offset, uint8_t len)
+{
+    if(len == 0) return 0;
+    uint32_t v = (px >> offset) & ((1UL << len) - 1);
+    if(len >= 8) return v >> (len - 8);
+    /*Repeat the bits to map the max. value to 255*/
+    v <<= 8 - len;
+    while(len < 8) {
+        v |= v >> len;
+        len *= 2;
+    }
+    return v;
+}
+
+static void conv_generic(uint8_t * dst, const lv_color_t * src, uint32_t px_cnt, const fbdev_px_format_t * fmt)
+{
+    uint32_t px_size = fmt->bpp / 8;
+    uint32_t i;
+    for(i = 0; i < px_cnt; i++) {
+        uint32_t c = lv_color_to32(src[i]);
+        uint32_t p = (scale_channel((c >> 16) & 0xFF, fmt->red_length) << fmt->red_offset) |
+                     (scale_channel((c >> 8) & 0xFF, fmt->green_length) << fmt->green_offset) |
+                     (scale_channel(c & 0xFF, fmt->blue_length) << fmt->blue_offset);
+        /*Opaque if there is an alpha channel*/
+        if(fmt->transp_length) p |= ((1UL << fmt->transp_length) - 1) << fmt->transp_offset;
+        uint32_t b;
+        for(b = 0; b < px_size; b++) {
+            dst[b] = p >> (b * 8);
+        }
+        dst += px_size;
+    }
+}
+
+static bool fmt_is(const fbdev_px_format_t * fmt, uint8_t bpp, uint8_t r_ofs, uint8_t g_ofs, uint8_t b_ofs)
+{
+    /*16 bpp means 5-6-5, else 8 bit channels*/
+    uint8_t rb_len = bpp == 16 ? 5 : 8;
+    uint8_t g_len = bpp == 16 ? 6 : 8;
+
+    return fmt->bpp == bpp &&
+           fmt->red_offset == r_ofs && fmt->red_length == rb_len &&
+           fmt->green_offset == g_ofs && fmt->green_length == g_len &&
+           fmt->blue_offset == b_ofs && fmt->blue_length == rb_len;
+}
+
+#if FBDEV_BLIT_AVX2
+static bool cpu_has_avx2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+#endif /*USE_FBDEV || USE_BSD_FBDEV*/
@@ -0,0 +1,107 @@
+/**
+ * @file fbdev_blit.h
+ * Pixel copy and conversion kernels of the frame buffer driver
+ */
+
+#ifndef FBDEV_BLIT_H
+#define FBDEV_BLIT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*********************
+ *      INCLUDES
+ *********************/
+#include "fbdev.h"
+
+#if USE_FBDEV || USE_BSD_FBDEV
+
+/*********************
+ *      DEFINES
+ *********************/
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+/*Pixel layout of the frame buffer (offsets and lengths of the channels in bits)*/
+typedef struct {
+    uint8_t bpp;
+    uint8_t red_offset;
+    uint8_t red_length;
+    uint8_t green_offset;
+    uint8_t green_length;
+    uint8_t blue_offset;
+    uint8_t blue_length;
+    uint8_t transp_offset;
+    uint8_t transp_length;
+} fbdev_px_format_t;
+
+/*Copy `size` bytes to the frame buffer*/
+typedef void (*fbdev_copy_cb_t)(uint8_t * dst, const uint8_t * src, uint32_t size);
+
+/*Convert `px_cnt` LVGL pixels to the frame buffer's format*/
+typedef void (*fbdev_conv_cb_t)(uint8_t * dst, const lv_color_t * src, uint32_t px_cnt,
+                                const fbdev_px_format_t * fmt);
+
+/**********************
+ * GLOBAL PROTOTYPES
+ **********************/
+
+/**
+ * Select the fastest conversion from `lv_color_t` to a frame buffer format
+ * for the CPU the program runs on.
+ * @param fmt pixel format of the frame buffer
+ * @param name if not NULL the name of the selected kernel is stored here
+ * @return the conversion function or NULL if `lv_color_t` can be copied as it is
+ *         (or the format is not an RGB format with 16, 24 or 32 bpp)
+ */
+fbdev_conv_cb_t fbdev_blit_get_conv(const fbdev_px_format_t * fmt, const char ** name);
+
+/**
+ * Read pixels of the frame buffer as `lv_color_t` (the reverse of the conversion).
+ * Formats without channel bitfields are read as black.
+ * @param dst store the pixels here
+ * @param src pixels of the frame buffer
+ * @param px_cnt number of pixels
+ * @param fmt pixel format of the frame buffer
+ */
+void fbdev_blit_read(lv_color_t * dst, const uint8_t * src, uint32_t px_cnt, const fbdev_px_format_t * fmt);
+
+/**
+ * Copy a block of `lv_color_t` pixels rotated. The block is processed in cache
+ * friendly tiles, 90 and 270 degrees are transposed with SIMD where available.
+ * Rotation is done the same way as LVGL's `sw_rotate`.
+ * @param dst top left pixel of the rotated block in the destination (h x w for 90 and 270 degrees)
+ * @param dst_stride distance of two rows in `dst` in bytes
+ * @param src top left pixel of the w x h block to rotate
+ * @param src_stride distance of two rows in `src` in pixels
+ * @param w width of the source block
+ * @param h height of the source block
+ * @param rot rotation
+ */
+void fbdev_blit_rotate(uint8_t * dst, int32_t dst_stride, const lv_color_t * src, int32_t src_stride,
+                       int32_t w, int32_t h, lv_disp_rot_t rot);
+
+/**
+ * Measure how fast `memcpy` and non-temporal (streaming) stores write to the frame buffer
+ * memory and select the faster one. Streaming stores bypass the cache, which pays off
+ * on write-combined or uncached mappings. The content of the memory is preserved.
+ * @param fb the mapped frame buffer memory
+ * @param size number of bytes of `fb` to use for the measurement
+ * @param name if not NULL the name of the selected method is stored here
+ * @return the streaming copy function or NULL if `memcpy` is faster (or no streaming stores are available)
+ */
+fbdev_copy_cb_t fbdev_blit_select_copy(uint8_t * fb, uint32_t size, const char ** name);
+
+/**********************
+ *      MACROS
+ **********************/
+
+#endif  /*USE_FBDEV || USE_BSD_FBDEV*/
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /*FBDEV_BLIT_H*/
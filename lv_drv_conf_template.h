@@ -277,6 +277,47 @@
 
 #if USE_FBDEV
 #  define FBDEV_PATH          "/dev/fb0"
+
+/* Render into a hidden page of a 2 x yres virtual screen and flip it
+ * with FBIOPAN_DISPLAY on the last flush of a refresh (tear-free) */
+#  define FBDEV_DOUBLE_BUFFER 0
+
+/* Align the refreshes to the vertical blanking (FBIO_WAITFORVSYNC or a timer
+ * if the driver doesn't support it). See fbdev_get_frame_stats().
+ * Without a hidden page all areas of a refresh are written after one vblank
+ * only in direct mode with FBDEV_DIRECT_SHADOW, else just the first one */
+#  define FBDEV_VSYNC         0
+
+/* Let LVGL draw the whole screen in direct mode without a copy from a draw
+ * buffer. See fbdev_set_direct_render() */
+#  define FBDEV_DIRECT_RENDER 0
+
+/* In direct render mode draw into a system RAM copy of the screen and copy
+ * only the dirty areas to the frame buffer. Reading back from the frame buffer
+ * memory (while blending) is very slow on many SoCs */
+#  define FBDEV_DIRECT_SHADOW 1
+
+/* Dithering on 1 bpp frame buffers if LV_COLOR_DEPTH > 1
+ * 0: brightness threshold, 1: ordered (8x8 Bayer), 2: Floyd-Steinberg */
+#  define FBDEV_1BPP_DITHER   0
+
+/* Number of worker threads splitting large flushed areas into row stripes
+ * (0: copy on the calling thread only). Needs pthread. See fbdev_get_copy_stats() */
+#  define FBDEV_THREADS       0
+
+/* Areas with fewer pixels than this are copied on the calling thread */
+#  define FBDEV_THREAD_MIN_PX (128 * 1024)
+
+/* Measure at start up if non-temporal (streaming) stores write the frame buffer
+ * memory faster than memcpy and use them for rows of FBDEV_STREAM_MIN_ROW bytes or more */
+#  define FBDEV_STREAM_COPY   0
+#  define FBDEV_STREAM_MIN_ROW 256
+
+/* Don't clear the frame buffer at start up to keep the boot splash on the screen.
+ * With FBDEV_DIRECT_RENDER the splash is LVGL's initial screen content: make the screen
+ * and the display background (lv_disp_set_bg_opa()) transparent to draw over it.
+ * See `first_frame_us` in fbdev_get_frame_stats() */
+#  define FBDEV_FAST_BOOT     0
 #endif
 
 /*-----------------------------------------
@@ -299,7 +340,59 @@
 
 #if USE_DRM
 #  define DRM_CARD          "/dev/dri/card0"
-#  define DRM_CONNECTOR_ID  -1	/* -1 for the first connected one */
+#  define DRM_CONNECTOR_ID  -1	/* -1 for the first connected one(s) */
+
+/* Number of connected connectors to drive, each with its own CRTC and plane.
+ * Bind them to display drivers with drm_get_output() and drm_bind().
+ * Only with DRM_NONBLOCK are the refreshes of the displays gathered into one
+ * commit per vblank, else each display is committed at the end of its refresh */
+#  define DRM_OUTPUTS       1
+
+/* Mode to set, 0 matches any width, height or refresh rate (Hz).
+ * The preferred mode is used if none matches. A matching mode the CRTC runs
+ * already is kept without a modeset. See also drm_output_set_mode() */
+#  define DRM_MODE_WIDTH    0
+#  define DRM_MODE_HEIGHT   0
+#  define DRM_MODE_REFRESH  0
+
+/* Render at a lower resolution and let the plane scale it up to the mode's size,
+ * 0 for the mode's size. Falls back to it if the plane can't scale */
+#  define DRM_RENDER_WIDTH  0
+#  define DRM_RENDER_HEIGHT 0
+
+/* Commit with DRM_MODE_ATOMIC_NONBLOCK and handle the page flip events on a
+ * separate thread which calls lv_disp_flush_ready(). Needs pthread */
+#  define DRM_NONBLOCK      0
+
+/* Number of buffers in the swap chain (2..4). With more than 2 LVGL can render
+ * the next refresh while the previous ones wait for the vblank */
+#  define DRM_BUFFERS       2
+
+/* Let LVGL render into the dumb buffers with drm_set_direct_render(), nothing
+ * is copied on flush. Use 3 buffers to not wait for the vblank before rendering */
+#  define DRM_DIRECT_RENDER 0
+
+/* Number of overlay layers drm_layer_create() can make: overlay planes with
+ * their own buffers and LVGL display, blended over an output by the hardware */
+#  define DRM_LAYERS        0
+
+/* Show the mouse cursor with a cursor plane: drm_cursor_set_image() and
+ * drm_cursor_move() from the pointer's read_cb, no redraw when it moves */
+#  define DRM_CURSOR        0
+
+/* Share the buffers with other processes (e.g. screen recording) as dma-bufs:
+ * they and the buffer on the screen after each page flip are sent on a UNIX
+ * socket, see drm_export_msg_t. Needs PRIME support of the DRM driver */
+#  define DRM_EXPORT        0
+#  define DRM_EXPORT_SOCKET "/tmp/lv_drm.sock"
+
+/* Capture the screen with a writeback connector of the CRTC (e.g. vkms), see
+ * drm_output_capture(). Without one the captures read LVGL's pixels */
+#  define DRM_WRITEBACK     0
+
+/* Follow the connectors being unplugged and plugged in, an LVGL timer reads
+ * the kernel's uevents. See drm_set_hotplug_cb() */
+#  define DRM_HOTPLUG       0
 #endif
 
 /*********************